@@ -3,8 +3,10 @@
 
 #include <vector>
 #include <memory>
+#include <string>
 
 #include "imbatracer/core/traversal_interface.h"
+#include "imbatracer/core/traversal_native.h"
 #include "imbatracer/core/mesh.h"
 
 namespace imba {
@@ -13,6 +15,9 @@ class MeshAdapter {
 public:
     virtual ~MeshAdapter() {}
 
+    /// Spends up to the given time (in milliseconds) reducing the cost of the acceleration structure, before it is written.
+    void set_optimization_budget(float ms) { optimization_budget_ = ms; }
+
     /// Writes the acceleration structure for the given mesh
     /// sequentially in the array of nodes.
     virtual void build_accel(const Mesh& mesh, int mesh_id, const std::vector<int>& tri_layout) = 0;
@@ -20,12 +25,18 @@ public:
 #ifdef STATISTICS
     virtual void print_stats() const {};
 #endif
+
+protected:
+    float optimization_budget_ = 0.0f;
 };
 
 class TopLevelAdapter {
 public:
     virtual ~TopLevelAdapter() {}
 
+    /// Spends up to the given time (in milliseconds) reducing the cost of the acceleration structure, before it is written.
+    void set_optimization_budget(float ms) { optimization_budget_ = ms; }
+
     /// Writes the acceleration structure for the given mesh
     /// sequentially in the array of nodes.
     virtual void build_accel(const std::vector<Mesh>& meshes,
@@ -33,16 +44,36 @@ public:
                              const std::vector<int>& layout,
                              int root_offset) = 0;
 
+    /// Updates the bounds of the nodes and the transformations of the instance nodes written by build_accel,
+    /// after the instances have moved. Returns the SAH cost of the refitted acceleration structure, relative to the area of its root.
+    virtual float refit_accel(const std::vector<Mesh>& meshes,
+                              const std::vector<Mesh::Instance>& instances,
+                              int root_offset) = 0;
+
 #ifdef STATISTICS
     virtual void print_stats() const {};
 #endif
+
+protected:
+    float optimization_budget_ = 0.0f;
 };
 
 /// Returns the correct mesh acceleration structure adapter for the traversal implementation.
-std::unique_ptr<MeshAdapter> new_mesh_adapter_cpu(std::vector<traversal_cpu::Node>& nodes, std::vector<Vec4>& tris);
-std::unique_ptr<MeshAdapter> new_mesh_adapter_gpu(std::vector<traversal_gpu::Node>& nodes, std::vector<Vec4>& tris);
+/// With fast_build, a binned BVH is built instead of a SBVH, trading traversal speed for build time.
+std::unique_ptr<MeshAdapter> new_mesh_adapter_cpu(std::vector<traversal_cpu::Node>& nodes, std::vector<Vec4>& tris, bool fast_build = false);
+std::unique_ptr<MeshAdapter> new_mesh_adapter_cpu8(std::vector<traversal_native::Node8>& nodes, std::vector<Vec4>& tris, bool fast_build = false);
+std::unique_ptr<MeshAdapter> new_mesh_adapter_cpu4q(std::vector<traversal_native::QNode4>& nodes, std::vector<Vec4>& tris, bool fast_build = false);
+std::unique_ptr<MeshAdapter> new_mesh_adapter_gpu(std::vector<traversal_gpu::Node>& nodes, std::vector<Vec4>& tris, bool fast_build = false);
+/// Returns a description of the builder, its parameters and the node layout used by the mesh adapters.
+/// Two acceleration structures built for the same mesh with the same description are identical.
+std::string mesh_accel_desc_cpu(bool fast_build = false);
+std::string mesh_accel_desc_cpu8(bool fast_build = false);
+std::string mesh_accel_desc_cpu4q(bool fast_build = false);
+std::string mesh_accel_desc_gpu(bool fast_build = false);
 /// Returns the correct top-level acceleration structure adapter for the traversal implementation.
 std::unique_ptr<TopLevelAdapter> new_top_level_adapter_cpu(std::vector<traversal_cpu::Node>& nodes, std::vector<InstanceNode>& instance_nodes);
+std::unique_ptr<TopLevelAdapter> new_top_level_adapter_cpu8(std::vector<traversal_native::Node8>& nodes, std::vector<InstanceNode>& instance_nodes);
+std::unique_ptr<TopLevelAdapter> new_top_level_adapter_cpu4q(std::vector<traversal_native::QNode4>& nodes, std::vector<InstanceNode>& instance_nodes);
 std::unique_ptr<TopLevelAdapter> new_top_level_adapter_gpu(std::vector<traversal_gpu::Node>& nodes, std::vector<InstanceNode>& instance_nodes);
 
 } // namespace imba
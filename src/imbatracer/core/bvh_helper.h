@@ -60,6 +60,22 @@ struct MultiNode {
     }
 };
 
+/// Multi-node of a tree that is built in parallel, before it is written in depth-first order.
+/// A child without a build node is a leaf.
+template <typename Node, int N>
+struct BuildNode {
+    MultiNode<Node, N> multi_node;
+    BuildNode* children[N];
+    bool cut;   ///< The children are stored as leaves, because the stack of a serial builder would overflow.
+    int stack_need; ///< Stack space needed to write the subtree, used by the BVH optimizer.
+
+    BuildNode(const MultiNode<Node, N>& multi_node)
+        : multi_node(multi_node), cut(false), stack_need(0)
+    {
+        std::fill(children, children + N, nullptr);
+    }
+};
+
 } // namespace imba
 
 #endif // BVH_HELPER_H
@@ -0,0 +1,217 @@
+#ifndef IMBA_BVH_OPTIMIZER_H
+#define IMBA_BVH_OPTIMIZER_H
+
+#include <cstdint>
+#include <algorithm>
+
+#include "imbatracer/core/bvh_helper.h"
+#include "imbatracer/core/bbox.h"
+
+namespace imba {
+
+/// Reduces the SAH cost of a tree produced by the BVH builders, before it is written.
+/// Subtrees are exchanged between the children and the grandchildren of every node (tree rotations), when this
+/// reduces the area of the inner nodes. The leaves are not modified. Passes over the tree are repeated until no
+/// exchange is beneficial, or until the budget is exhausted. The budget is given in milliseconds, but it is converted
+/// to a number of evaluated exchanges, so that the result only depends on the budget and not on the machine.
+/// The tree must still be written with a stack of the given capacity, so exchanges that would need more space are not applied.
+/// See Kopta et al., "Fast, Effective BVH Updates for Animated Scenes", 2012
+template <typename Node, int N, typename CostFn>
+class BvhOptimizer {
+public:
+    typedef BuildNode<Node, N> TreeNode;
+
+    BvhOptimizer(float budget_ms, int stack_capacity)
+        : work_left_(int64_t(double(budget_ms) * evaluations_per_ms))
+        , stack_capacity_(stack_capacity)
+        , swaps_(0)
+    {}
+
+    /// Optimizes the tree in place, and returns the number of subtrees that were exchanged.
+    int optimize(TreeNode* root) {
+        prepare(root);
+        while (!timeout()) {
+            const int swaps = swaps_;
+            optimize_subtree(root, 0);
+            if (swaps == swaps_) break;
+        }
+        return swaps_;
+    }
+
+    /// Returns the SAH cost of a tree, without the cost of the root.
+    static float cost(const TreeNode* node) {
+        const auto& multi_node = node->multi_node;
+        float c = 0.0f;
+        for (int i = 0; i < multi_node.count; i++) {
+            const float area = multi_node.nodes[i].bbox.half_area();
+            if (is_inner(node, i))
+                c += CostFn::traversal_cost(area) + cost(node->children[i]);
+            else
+                c += CostFn::leaf_cost(multi_node.nodes[i].size(), area);
+        }
+        return c;
+    }
+
+private:
+    /// Number of exchanges evaluated per millisecond, measured on a desktop CPU.
+    static constexpr double evaluations_per_ms = 50000.0;
+
+    static bool is_inner(const TreeNode* node, int i) { return !node->cut && node->children[i]; }
+
+    /// Returns true if the child can take part in an exchange.
+    static bool is_rotatable(const TreeNode* node, int i) { return is_inner(node, i) && !node->children[i]->cut; }
+
+    bool timeout() const { return work_left_ <= 0; }
+
+    /// Updates the stack space needed to write a subtree, from the space needed by its children.
+    static void update_stack_need(TreeNode* node) {
+        const auto& multi_node = node->multi_node;
+        int need = multi_node.count;
+        for (int i = 0; i < multi_node.count; i++) {
+            if (is_inner(node, i))
+                need = std::max(need, multi_node.count - 1 - i + node->children[i]->stack_need);
+        }
+        node->stack_need = need;
+    }
+
+    /// Shrinks the bounding boxes of the inner nodes to the union of their children, so that the gains of the
+    /// exchanges only come from the exchanges. Computes the stack space needed by every subtree.
+    static void prepare(TreeNode* node) {
+        for (int i = 0; i < node->multi_node.count; i++) {
+            if (is_inner(node, i)) {
+                prepare(node->children[i]);
+                update_bbox(node, i);
+            }
+        }
+        update_stack_need(node);
+    }
+
+    /// Recomputes the bounding box of the i-th child of a node, after its children have changed.
+    static void update_bbox(TreeNode* node, int i) {
+        TreeNode* child = node->children[i];
+        auto& multi_node = child->multi_node;
+        multi_node.bbox = BBox::empty();
+        for (int j = 0; j < multi_node.count; j++)
+            multi_node.bbox.extend(multi_node.nodes[j].bbox);
+        node->multi_node.nodes[i].bbox = multi_node.bbox;
+        update_stack_need(child);
+    }
+
+    static BBox bbox_without(const TreeNode* node, int i) {
+        BBox bbox = BBox::empty();
+        for (int j = 0; j < node->multi_node.count; j++) {
+            if (j != i) bbox.extend(node->multi_node.nodes[j].bbox);
+        }
+        return bbox;
+    }
+
+    static float traversal_cost(BBox bbox, const BBox& other) {
+        return CostFn::traversal_cost(bbox.extend(other).half_area());
+    }
+
+    static void swap_slots(TreeNode* a, int i, TreeNode* b, int j) {
+        std::swap(a->multi_node.nodes[i], b->multi_node.nodes[j]);
+        std::swap(a->children[i], b->children[j]);
+    }
+
+    /// Optimizes the children of a node first, then the node itself.
+    /// The stack size is the number of nodes that are on the stack when the node is written.
+    void optimize_subtree(TreeNode* node, int stack_size) {
+        if (node->cut) return;
+
+        const int count = node->multi_node.count;
+        for (int i = 0; i < count && !timeout(); i++) {
+            if (is_inner(node, i))
+                optimize_subtree(node->children[i], stack_size + count - 1 - i);
+        }
+
+        // The children may have changed, even if the optimization stopped early.
+        update_stack_need(node);
+
+        while (!timeout() && rotate(node, stack_size))
+            swaps_++;
+    }
+
+    /// Applies the exchange between the children and grandchildren of a node that reduces the cost the most.
+    /// Returns false if no exchange reduces the cost.
+    bool rotate(TreeNode* node, int stack_size) {
+        const auto& multi_node = node->multi_node;
+        const int count = multi_node.count;
+
+        // Ignore tiny improvements, which could be caused by rounding errors
+        float best_gain = 1e-5f * CostFn::traversal_cost(multi_node.bbox.half_area());
+        int best_a = -1, best_x = -1, best_b = -1, best_y = -1;
+
+        for (int a = 0; a < count; a++) {
+            if (!is_rotatable(node, a)) continue;
+            const TreeNode* child_a = node->children[a];
+            const float cost_a = CostFn::traversal_cost(multi_node.nodes[a].bbox.half_area());
+
+            for (int x = 0; x < child_a->multi_node.count; x++) {
+                const BBox rest_a = bbox_without(child_a, x);
+                const BBox& bbox_x = child_a->multi_node.nodes[x].bbox;
+
+                // Exchange a grandchild with a child of the node
+                for (int c = 0; c < count; c++) {
+                    if (c == a) continue;
+                    work_left_--;
+                    const float gain = cost_a - traversal_cost(rest_a, multi_node.nodes[c].bbox);
+                    if (gain > best_gain) {
+                        best_gain = gain;
+                        best_a = a; best_x = x; best_b = c; best_y = -1;
+                    }
+                }
+
+                // Exchange two grandchildren that have different parents
+                for (int b = a + 1; b < count; b++) {
+                    if (!is_rotatable(node, b)) continue;
+                    const TreeNode* child_b = node->children[b];
+                    const float cost_b = CostFn::traversal_cost(multi_node.nodes[b].bbox.half_area());
+
+                    for (int y = 0; y < child_b->multi_node.count; y++) {
+                        work_left_--;
+                        const float gain = cost_a + cost_b
+                            - traversal_cost(rest_a, child_b->multi_node.nodes[y].bbox)
+                            - traversal_cost(bbox_without(child_b, y), bbox_x);
+                        if (gain > best_gain) {
+                            best_gain = gain;
+                            best_a = a; best_x = x; best_b = b; best_y = y;
+                        }
+                    }
+                }
+            }
+        }
+
+        if (best_a < 0) return false;
+
+        apply_rotation(node, best_a, best_x, best_b, best_y);
+        if (stack_size + node->stack_need < stack_capacity_)
+            return true;
+
+        // The tree would be too deep to be written, undo the exchange.
+        apply_rotation(node, best_a, best_x, best_b, best_y);
+        return false;
+    }
+
+    /// Exchanges the grandchild x of child a with child b (if y < 0), or with the grandchild y of child b.
+    /// Applying the same rotation twice restores the tree.
+    static void apply_rotation(TreeNode* node, int a, int x, int b, int y) {
+        if (y < 0) {
+            swap_slots(node->children[a], x, node, b);
+            update_bbox(node, a);
+        } else {
+            swap_slots(node->children[a], x, node->children[b], y);
+            update_bbox(node, a);
+            update_bbox(node, b);
+        }
+        update_stack_need(node);
+    }
+
+    int64_t work_left_;
+    int stack_capacity_;
+    int swaps_;
+};
+
+} // namespace imba
+
+#endif // IMBA_BVH_OPTIMIZER_H
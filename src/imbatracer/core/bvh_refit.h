@@ -0,0 +1,114 @@
+#ifndef IMBA_BVH_REFIT_H
+#define IMBA_BVH_REFIT_H
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#define NOMINMAX
+#include <tbb/tbb.h>
+
+#include "imbatracer/core/traversal_interface.h"
+#include "imbatracer/core/float3x4.h"
+#include "imbatracer/core/mesh.h"
+#include "imbatracer/core/bbox.h"
+
+namespace imba {
+
+/// Refits a top-level acceleration structure after its instances have moved. The transformations stored in the
+/// instance nodes are updated, and the bounds of the nodes are recomputed bottom-up, one level of the tree at a time,
+/// the nodes of a level being processed in parallel. The topology of the tree is not modified.
+/// The nodes must be ordered as written by the builders (every node before its children). The function child(node, i)
+/// returns the i-th child of a node (0 if empty), and write_bounds(node, bboxes, count) stores the bounds of its children.
+/// Returns the SAH cost of the refitted tree, without the cost of the root, relative to the area of the root. It thus
+/// measures the quality of the tree, independently of the size of the scene.
+template <int N, typename CostFn, typename Node, typename ChildFn, typename WriteBoundsFn>
+float refit_top_level(std::vector<Node>& nodes, std::vector<InstanceNode>& instance_nodes, int root_offset,
+                      const std::vector<Mesh>& meshes, const std::vector<Mesh::Instance>& instances,
+                      ChildFn child, WriteBoundsFn write_bounds) {
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, instance_nodes.size()), [&] (const tbb::blocked_range<size_t>& range) {
+        for (size_t i = range.begin(); i != range.end(); i++) {
+            auto& inst_node = instance_nodes[i];
+            memcpy(&inst_node.transf, &instances[inst_node.id].inv_mat, sizeof(inst_node.transf));
+        }
+    });
+
+    std::vector<BBox> inst_bounds(instances.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, instances.size()), [&] (const tbb::blocked_range<size_t>& range) {
+        for (size_t i = range.begin(); i != range.end(); i++)
+            inst_bounds[i] = transform(instances[i].mat, meshes[instances[i].id].bounding_box());
+    });
+
+    // Group the nodes by depth. Children are always written after their parent.
+    std::vector<int> depths(nodes.size(), 0);
+    std::vector<std::vector<int>> levels(1);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const size_t d = depths[i];
+        if (d >= levels.size()) levels.resize(d + 1);
+        levels[d].push_back(i);
+        for (int j = 0; j < N; j++) {
+            const int c = child(nodes[i], j);
+            if (c > 0) depths[c - root_offset] = d + 1;
+        }
+    }
+
+    std::vector<BBox> node_bounds(nodes.size());
+    std::vector<float> node_costs(nodes.size());
+    for (int d = int(levels.size()) - 1; d >= 0; d--) {
+        const auto& level = levels[d];
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, level.size()), [&] (const tbb::blocked_range<size_t>& range) {
+            for (size_t k = range.begin(); k != range.end(); k++) {
+                const int i = level[k];
+                BBox bboxes[N];
+                int count = 0;
+                float cost = 0.0f;
+                for (int j = 0; j < N; j++) {
+                    const int c = child(nodes[i], j);
+                    if (c == 0) continue;
+
+                    BBox& bbox = bboxes[count++];
+                    if (c > 0) {
+                        bbox = node_bounds[c - root_offset];
+                        cost += CostFn::traversal_cost(bbox.half_area());
+                    } else {
+                        // Leaves are lists of instance nodes, terminated by a sentinel.
+                        bbox = BBox::empty();
+                        int leaf_size = 0;
+                        for (int l = ~c; ; l++) {
+                            bbox.extend(inst_bounds[instance_nodes[l].id]);
+                            leaf_size++;
+                            if (instance_nodes[l].pad[0] == -1) break;
+                        }
+                        cost += CostFn::leaf_cost(leaf_size, bbox.half_area());
+                    }
+                }
+
+                write_bounds(nodes[i], bboxes, count);
+
+                node_bounds[i] = BBox::empty();
+                for (int j = 0; j < count; j++)
+                    node_bounds[i].extend(bboxes[j]);
+                node_costs[i] = cost;
+            }
+        });
+    }
+
+#ifndef NDEBUG
+    // A rebuilt tree has the same bounds at the root: those of all the instances.
+    BBox scene_bounds = BBox::empty();
+    for (auto& bbox : inst_bounds) scene_bounds.extend(bbox);
+    assert(nodes.empty() ||
+           (node_bounds[0].min.x == scene_bounds.min.x && node_bounds[0].max.x == scene_bounds.max.x &&
+            node_bounds[0].min.y == scene_bounds.min.y && node_bounds[0].max.y == scene_bounds.max.y &&
+            node_bounds[0].min.z == scene_bounds.min.z && node_bounds[0].max.z == scene_bounds.max.z));
+#endif
+
+    float total_cost = 0.0f;
+    for (auto c : node_costs) total_cost += c;
+    const float root_area = nodes.empty() ? 0.0f : node_bounds[0].half_area();
+    return root_area > 0.0f ? total_cost / root_area : total_cost;
+}
+
+} // namespace imba
+
+#endif // IMBA_BVH_REFIT_H
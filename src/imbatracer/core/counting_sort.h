@@ -1,88 +1,86 @@
 #ifndef IMBA_COUNTING_SORT_H
 #define IMBA_COUNTING_SORT_H
 
+#define NOMINMAX
 #include <tbb/tbb.h>
+#include <algorithm>
 #include <vector>
-#include <atomic>
 
 namespace imba {
 
-template <int N>
-struct Counter {
-    Counter(int n) {
-        assert(n <= N);
-        std::fill(counts, counts + n, 0);
-    }
-
-    Counter(Counter& c, tbb::split) {
-        std::fill(counts, counts + N, 0);
-    }
+/// Stable, parallel counting sort. Every block of keys gets its own histogram, so that
+/// the indices can be scattered to their bins without any atomic operation.
+class CountingSort {
+public:
+    /// Sorts the indices 0..count - 1 by their keys in [0, num_keys), preserving the order of indices with equal keys.
+    ///
+    /// \param key  Function that returns the key for a given index. Called exactly once per index.
+    /// \param ids  Receives the sorted indices, must be able to hold count elements.
+    template <typename KeyFn>
+    void sort(int count, int num_keys, KeyFn key, int* ids) {
+        // Keep the cost of the histograms in the order of the number of keys.
+        const int block_size  = num_keys > BLOCK_SIZE ? num_keys : BLOCK_SIZE;
+        const int block_count = (count + block_size - 1) / block_size;
+
+        if (keys_.size() < size_t(count)) keys_.resize(count);
+        histograms_.assign(block_count * num_keys, 0);
+        bins_.resize(num_keys + 1);
+
+        // Compute the keys and the histogram of every block.
+        tbb::parallel_for(tbb::blocked_range<int>(0, block_count),
+            [&] (const tbb::blocked_range<int>& range)
+        {
+            for (auto b = range.begin(); b != range.end(); ++b) {
+                int* hist = histograms_.data() + b * num_keys;
+                const int end = std::min(count, (b + 1) * block_size);
+                for (int i = b * block_size; i < end; ++i) {
+                    const int k = key(i);
+                    keys_[i] = k;
+                    hist[k]++;
+                }
+            }
+        });
 
-    template <typename Iterator>
-    void operator () (const tbb::blocked_range<Iterator>& range) {
-        for (auto it = range.begin(); it != range.end(); ++it) {
-            counts[*it]++;
+        // Turn the histograms into the starting index of every key within every block.
+        int accum = 0;
+        for (int k = 0; k < num_keys; ++k) {
+            bins_[k] = accum;
+            for (int b = 0; b < block_count; ++b) {
+                const int tmp = histograms_[b * num_keys + k];
+                histograms_[b * num_keys + k] = accum;
+                accum += tmp;
+            }
         }
-    }
+        bins_[num_keys] = accum;
 
-    void join(const Counter& c) {
-        for (int i = 0; i < N; i++) counts[i] += c.counts[i];
+        // Every block scatters its indices in order, which makes the sort stable.
+        tbb::parallel_for(tbb::blocked_range<int>(0, block_count),
+            [&] (const tbb::blocked_range<int>& range)
+        {
+            for (auto b = range.begin(); b != range.end(); ++b) {
+                int* offsets = histograms_.data() + b * num_keys;
+                const int end = std::min(count, (b + 1) * block_size);
+                for (int i = b * block_size; i < end; ++i)
+                    ids[offsets[keys_[i]]++] = i;
+            }
+        });
     }
 
-    int counts[N];
-};
+    /// Returns the position of the first index with the given key after the last call to sort().
+    /// Passing the number of keys returns the total number of sorted indices.
+    int bin_begin(int key) const { return bins_[key]; }
 
-template <>
-struct Counter<-1> {
-    Counter(int n) : counts(n, 0) {}
+    /// Returns the key that was computed for the given index during the last call to sort().
+    int key(int idx) const { return keys_[idx]; }
 
-    Counter(Counter& c, tbb::split)
-        : counts(c.counts.size(), 0)
-    {}
+private:
+    static constexpr int BLOCK_SIZE = 4096;
 
-    template <typename Iterator>
-    void operator () (const tbb::blocked_range<Iterator>& range) {
-        for (auto it = range.begin(); it != range.end(); ++it) {
-            counts[*it]++;
-        }
-    }
-
-    void join(const Counter& c) {
-        for (int i = 0, n = counts.size(); i < n; i++) counts[i] += c.counts[i];
-    }
-
-    std::vector<int> counts;
-};
-
-template <int N>
-struct CountingSort {
-    template <typename Iterator>
-    static void sort(Iterator begin, Iterator end, int n, std::atomic_int* offs, int* ids) {
-        Counter<N> c(n);
-        tbb::parallel_reduce(tbb::blocked_range<Iterator>(begin, end), c);
-        std::partial_sum(&c.counts[0], &c.counts[0] + n, &c.counts[0]);     
-        std::copy(&c.counts[0], &c.counts[0] + n, offs);
-        tbb::parallel_for(tbb::blocked_range<int>(0, end - begin),
-            [=] (const tbb::blocked_range<int>& range)
-        {
-            for (auto i = range.begin(); i != range.end(); ++i)
-                ids[--offs[*(begin + i)]] = i;
-        });
-    }
+    std::vector<int> keys_;
+    std::vector<int> histograms_;
+    std::vector<int> bins_;
 };
 
-template <typename Iterator>
-inline void counting_sort(Iterator begin, Iterator end, int n, int* ids) {
-    if (n <= 1024) {
-        std::atomic_int offs[1024];
-        CountingSort<1024>::sort(begin, end, n, offs, ids);
-    } else {
-        static thread_local std::vector<std::atomic_int> offs;
-        if (offs.size() < n) offs = std::vector<std::atomic_int>(n);
-        CountingSort<-1>::sort(begin, end, n, offs.data(), ids);
-    }
-}
-
 } // namespace imba
 
 #endif // IMBA_COUNTING_SORT_H
@@ -1,16 +1,28 @@
 #include <cstring>
+#include <cmath>
+#include <sstream>
+#include <algorithm>
 
 #include "imbatracer/core/adapter.h"
+#include "imbatracer/core/traversal_native.h"
 #include "imbatracer/core/sbvh_builder.h"
 #include "imbatracer/core/fast_bvh_builder.h"
+#include "imbatracer/core/bvh_refit.h"
 #include "imbatracer/core/mesh.h"
 #include "imbatracer/core/stack.h"
 #include "imbatracer/core/common.h"
 
 namespace imba {
 
-using traversal_cpu::Node;
+using traversal_native::Node8;
+using traversal_native::QNode4;
+using traversal_native::QuantizedNode;
 
+// Parameters of the mesh acceleration structure builders
+static const int   mesh_leaf_threshold = 2;
+static const float mesh_spatial_split_alpha = 1e-4f;
+
+template <typename Node>
 static void fill_dummy_parent(Node& node, const BBox& leaf_bb, int index) {
     node.children[0] = index;
     node.children[1] = 0;
@@ -24,34 +36,112 @@ static void fill_dummy_parent(Node& node, const BBox& leaf_bb, int index) {
     node.max_z[0] = leaf_bb.max.z;
 }
 
+/// Writes the bounds of the children of a node. The bounds of the unused children are empty.
+template <typename Node>
+static void write_bounds(Node& node, const BBox* bboxes, int count) {
+    const int n = sizeof(node.children) / sizeof(node.children[0]);
+    for (int j = 0; j < n; j++) {
+        const BBox& bbox = j < count ? bboxes[j] : BBox::empty();
+        node.min_x[j] = bbox.min.x;
+        node.min_y[j] = bbox.min.y;
+        node.min_z[j] = bbox.min.z;
+
+        node.max_x[j] = bbox.max.x;
+        node.max_y[j] = bbox.max.y;
+        node.max_z[j] = bbox.max.z;
+    }
+}
+
+/// Quantizes the bounds of the children on one axis. The lower bounds are rounded down and the upper bounds up,
+/// so that the quantized boxes enclose the original ones.
+static void quantize_axis(float node_min, float node_max, const float* mins, const float* maxs, int count,
+                          float& origin, float& scale, uint8_t* qmins, uint8_t* qmaxs, int n) {
+    origin = node_min;
+    scale = node_max > node_min ? (node_max - node_min) / 255.0f : 0.0f;
+    while (origin + 255.0f * scale < node_max)
+        scale = std::nextafter(scale, FLT_MAX);
+
+    for (int j = 0; j < count; j++) {
+        int qmin = 0, qmax = 0;
+        if (scale > 0.0f) {
+            qmin = std::min(255, std::max(0, int(std::floor((mins[j] - origin) / scale))));
+            qmax = std::min(255, std::max(0, int(std::ceil ((maxs[j] - origin) / scale))));
+            while (qmin > 0   && origin + qmin * scale > mins[j]) qmin--;
+            while (qmax < 255 && origin + qmax * scale < maxs[j]) qmax++;
+        }
+        qmins[j] = qmin;
+        qmaxs[j] = qmax;
+    }
+
+    // Empty boxes, for the unused children
+    for (int j = count; j < n; j++) {
+        qmins[j] = 255;
+        qmaxs[j] = 0;
+    }
+}
+
+template <int N>
+static void write_bounds(QuantizedNode<N>& node, const BBox* bboxes, int count) {
+    BBox node_bb = BBox::empty();
+    float min_x[N], min_y[N], min_z[N], max_x[N], max_y[N], max_z[N];
+    for (int j = 0; j < count; j++) {
+        node_bb.extend(bboxes[j]);
+        min_x[j] = bboxes[j].min.x; max_x[j] = bboxes[j].max.x;
+        min_y[j] = bboxes[j].min.y; max_y[j] = bboxes[j].max.y;
+        min_z[j] = bboxes[j].min.z; max_z[j] = bboxes[j].max.z;
+    }
+
+    quantize_axis(node_bb.min.x, node_bb.max.x, min_x, max_x, count, node.origin[0], node.scale[0], node.min_x, node.max_x, N);
+    quantize_axis(node_bb.min.y, node_bb.max.y, min_y, max_y, count, node.origin[1], node.scale[1], node.min_y, node.max_y, N);
+    quantize_axis(node_bb.min.z, node_bb.max.z, min_z, max_z, count, node.origin[2], node.scale[2], node.min_z, node.max_z, N);
+}
+
+template <int N>
+static void fill_dummy_parent(QuantizedNode<N>& node, const BBox& leaf_bb, int index) {
+    write_bounds(node, &leaf_bb, 1);
+    for (int j = 0; j < N; j++)
+        node.children[j] = j == 0 ? index : 0;
+}
+
+/// Mesh adapter for N-wide nodes, with leaves made of blocks of N triangles.
+template <typename Node, int N>
 class CpuMeshAdapter : public MeshAdapter {
     std::vector<Node>& nodes_;
     std::vector<Vec4>& tris_;
 public:
-    CpuMeshAdapter(std::vector<Node>& nodes, std::vector<Vec4>& tris)
-        : nodes_(nodes), tris_(tris)
+    CpuMeshAdapter(std::vector<Node>& nodes, std::vector<Vec4>& tris, bool fast_build)
+        : nodes_(nodes), tris_(tris), fast_build_(fast_build)
     {}
 
     void build_accel(const Mesh& mesh, int mesh_id, const std::vector<int>& tri_layout) override {
         mesh_ = &mesh;
-        builder_.build(mesh, NodeWriter(this), LeafWriter(this, mesh_id, tri_layout), 2, 1e-4f);
+        fast_builder_.set_optimization_budget(optimization_budget_);
+        builder_.set_optimization_budget(optimization_budget_);
+        if (fast_build_)
+            fast_builder_.build(mesh, NodeWriter(this), LeafWriter(this, mesh_id, tri_layout), mesh_leaf_threshold);
+        else
+            builder_.build(mesh, NodeWriter(this), LeafWriter(this, mesh_id, tri_layout), mesh_leaf_threshold, mesh_spatial_split_alpha);
     }
 
 #ifdef STATISTICS
-    void print_stats() const override { builder_.print_stats(); }
+    void print_stats() const override {
+        if (fast_build_) fast_builder_.print_stats();
+        else             builder_.print_stats();
+    }
 #endif
 
 private:
     struct CostFn {
         static float leaf_cost(int count, float area) {
-            return ((count - 1) / 4 + 1) * area;
+            return ((count - 1) / N + 1) * area;
         }
         static float traversal_cost(float area) {
             return area * 0.5f;
         }
     };
 
-    typedef SplitBvhBuilder<4, CostFn> BvhBuilder;
+    typedef SplitBvhBuilder<N, CostFn> BvhBuilder;
+    typedef FastBvhBuilder<N, CostFn> FastBuilder;
 
     struct NodeWriter {
         CpuMeshAdapter* adapter;
@@ -73,32 +163,17 @@ private:
                 nodes[elem.parent].children[elem.child] = i;
             }
 
-            assert(count >= 2 && count <= 4);
+            assert(count >= 2 && count <= N);
 
+            BBox child_bbs[N];
             for (int j = count - 1; j >= 0; j--) {
-                const BBox& bbox = bboxes(j);
-                nodes[i].min_x[j] = bbox.min.x;
-                nodes[i].min_y[j] = bbox.min.y;
-                nodes[i].min_z[j] = bbox.min.z;
-
-                nodes[i].max_x[j] = bbox.max.x;
-                nodes[i].max_y[j] = bbox.max.y;
-                nodes[i].max_z[j] = bbox.max.z;
-
+                child_bbs[j] = bboxes(j);
                 stack.push(i, j);
             }
+            write_bounds(nodes[i], child_bbs, count);
 
-            for (int j = 3; j >= count; j--) {
-                nodes[i].min_x[j] = FLT_MAX;
-                nodes[i].min_y[j] = FLT_MAX;
-                nodes[i].min_z[j] = FLT_MAX;
-
-                nodes[i].max_x[j] = -FLT_MAX;
-                nodes[i].max_y[j] = -FLT_MAX;
-                nodes[i].max_z[j] = -FLT_MAX;
-
+            for (int j = N - 1; j >= count; j--)
                 nodes[i].children[j] = 0;
-            }
         }
     };
 
@@ -126,19 +201,12 @@ private:
                 nodes[elem.parent].children[elem.child] = ~tris.size();
             }
 
-            // Group triangles by packets of 4
-            for (int i = 0; i < ref_count; i += 4) {
-                const int c = i + 4 <= ref_count ? 4 : ref_count - i;
-                union{
-                    struct {
-                        Vec4 v0_x, v0_y, v0_z;
-                        Vec4 e1_x, e1_y, e1_z;
-                        Vec4 e2_x, e2_y, e2_z;
-                        Vec4 n_x, n_y, n_z;
-                        Vec4 ids;
-                    } tri;
-                    float raw[4 * 4 * 3];
-                } data;
+            // Group triangles by packets of N
+            for (int i = 0; i < ref_count; i += N) {
+                const int c = i + N <= ref_count ? N : ref_count - i;
+
+                // Rows of N values: v0_x, v0_y, v0_z, e1_x, e1_y, e1_z, e2_x, e2_y, e2_z, n_x, n_y, n_z, ids
+                float data[13 * N];
 
                 for (int j = 0; j < c; j++) {
                     const int id = refs(i + j);
@@ -146,58 +214,35 @@ private:
                     const float3 e1 = tri.v0 - tri.v1;
                     const float3 e2 = tri.v2 - tri.v0;
                     const float3 n = cross(e1, e2);
-                    data.raw[j + 0] = tri.v0.x;
-                    data.raw[j + 4] = tri.v0.y;
-                    data.raw[j + 8] = tri.v0.z;
+                    data[j +  0 * N] = tri.v0.x;
+                    data[j +  1 * N] = tri.v0.y;
+                    data[j +  2 * N] = tri.v0.z;
 
-                    data.raw[j + 12] = e1.x;
-                    data.raw[j + 16] = e1.y;
-                    data.raw[j + 20] = e1.z;
+                    data[j +  3 * N] = e1.x;
+                    data[j +  4 * N] = e1.y;
+                    data[j +  5 * N] = e1.z;
 
-                    data.raw[j + 24] = e2.x;
-                    data.raw[j + 28] = e2.y;
-                    data.raw[j + 32] = e2.z;
+                    data[j +  6 * N] = e2.x;
+                    data[j +  7 * N] = e2.y;
+                    data[j +  8 * N] = e2.z;
 
-                    data.raw[j + 36] = n.x;
-                    data.raw[j + 40] = n.y;
-                    data.raw[j + 44] = n.z;
+                    data[j +  9 * N] = n.x;
+                    data[j + 10 * N] = n.y;
+                    data[j + 11 * N] = n.z;
 
-                    data.raw[j + 48] = int_as_float(id + tri_layout[mesh_id]);
+                    data[j + 12 * N] = int_as_float(id + tri_layout[mesh_id]);
                 }
 
-                for (int j = c; j < 4; j++) {
-                    data.raw[j + 0] = 0.0f;
-                    data.raw[j + 4] = 0.0f;
-                    data.raw[j + 8] = 0.0f;
-                    data.raw[j + 12] = 0.0f;
-                    data.raw[j + 16] = 0.0f;
-                    data.raw[j + 20] = 0.0f;
-                    data.raw[j + 24] = 0.0f;
-                    data.raw[j + 28] = 0.0f;
-                    data.raw[j + 32] = 0.0f;
-                    data.raw[j + 36] = 0.0f;
-                    data.raw[j + 40] = 0.0f;
-                    data.raw[j + 44] = 0.0f;
-                    data.raw[j + 48] = int_as_float(0x80000000);
+                for (int j = c; j < N; j++) {
+                    for (int k = 0; k < 12; k++)
+                        data[j + k * N] = 0.0f;
+                    data[j + 12 * N] = int_as_float(0x80000000);
                 }
 
-                tris.emplace_back(data.tri.v0_x);
-                tris.emplace_back(data.tri.v0_y);
-                tris.emplace_back(data.tri.v0_z);
-
-                tris.emplace_back(data.tri.e1_x);
-                tris.emplace_back(data.tri.e1_y);
-                tris.emplace_back(data.tri.e1_z);
-
-                tris.emplace_back(data.tri.e2_x);
-                tris.emplace_back(data.tri.e2_y);
-                tris.emplace_back(data.tri.e2_z);
-
-                tris.emplace_back(data.tri.n_x);
-                tris.emplace_back(data.tri.n_y);
-                tris.emplace_back(data.tri.n_z);
-
-                tris.emplace_back(data.tri.ids);
+                for (int k = 0; k < 13 * N; k += 4) {
+                    Vec4 v = { data[k + 0], data[k + 1], data[k + 2], data[k + 3] };
+                    tris.emplace_back(v);
+                }
             }
 
             // Add sentinel
@@ -216,8 +261,11 @@ private:
     Stack<StackElem> stack_;
     const Mesh* mesh_;
     BvhBuilder builder_;
+    FastBuilder fast_builder_;
+    bool fast_build_;
 };
 
+template <typename Node, int N>
 class CpuTopLevelAdapter : public TopLevelAdapter {
     std::vector<Node>& nodes_;
     std::vector<InstanceNode>& instance_nodes_;
@@ -244,11 +292,20 @@ public:
         }
 
         // Build the acceleration structure.
+        builder_.set_optimization_budget(optimization_budget_);
         builder_.build(bounds.data(), centers.data(), instances.size(),
             NodeWriter(this, meshes, instances, root_offset),
             LeafWriter(this, meshes, instances, layout), 1);
     }
 
+    float refit_accel(const std::vector<Mesh>& meshes,
+                      const std::vector<Mesh::Instance>& instances,
+                      int root_offset) override {
+        return refit_top_level<N, CostFn>(nodes_, instance_nodes_, root_offset, meshes, instances,
+            [] (const Node& node, int i) { return node.children[i]; },
+            [] (Node& node, const BBox* bboxes, int count) { write_bounds(node, bboxes, count); });
+    }
+
 private:
 #ifdef STATISTICS
     void print_stats() const override { builder_.print_stats(); }
@@ -256,14 +313,14 @@ private:
 
     struct CostFn {
         static float leaf_cost(int count, float area) {
-            return ((count - 1) / 4 + 1) * area;
+            return ((count - 1) / N + 1) * area;
         }
         static float traversal_cost(float area) {
             return area * 0.5f;
         }
     };
 
-    typedef FastBvhBuilder<4, CostFn> BvhBuilder;
+    typedef FastBvhBuilder<N, CostFn> BvhBuilder;
 
     struct NodeWriter {
         CpuTopLevelAdapter* adapter;
@@ -288,32 +345,17 @@ private:
                 nodes[elem.parent].children[elem.child] = i + root_offset;
             }
 
-            assert(count >= 2 && count <= 4);
+            assert(count >= 2 && count <= N);
 
+            BBox child_bbs[N];
             for (int j = count - 1; j >= 0; j--) {
-                const BBox& bbox = bboxes(j);
-                nodes[i].min_x[j] = bbox.min.x;
-                nodes[i].min_y[j] = bbox.min.y;
-                nodes[i].min_z[j] = bbox.min.z;
-
-                nodes[i].max_x[j] = bbox.max.x;
-                nodes[i].max_y[j] = bbox.max.y;
-                nodes[i].max_z[j] = bbox.max.z;
-
+                child_bbs[j] = bboxes(j);
                 stack.push(i, j);
             }
+            write_bounds(nodes[i], child_bbs, count);
 
-            for (int j = 3; j >= count; j--) {
-                nodes[i].min_x[j] = FLT_MAX;
-                nodes[i].min_y[j] = FLT_MAX;
-                nodes[i].min_z[j] = FLT_MAX;
-
-                nodes[i].max_x[j] = -FLT_MAX;
-                nodes[i].max_y[j] = -FLT_MAX;
-                nodes[i].max_z[j] = -FLT_MAX;
-
+            for (int j = N - 1; j >= count; j--)
                 nodes[i].children[j] = 0;
-            }
         }
     };
 
@@ -377,12 +419,49 @@ private:
     BvhBuilder builder_;
 };
 
-std::unique_ptr<MeshAdapter> new_mesh_adapter_cpu(std::vector<Node>& nodes, std::vector<Vec4>& tris) {
-    return std::unique_ptr<MeshAdapter>(new CpuMeshAdapter(nodes, tris));
+std::unique_ptr<MeshAdapter> new_mesh_adapter_cpu(std::vector<traversal_cpu::Node>& nodes, std::vector<Vec4>& tris, bool fast_build) {
+    return std::unique_ptr<MeshAdapter>(new CpuMeshAdapter<traversal_cpu::Node, 4>(nodes, tris, fast_build));
+}
+
+std::unique_ptr<MeshAdapter> new_mesh_adapter_cpu8(std::vector<Node8>& nodes, std::vector<Vec4>& tris, bool fast_build) {
+    return std::unique_ptr<MeshAdapter>(new CpuMeshAdapter<Node8, 8>(nodes, tris, fast_build));
+}
+
+std::unique_ptr<MeshAdapter> new_mesh_adapter_cpu4q(std::vector<QNode4>& nodes, std::vector<Vec4>& tris, bool fast_build) {
+    return std::unique_ptr<MeshAdapter>(new CpuMeshAdapter<QNode4, 4>(nodes, tris, fast_build));
+}
+
+template <typename Node, int N>
+static std::string mesh_accel_desc(const char* name, bool fast_build) {
+    std::ostringstream desc;
+    desc << name << " N=" << N << " node=" << sizeof(Node) << " leaf=" << mesh_leaf_threshold;
+    if (fast_build) desc << " builder=binned";
+    else            desc << " builder=sbvh alpha=" << mesh_spatial_split_alpha;
+    return desc.str();
+}
+
+std::string mesh_accel_desc_cpu(bool fast_build) {
+    return mesh_accel_desc<traversal_cpu::Node, 4>("cpu", fast_build);
+}
+
+std::string mesh_accel_desc_cpu8(bool fast_build) {
+    return mesh_accel_desc<Node8, 8>("cpu8", fast_build);
+}
+
+std::string mesh_accel_desc_cpu4q(bool fast_build) {
+    return mesh_accel_desc<QNode4, 4>("cpu4q", fast_build);
+}
+
+std::unique_ptr<TopLevelAdapter> new_top_level_adapter_cpu(std::vector<traversal_cpu::Node>& nodes, std::vector<InstanceNode>& instance_nodes) {
+    return std::unique_ptr<TopLevelAdapter>(new CpuTopLevelAdapter<traversal_cpu::Node, 4>(nodes, instance_nodes));
+}
+
+std::unique_ptr<TopLevelAdapter> new_top_level_adapter_cpu8(std::vector<Node8>& nodes, std::vector<InstanceNode>& instance_nodes) {
+    return std::unique_ptr<TopLevelAdapter>(new CpuTopLevelAdapter<Node8, 8>(nodes, instance_nodes));
 }
 
-std::unique_ptr<TopLevelAdapter> new_top_level_adapter_cpu(std::vector<Node>& nodes, std::vector<InstanceNode>& instance_nodes) {
-    return std::unique_ptr<TopLevelAdapter>(new CpuTopLevelAdapter(nodes, instance_nodes));
+std::unique_ptr<TopLevelAdapter> new_top_level_adapter_cpu4q(std::vector<QNode4>& nodes, std::vector<InstanceNode>& instance_nodes) {
+    return std::unique_ptr<TopLevelAdapter>(new CpuTopLevelAdapter<QNode4, 4>(nodes, instance_nodes));
 }
 
 } // namespace imba
@@ -6,10 +6,15 @@
 #include <cassert>
 #include <iostream>
 #include <chrono>
+#include <vector>
+
+#define NOMINMAX
+#include <tbb/tbb.h>
 
 #include "imbatracer/core/common.h"
 #include "imbatracer/core/mem_pool.h"
 #include "imbatracer/core/bvh_helper.h"
+#include "imbatracer/core/bvh_optimizer.h"
 #include "imbatracer/core/float4.h"
 #include "imbatracer/core/stack.h"
 #include "imbatracer/core/mesh.h"
@@ -19,6 +24,8 @@
 namespace imba {
 
 /// A fast binning BVH builder, which produces medium-quality BVHs.
+/// Bounds, binning and partitioning of large nodes run in parallel, and large subtrees are built by separate tasks.
+/// The nodes are written in depth-first order by a single thread.
 /// Inspired from "On fast Construction of SAH-based Bounding Volume Hierarchies", I. Wald, 2007
 /// http://www.sci.utah.edu/~wald/Publications/2007/ParallelBVHBuild/fastbuild.pdf
 template <int N, typename CostFn>
@@ -27,14 +34,16 @@ public:
     template <typename NodeWriter, typename LeafWriter>
     void build(const Mesh& mesh, NodeWriter write_node, LeafWriter write_leaf, int leaf_threshold) {
         const int tri_count = mesh.triangle_count();
-        BBox* bboxes = mem_pool_.alloc<BBox>(tri_count);
-        float3* centers = mem_pool_.alloc<float3>(tri_count);
-
-        for (int i = 0; i < tri_count; i++) {
-            const Tri& tri = mesh.triangle(i);
-            tri.compute_bbox(bboxes[i]);
-            centers[i] = (1.0f / 3.0f) * (tri.v0 + tri.v1 + tri.v2);
-        }
+        BBox* bboxes = mem_pool_.local().template alloc<BBox>(tri_count);
+        float3* centers = mem_pool_.local().template alloc<float3>(tri_count);
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, tri_count), [&] (const tbb::blocked_range<int>& range) {
+            for (int i = range.begin(); i != range.end(); i++) {
+                const Tri& tri = mesh.triangle(i);
+                tri.compute_bbox(bboxes[i]);
+                centers[i] = (1.0f / 3.0f) * (tri.v0 + tri.v1 + tri.v2);
+            }
+        });
 
         build(bboxes, centers, tri_count, write_node, write_leaf, leaf_threshold);
     }
@@ -47,135 +56,72 @@ public:
         auto time_start = std::chrono::high_resolution_clock::now();
 #endif
 
-        BBox global_bb = BBox::empty();
-        for (int i = 0; i < obj_count; i++) global_bb.extend(bboxes[i]);
-        int* refs = mem_pool_.alloc<int>(obj_count);
-        for (int i = 0; i < obj_count; i++) refs[i] = i;
-
-        Stack<Node> stack;
-        stack.push(0, obj_count, global_bb);
-
-        while (!stack.is_empty()) {
-            MultiNode<Node, N> multi_node(stack.pop());
-
-            // Iterate over the available split candidates in the multi-node
-            while (!multi_node.is_full() && multi_node.node_available()) {
-                const int node_id = multi_node.next_node();
-                Node node = multi_node.nodes[node_id];
-
-                multi_node.nodes[node_id].tested = true;
-
-                const int begin = node.begin;
-                const int end = node.end;
-                const BBox& parent_bb = node.bbox;
-                assert(end - begin != 0);
-
-                // Test longest axes first
-                float3 extents = parent_bb.max - parent_bb.min;
-                int axes[3] = {0, 1, 2};
-                if (extents[axes[0]] < extents[axes[1]]) std::swap(axes[0], axes[1]);
-                if (extents[axes[1]] < extents[axes[2]]) std::swap(axes[1], axes[2]);
-                if (extents[axes[0]] < extents[axes[1]]) std::swap(axes[0], axes[1]);
-                for (int j = 0; j < 3; j++) {
-                    const int axis = axes[j];
-
-                    // Compute the min/max center position
-                    float center_min = parent_bb.max[axis];
-                    float center_max = parent_bb.min[axis];
-                    for (int i = begin; i < end; i++) {
-                        const float c = centers[refs[i]][axis];
-                        center_min = std::min(center_min, c);
-                        center_max = std::max(center_max, c);
-                    }
-
-                    // Put the triangles into the bins
-                    Bin bins[num_bins];
-                    bin_triangles(axis, bins, refs, bboxes, centers, center_min, center_max, begin, end);
-
-                    // Find the best split position
-                    const float parent_area = parent_bb.half_area();
-                    int best_split = find_best_split(bins, CostFn::leaf_cost(end - begin, parent_area) - CostFn::traversal_cost(parent_area));
-                    if (best_split >= 0 && best_split < num_bins - 1) {
-                        // The node was succesfully split
-                        const int begin_right = apply_split(axis, best_split, refs, centers, center_min, center_max, begin, end);
-                        const int end_right = end;
-                        const int begin_left = begin;
-                        const int end_left = begin_right;
-
-                        BBox left_bb  = BBox::empty();
-                        BBox right_bb = BBox::empty();
-                        if (num_bins < end - begin) {
-                            // Compute the bounding box using the bins
-                            for (int i = 0; i < best_split; i++) left_bb.extend(bins[i].bbox);
-                            for (int i = best_split; i < num_bins; i++) right_bb.extend(bins[i].bbox);
-                        } else {
-                            // Compute the bounding box using the objects
-                            for (int i = begin_left; i < end_left; i++) left_bb.extend(bboxes[refs[i]]);
-                            for (int i = begin_right; i < end_right; i++) right_bb.extend(bboxes[refs[i]]);
-                        }
-
-                        // Exit once the first candidate is found
-                        multi_node.split_node(node_id,
-                                              Node(begin_left, end_left, left_bb),
-                                              Node(begin_right, end_right, right_bb));
-                        break;
-                    }
+        int* refs = mem_pool_.local().template alloc<int>(obj_count);
+        BBox global_bb = tbb::parallel_reduce(tbb::blocked_range<int>(0, obj_count), BBox::empty(),
+            [&] (const tbb::blocked_range<int>& range, BBox bb) {
+                for (int i = range.begin(); i != range.end(); i++) {
+                    bb.extend(bboxes[i]);
+                    refs[i] = i;
                 }
-            }
-
-            assert(multi_node.count > 0);
-            // Process the smallest nodes first
-            multi_node.sort_nodes();
-
-            // The multi-node is ready to be stored
-            if (multi_node.is_leaf()) {
-                // Store a leaf if it could not be split
-                const Node& node = multi_node.nodes[0];
-                assert(node.tested);
-                make_leaf(node, refs, write_leaf);
-            } else {
-                // Store a multi-node
-                make_node(multi_node, write_node);
-                assert(N > 2 || multi_node.count == 2);
-
-                if (stack.size() + multi_node.count < stack.capacity()) {
-                    for (int i = multi_node.count - 1; i >= 0; i--) {
-                        stack.push(multi_node.nodes[i]);
-                    }
-                } else {
-                    // Insufficient space on the stack, we have to stop recursion here
-                    for (int i = 0; i < multi_node.count; i++) {
-                        make_leaf(multi_node.nodes[i], refs, write_leaf);
-                    }
-                }
-            }
-        }
+                return bb;
+            },
+            [] (BBox a, const BBox& b) { return a.extend(b); });
+
+        // Build the tree in memory first, then write it in depth-first order.
+        Node root(0, obj_count, global_bb);
+        TreeNode* build_root = build_subtree(root, 0, refs, bboxes, centers, leaf_threshold);
+        if (build_root && optimization_budget_ > 0.0f)
+            optimize(build_root);
+        if (build_root)
+            emit(build_root, refs, write_node, write_leaf);
+        else
+            make_leaf(root, refs, write_leaf);
 
 #ifdef STATISTICS
         auto time_end = std::chrono::high_resolution_clock::now();
         total_time_ += std::chrono::duration_cast<std::chrono::milliseconds>(time_end - time_start).count();
 #endif
 
-        mem_pool_.cleanup();
+        for (auto& pool : mem_pool_) pool.cleanup();
     }
 
+    /// Spends up to the given time (in milliseconds) reducing the SAH cost of every tree, before it is written.
+    void set_optimization_budget(float ms) { optimization_budget_ = ms; }
+
 #ifdef STATISTICS
     void print_stats() const {
         std::cout << "BVH built in " << total_time_ << "ms ("
                   << total_nodes_ << " nodes, "
                   << total_leaves_ << " leaves)"
                   << std::endl;
+        if (optimization_budget_ > 0.0f) {
+            std::cout << "BVH optimized in " << total_opt_time_ << "ms ("
+                      << total_swaps_ << " exchanged subtrees, SAH cost reduced by "
+                      << (cost_before_ > 0.0f ? 100.0f * (1.0f - cost_after_ / cost_before_) : 0.0f) << "%)"
+                      << std::endl;
+        }
     }
 #endif
 
 private:
     static constexpr int num_bins = 32;
 
+    /// Subtrees with at least this many references are built by a separate task.
+    static constexpr int parallel_build_threshold = 4096;
+    /// Nodes with at least this many references are binned and partitioned in parallel.
+    static constexpr int parallel_split_threshold = 1 << 14;
+
     struct Bin {
         int count;
         BBox bbox;
     };
 
+    struct BinSet {
+        Bin bins[num_bins];
+
+        BinSet() { clear_bins(bins); }
+    };
+
     struct Node {
         BBox bbox;
         int begin, end;
@@ -191,6 +137,137 @@ private:
         int size() const { return end - begin; }
     };
 
+    typedef imba::BuildNode<Node, N> TreeNode;
+
+    /// Splits the given node as long as possible, and returns the resulting subtree, or nullptr for a leaf.
+    /// The stack size is the number of nodes that would be on the stack of a serial builder after popping this node.
+    TreeNode* build_subtree(const Node& node, int stack_size, int* refs, const BBox* bboxes, const float3* centers, int leaf_threshold) {
+        MultiNode<Node, N> multi_node(node);
+
+        // Iterate over the available split candidates in the multi-node
+        while (!multi_node.is_full() && multi_node.node_available()) {
+            const int node_id = multi_node.next_node();
+            Node node = multi_node.nodes[node_id];
+
+            multi_node.nodes[node_id].tested = true;
+
+            const int begin = node.begin;
+            const int end = node.end;
+            const BBox& parent_bb = node.bbox;
+            assert(end - begin != 0);
+
+            // Test longest axes first
+            float3 extents = parent_bb.max - parent_bb.min;
+            int axes[3] = {0, 1, 2};
+            if (extents[axes[0]] < extents[axes[1]]) std::swap(axes[0], axes[1]);
+            if (extents[axes[1]] < extents[axes[2]]) std::swap(axes[1], axes[2]);
+            if (extents[axes[0]] < extents[axes[1]]) std::swap(axes[0], axes[1]);
+            for (int j = 0; j < 3; j++) {
+                const int axis = axes[j];
+
+                // Compute the min/max center position
+                float center_min, center_max;
+                compute_center_bounds(axis, refs, centers, parent_bb, begin, end, center_min, center_max);
+
+                // Put the triangles into the bins
+                Bin bins[num_bins];
+                bin_triangles(axis, bins, refs, bboxes, centers, center_min, center_max, begin, end);
+
+                // Find the best split position
+                const float parent_area = parent_bb.half_area();
+                int best_split = find_best_split(bins, CostFn::leaf_cost(end - begin, parent_area) - CostFn::traversal_cost(parent_area));
+                if (best_split >= 0 && best_split < num_bins - 1) {
+                    // The node was succesfully split
+                    const int begin_right = apply_split(axis, best_split, refs, centers, center_min, center_max, begin, end);
+                    const int end_right = end;
+                    const int begin_left = begin;
+                    const int end_left = begin_right;
+
+                    BBox left_bb  = BBox::empty();
+                    BBox right_bb = BBox::empty();
+                    if (num_bins < end - begin) {
+                        // Compute the bounding box using the bins
+                        for (int i = 0; i < best_split; i++) left_bb.extend(bins[i].bbox);
+                        for (int i = best_split; i < num_bins; i++) right_bb.extend(bins[i].bbox);
+                    } else {
+                        // Compute the bounding box using the objects
+                        for (int i = begin_left; i < end_left; i++) left_bb.extend(bboxes[refs[i]]);
+                        for (int i = begin_right; i < end_right; i++) right_bb.extend(bboxes[refs[i]]);
+                    }
+
+                    // Exit once the first candidate is found
+                    multi_node.split_node(node_id,
+                                          Node(begin_left, end_left, left_bb),
+                                          Node(begin_right, end_right, right_bb));
+                    break;
+                }
+            }
+        }
+
+        assert(multi_node.count > 0);
+        // Process the smallest nodes first
+        multi_node.sort_nodes();
+
+        // Leaves are stored by the parent
+        if (multi_node.is_leaf()) {
+            assert(multi_node.nodes[0].tested);
+            return nullptr;
+        }
+
+        assert(N > 2 || multi_node.count == 2);
+        TreeNode* build_node = new (mem_pool_.local().template alloc<TreeNode>(1)) TreeNode(multi_node);
+
+        if (stack_size + multi_node.count >= Stack<Node>::capacity()) {
+            // Insufficient space on the stack, we have to stop recursion here
+            build_node->cut = true;
+            return build_node;
+        }
+
+        // The children cover disjoint ranges of references, and can thus be built independently.
+        tbb::task_group children;
+        for (int i = 0; i < multi_node.count; i++) {
+            const Node& child = multi_node.nodes[i];
+            const int child_stack_size = stack_size + multi_node.count - 1 - i;
+            if (child.size() >= parallel_build_threshold) {
+                children.run([=] {
+                    build_node->children[i] = build_subtree(child, child_stack_size, refs, bboxes, centers, leaf_threshold);
+                });
+            } else {
+                build_node->children[i] = build_subtree(child, child_stack_size, refs, bboxes, centers, leaf_threshold);
+            }
+        }
+        children.wait();
+
+        return build_node;
+    }
+
+    void optimize(TreeNode* root) {
+        BvhOptimizer<Node, N, CostFn> optimizer(optimization_budget_, Stack<Node>::capacity());
+#ifdef STATISTICS
+        auto time_start = std::chrono::high_resolution_clock::now();
+        cost_before_ += optimizer.cost(root);
+        total_swaps_ += optimizer.optimize(root);
+        cost_after_ += optimizer.cost(root);
+        auto time_end = std::chrono::high_resolution_clock::now();
+        total_opt_time_ += std::chrono::duration_cast<std::chrono::milliseconds>(time_end - time_start).count();
+#else
+        optimizer.optimize(root);
+#endif
+    }
+
+    template <typename NodeWriter, typename LeafWriter>
+    void emit(const TreeNode* build_node, const int* refs, NodeWriter write_node, LeafWriter write_leaf) {
+        const auto& multi_node = build_node->multi_node;
+        make_node(multi_node, write_node);
+
+        for (int i = 0; i < multi_node.count; i++) {
+            if (build_node->cut || !build_node->children[i])
+                make_leaf(multi_node.nodes[i], refs, write_leaf);
+            else
+                emit(build_node->children[i], refs, write_node, write_leaf);
+        }
+    }
+
     template <typename NodeWriter>
     void make_node(const MultiNode<Node, N>& multi_node, NodeWriter write_node) {
         write_node(multi_node.bbox, multi_node.count, [&] (int i) {
@@ -211,17 +288,46 @@ private:
 #endif
     }
 
-    int compute_bin_id(float c, float min, float inv) {
+    static int compute_bin_id(float c, float min, float inv) {
         return std::min(num_bins - 1, std::max(0, (int)(num_bins * (c - min) * inv)));
     }
 
-    void bin_triangles(int axis, Bin* bins, const int* refs, const BBox* bboxes, const float3* centers, float min, float max, int begin, int end) {
+    void compute_center_bounds(int axis, const int* refs, const float3* centers, const BBox& parent_bb, int begin, int end, float& center_min, float& center_max) {
+        center_min = parent_bb.max[axis];
+        center_max = parent_bb.min[axis];
+        if (end - begin >= parallel_split_threshold) {
+            typedef std::pair<float, float> Range;
+            const Range range = tbb::parallel_reduce(tbb::blocked_range<int>(begin, end), Range(center_min, center_max),
+                [&] (const tbb::blocked_range<int>& r, Range range) {
+                    for (int i = r.begin(); i != r.end(); i++) {
+                        const float c = centers[refs[i]][axis];
+                        range.first  = std::min(range.first, c);
+                        range.second = std::max(range.second, c);
+                    }
+                    return range;
+                },
+                [] (const Range& a, const Range& b) {
+                    return Range(std::min(a.first, b.first), std::max(a.second, b.second));
+                });
+            center_min = range.first;
+            center_max = range.second;
+        } else {
+            for (int i = begin; i < end; i++) {
+                const float c = centers[refs[i]][axis];
+                center_min = std::min(center_min, c);
+                center_max = std::max(center_max, c);
+            }
+        }
+    }
+
+    static void clear_bins(Bin* bins) {
         for (int i = 0; i < num_bins; i++) {
             bins[i].count = 0;
             bins[i].bbox = BBox::empty();
         }
+    }
 
-        const float inv = 1.0f / (max - min);
+    static void fill_bins(int axis, Bin* bins, const int* refs, const BBox* bboxes, const float3* centers, float min, float inv, int begin, int end) {
         for (int i = begin; i < end; i++) {
             const int ref = refs[i];
             const int bin_id = compute_bin_id(centers[ref][axis], min, inv);
@@ -230,6 +336,29 @@ private:
         }
     }
 
+    void bin_triangles(int axis, Bin* bins, const int* refs, const BBox* bboxes, const float3* centers, float min, float max, int begin, int end) {
+        const float inv = 1.0f / (max - min);
+        if (end - begin >= parallel_split_threshold) {
+            // Every thread fills its own bins, which are merged afterwards
+            const BinSet bin_set = tbb::parallel_reduce(tbb::blocked_range<int>(begin, end), BinSet(),
+                [&] (const tbb::blocked_range<int>& range, BinSet set) {
+                    fill_bins(axis, set.bins, refs, bboxes, centers, min, inv, range.begin(), range.end());
+                    return set;
+                },
+                [] (BinSet a, const BinSet& b) {
+                    for (int i = 0; i < num_bins; i++) {
+                        a.bins[i].count += b.bins[i].count;
+                        a.bins[i].bbox.extend(b.bins[i].bbox);
+                    }
+                    return a;
+                });
+            std::copy(bin_set.bins, bin_set.bins + num_bins, bins);
+        } else {
+            clear_bins(bins);
+            fill_bins(axis, bins, refs, bboxes, centers, min, inv, begin, end);
+        }
+    }
+
     int find_best_split(const Bin* bins, float max_cost) {
         float left_cost[num_bins];
         int left_count = 0;
@@ -263,18 +392,58 @@ private:
 
     int apply_split(int axis, int split, int* refs, const float3* centers, float center_min, float center_max, int begin, int end) {
         const float inv = 1.0f / (center_max - center_min);
-        return std::partition(refs + begin, refs + end, [&] (const int ref) {
+        auto is_left = [&] (const int ref) {
             return compute_bin_id(centers[ref][axis], center_min, inv) < split;
-        }) - refs;
+        };
+
+        if (end - begin < parallel_split_threshold)
+            return std::partition(refs + begin, refs + end, is_left) - refs;
+
+        // Count the references on the left in every block, then scatter them to a temporary array, and copy them back.
+        const int block_size  = parallel_split_threshold / 4;
+        const int block_count = (end - begin + block_size - 1) / block_size;
+        std::vector<int> left_offsets(block_count + 1, 0);
+        tbb::parallel_for(tbb::blocked_range<int>(0, block_count), [&] (const tbb::blocked_range<int>& range) {
+            for (int b = range.begin(); b != range.end(); b++) {
+                const int block_end = std::min(end, begin + (b + 1) * block_size);
+                left_offsets[b + 1] = std::count_if(refs + begin + b * block_size, refs + block_end, is_left);
+            }
+        });
+        for (int b = 0; b < block_count; b++) left_offsets[b + 1] += left_offsets[b];
+
+        const int left_count = left_offsets[block_count];
+        std::vector<int> tmp(end - begin);
+        tbb::parallel_for(tbb::blocked_range<int>(0, block_count), [&] (const tbb::blocked_range<int>& range) {
+            for (int b = range.begin(); b != range.end(); b++) {
+                int left  = left_offsets[b];
+                int right = left_count + b * block_size - left_offsets[b];
+                const int block_end = std::min(end, begin + (b + 1) * block_size);
+                for (int i = begin + b * block_size; i < block_end; i++) {
+                    if (is_left(refs[i])) tmp[left++]  = refs[i];
+                    else                  tmp[right++] = refs[i];
+                }
+            }
+        });
+        tbb::parallel_for(tbb::blocked_range<int>(0, end - begin), [&] (const tbb::blocked_range<int>& range) {
+            std::copy(tmp.begin() + range.begin(), tmp.begin() + range.end(), refs + begin + range.begin());
+        });
+
+        return begin + left_count;
     }
 
+    float optimization_budget_ = 0.0f;
+
 #ifdef STATISTICS
     long total_time_ = 0;
+    long total_opt_time_ = 0;
+    int total_swaps_ = 0;
+    float cost_before_ = 0.0f;
+    float cost_after_ = 0.0f;
     int total_nodes_ = 0;
     int total_leaves_ = 0;
 #endif
 
-    MemoryPool<> mem_pool_;
+    tbb::enumerable_thread_specific<MemoryPool<> > mem_pool_;
 };
 
 } // namespace imba
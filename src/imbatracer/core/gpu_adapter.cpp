@@ -1,8 +1,10 @@
 #include <cstring>
+#include <sstream>
 
 #include "imbatracer/core/adapter.h"
 #include "imbatracer/core/sbvh_builder.h"
 #include "imbatracer/core/fast_bvh_builder.h"
+#include "imbatracer/core/bvh_refit.h"
 #include "imbatracer/core/mesh.h"
 #include "imbatracer/core/stack.h"
 #include "imbatracer/core/common.h"
@@ -11,9 +13,16 @@ namespace imba {
 
 using traversal_gpu::Node;
 
+// Parameters of the mesh acceleration structure builders
+static const int   mesh_leaf_threshold = 2;
+static const float mesh_spatial_split_alpha = 1e-5f;
+
+// Right child of the dummy parent nodes
+static const int dummy_child = 0x76543210;
+
 static void fill_dummy_parent(Node& node, const BBox& leaf_bb, int index) {
     node.left  = index;
-    node.right = 0x76543210;
+    node.right = dummy_child;
 
     node.left_bb.lo_x = leaf_bb.min.x;
     node.left_bb.lo_y = leaf_bb.min.y;
@@ -30,21 +39,46 @@ static void fill_dummy_parent(Node& node, const BBox& leaf_bb, int index) {
     node.right_bb.hi_z = -0.0f;
 }
 
+/// Writes the bounds of the two children of a node.
+static void write_bounds(Node& node, const BBox* bboxes) {
+    node.left_bb.lo_x = bboxes[0].min.x;
+    node.left_bb.lo_y = bboxes[0].min.y;
+    node.left_bb.lo_z = bboxes[0].min.z;
+    node.left_bb.hi_x = bboxes[0].max.x;
+    node.left_bb.hi_y = bboxes[0].max.y;
+    node.left_bb.hi_z = bboxes[0].max.z;
+
+    node.right_bb.lo_x = bboxes[1].min.x;
+    node.right_bb.lo_y = bboxes[1].min.y;
+    node.right_bb.lo_z = bboxes[1].min.z;
+    node.right_bb.hi_x = bboxes[1].max.x;
+    node.right_bb.hi_y = bboxes[1].max.y;
+    node.right_bb.hi_z = bboxes[1].max.z;
+}
+
 class GpuMeshAdapter : public MeshAdapter {
     std::vector<Node>& nodes_;
     std::vector<Vec4>& tris_;
 public:
-    GpuMeshAdapter(std::vector<Node>& nodes, std::vector<Vec4>& tris)
-        : nodes_(nodes), tris_(tris)
+    GpuMeshAdapter(std::vector<Node>& nodes, std::vector<Vec4>& tris, bool fast_build)
+        : nodes_(nodes), tris_(tris), fast_build_(fast_build)
     {}
 
     void build_accel(const Mesh& mesh, int mesh_id, const std::vector<int>& tri_layout) override {
         mesh_ = &mesh;
-        builder_.build(mesh, NodeWriter(this), LeafWriter(this, mesh_id, tri_layout), 2);
+        fast_builder_.set_optimization_budget(optimization_budget_);
+        builder_.set_optimization_budget(optimization_budget_);
+        if (fast_build_)
+            fast_builder_.build(mesh, NodeWriter(this), LeafWriter(this, mesh_id, tri_layout), mesh_leaf_threshold);
+        else
+            builder_.build(mesh, NodeWriter(this), LeafWriter(this, mesh_id, tri_layout), mesh_leaf_threshold, mesh_spatial_split_alpha);
     }
 
 #ifdef STATISTICS
-    void print_stats() const override { builder_.print_stats(); }
+    void print_stats() const override {
+        if (fast_build_) fast_builder_.print_stats();
+        else             builder_.print_stats();
+    }
 #endif
 
 private:
@@ -58,6 +92,7 @@ private:
     };
 
     typedef SplitBvhBuilder<2, CostFn> BvhBuilder;
+    typedef FastBvhBuilder<2, CostFn> FastBuilder;
 
     struct NodeWriter {
         GpuMeshAdapter* adapter;
@@ -151,6 +186,8 @@ private:
     Stack<StackElem> stack_;
     const Mesh* mesh_;
     BvhBuilder builder_;
+    FastBuilder fast_builder_;
+    bool fast_build_;
 };
 
 class GpuTopLevelAdapter : public TopLevelAdapter {
@@ -179,11 +216,29 @@ public:
         }
 
         // Build the acceleration structure.
+        builder_.set_optimization_budget(optimization_budget_);
         builder_.build(bounds.data(), centers.data(), instances.size(),
             NodeWriter(this, meshes, instances, root_offset),
             LeafWriter(this, meshes, instances, layout), 1);
     }
 
+    float refit_accel(const std::vector<Mesh>& meshes,
+                      const std::vector<Mesh::Instance>& instances,
+                      int root_offset) override {
+        return refit_top_level<2, CostFn>(nodes_, instance_nodes_, root_offset, meshes, instances,
+            [] (const Node& node, int i) {
+                // The right child of a dummy parent is not a node.
+                const int child = *(&node.left + i);
+                return child == dummy_child ? 0 : child;
+            },
+            [] (Node& node, const BBox* bboxes, int count) {
+                if (count == 1)
+                    fill_dummy_parent(node, bboxes[0], node.left);
+                else
+                    write_bounds(node, bboxes);
+            });
+    }
+
 private:
 #ifdef STATISTICS
     void print_stats() const override { builder_.print_stats(); }
@@ -226,21 +281,8 @@ private:
 
             assert(count == 2);
 
-            const BBox& left_bb = bboxes(0);
-            nodes[i].left_bb.lo_x = left_bb.min.x;
-            nodes[i].left_bb.lo_y = left_bb.min.y;
-            nodes[i].left_bb.lo_z = left_bb.min.z;
-            nodes[i].left_bb.hi_x = left_bb.max.x;
-            nodes[i].left_bb.hi_y = left_bb.max.y;
-            nodes[i].left_bb.hi_z = left_bb.max.z;
-
-            const BBox& right_bb = bboxes(1);
-            nodes[i].right_bb.lo_x = right_bb.min.x;
-            nodes[i].right_bb.lo_y = right_bb.min.y;
-            nodes[i].right_bb.lo_z = right_bb.min.z;
-            nodes[i].right_bb.hi_x = right_bb.max.x;
-            nodes[i].right_bb.hi_y = right_bb.max.y;
-            nodes[i].right_bb.hi_z = right_bb.max.z;
+            const BBox child_bbs[2] = { bboxes(0), bboxes(1) };
+            write_bounds(nodes[i], child_bbs);
 
             stack.push(i, 1);
             stack.push(i, 0);
@@ -307,8 +349,16 @@ private:
     BvhBuilder builder_;
 };
 
-std::unique_ptr<MeshAdapter> new_mesh_adapter_gpu(std::vector<Node>& nodes, std::vector<Vec4>& tris) {
-    return std::unique_ptr<MeshAdapter>(new GpuMeshAdapter(nodes, tris));
+std::unique_ptr<MeshAdapter> new_mesh_adapter_gpu(std::vector<Node>& nodes, std::vector<Vec4>& tris, bool fast_build) {
+    return std::unique_ptr<MeshAdapter>(new GpuMeshAdapter(nodes, tris, fast_build));
+}
+
+std::string mesh_accel_desc_gpu(bool fast_build) {
+    std::ostringstream desc;
+    desc << "gpu N=2 node=" << sizeof(Node) << " leaf=" << mesh_leaf_threshold;
+    if (fast_build) desc << " builder=binned";
+    else            desc << " builder=sbvh alpha=" << mesh_spatial_split_alpha;
+    return desc.str();
 }
 
 std::unique_ptr<TopLevelAdapter> new_top_level_adapter_gpu(std::vector<Node>& nodes, std::vector<InstanceNode>& instance_nodes) {
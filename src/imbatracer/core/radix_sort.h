@@ -0,0 +1,55 @@
+#ifndef IMBA_RADIX_SORT_H
+#define IMBA_RADIX_SORT_H
+
+#include <cstdint>
+#include <vector>
+
+#define NOMINMAX
+#include <tbb/tbb.h>
+
+#include "imbatracer/core/counting_sort.h"
+
+namespace imba {
+
+/// Stable, parallel LSD radix sort of 64-bit keys. Every digit is sorted with a parallel counting sort.
+class RadixSort {
+public:
+    /// Sorts the indices 0..count - 1 by their keys, which must be smaller than 2^bits.
+    ///
+    /// \param keys Array of count keys.
+    /// \param ids  Receives the sorted indices, must be able to hold count elements.
+    void sort(const uint64_t* keys, int count, int bits, int* ids) {
+        if (tmp_.size() < size_t(count)) {
+            tmp_.resize(count);
+            perm_.resize(count);
+        }
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, count), [&] (const tbb::blocked_range<int>& range) {
+            for (auto i = range.begin(); i != range.end(); ++i) ids[i] = i;
+        });
+
+        for (int shift = 0; shift < bits; shift += DIGIT_BITS) {
+            counting_sort_.sort(count, 1 << DIGIT_BITS, [&] (int i) {
+                return int(keys[ids[i]] >> shift) & ((1 << DIGIT_BITS) - 1);
+            }, tmp_.data());
+
+            tbb::parallel_for(tbb::blocked_range<int>(0, count), [&] (const tbb::blocked_range<int>& range) {
+                for (auto i = range.begin(); i != range.end(); ++i) perm_[i] = ids[tmp_[i]];
+            });
+            tbb::parallel_for(tbb::blocked_range<int>(0, count), [&] (const tbb::blocked_range<int>& range) {
+                for (auto i = range.begin(); i != range.end(); ++i) ids[i] = perm_[i];
+            });
+        }
+    }
+
+private:
+    static constexpr int DIGIT_BITS = 8;
+
+    CountingSort counting_sort_;
+    std::vector<int> tmp_;
+    std::vector<int> perm_;
+};
+
+} // namespace imba
+
+#endif // IMBA_RADIX_SORT_H
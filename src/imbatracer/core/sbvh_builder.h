@@ -6,10 +6,16 @@
 #include <cassert>
 #include <chrono>
 #include <iostream>
+#include <atomic>
+#include <vector>
+
+#define NOMINMAX
+#include <tbb/tbb.h>
 
 #include "imbatracer/core/common.h"
 #include "imbatracer/core/mem_pool.h"
 #include "imbatracer/core/bvh_helper.h"
+#include "imbatracer/core/bvh_optimizer.h"
 #include "imbatracer/core/float4.h"
 #include "imbatracer/core/stack.h"
 #include "imbatracer/core/mesh.h"
@@ -19,7 +25,9 @@
 namespace imba {
 
 /// Builds a SBVH (Spatial split BVH), given the set of triangles and the alpha parameter
-/// that controls when to do a spatial split. The tree is built in depth-first order.
+/// that controls when to do a spatial split. Large subtrees are built in parallel, and the
+/// split searches of large nodes are parallelized. The nodes are then written in depth-first
+/// order by a single thread, which gives the same output as a serial build.
 /// See  Stich et al., "Spatial Splits in Bounding Volume Hierarchies", 2009
 /// http://www.nvidia.com/docs/IO/77714/sbvh.pdf
 template <int N, typename CostFn>
@@ -36,134 +44,42 @@ public:
 
         const int tri_count = mesh.triangle_count();
 
-        Ref* initial_refs = mem_pool_.alloc<Ref>(tri_count);
-        right_bbs_ = mem_pool_.alloc<BBox>(std::max((int)spatial_bins, tri_count));
-        BBox mesh_bb = BBox::empty();
-        for (int i = 0; i < tri_count; i++) {
-            const Tri& tri = mesh.triangle(i);
-            tri.compute_bbox(initial_refs[i].bb);
-            mesh_bb.extend(initial_refs[i].bb);
-            initial_refs[i].id = i;
-        }
-
-        const float spatial_threshold = mesh_bb.half_area() * alpha;
-
-        Stack<Node> stack;
-        stack.push(initial_refs, tri_count, mesh_bb);
-
-        while (!stack.is_empty()) {
-            MultiNode<Node, N> multi_node(stack.pop());
-
-            // Iterate over the available split candidates in the multi-node
-            while (!multi_node.is_full() && multi_node.node_available()) {
-                const int node_id = multi_node.next_node();
-                Node node = multi_node.nodes[node_id];
-                Ref* refs = node.refs;
-                int ref_count = node.ref_count;
-                const BBox& parent_bb = node.bbox;
-                assert(ref_count != 0);
-
-                if (ref_count <= leaf_threshold) {
-                    // This candidate does not have enough triangles
-                    multi_node.nodes[node_id].tested = true;
-                    continue;
+        Ref* initial_refs = mem_pool_.local().template alloc<Ref>(tri_count);
+        BBox mesh_bb = tbb::parallel_reduce(tbb::blocked_range<int>(0, tri_count), BBox::empty(),
+            [&] (const tbb::blocked_range<int>& range, BBox bb) {
+                for (int i = range.begin(); i != range.end(); i++) {
+                    const Tri& tri = mesh.triangle(i);
+                    tri.compute_bbox(initial_refs[i].bb);
+                    bb.extend(initial_refs[i].bb);
+                    initial_refs[i].id = i;
                 }
+                return bb;
+            },
+            [] (BBox a, const BBox& b) { return a.extend(b); });
 
-                // Try object splits
-                ObjectSplit object_split;
-                for (int axis = 0; axis < 3; axis++)
-                    find_object_split(object_split, axis, refs, ref_count);
-
-                SpatialSplit spatial_split;
-                if (BBox(object_split.left_bb).overlap(object_split.right_bb).half_area() > spatial_threshold) {
-                    // Try spatial splits
-                    for (int axis = 0; axis < 3; axis++) {
-                        if (parent_bb.min[axis] == parent_bb.max[axis])
-                            continue;
-                        find_spatial_split(spatial_split, parent_bb, mesh, axis, refs, ref_count);
-                    }
-                }
-
-                bool spatial = spatial_split.cost < object_split.cost;
-                const float split_cost = spatial ? spatial_split.cost : object_split.cost;
-
-                if (split_cost + CostFn::traversal_cost(parent_bb.half_area()) >= node.cost) {
-                    // Split is not beneficial
-                    multi_node.nodes[node_id].tested = true;
-                    continue;
-                }
-
-                if (spatial) {
-                    Ref* left_refs, *right_refs;
-                    BBox left_bb, right_bb;
-                    int left_count, right_count;
-                    apply_spatial_split(spatial_split, mesh,
-                                        refs, ref_count,
-                                        left_refs, left_count, left_bb,
-                                        right_refs, right_count, right_bb);
-
-                    multi_node.split_node(node_id,
-                                          Node(left_refs,  left_count,  left_bb),
-                                          Node(right_refs, right_count, right_bb));
-
-#ifdef STATISTICS
-                    spatial_splits_++;
-#endif
-                } else {
-                    // Partitioning can be done in-place
-                    apply_object_split(object_split, refs, ref_count);
-
-                    const int right_count = ref_count - object_split.left_count;
-                    const int left_count = object_split.left_count;
-
-                    Ref *right_refs = refs + object_split.left_count;
-                    Ref* left_refs = refs;
-
-                    multi_node.split_node(node_id,
-                                          Node(left_refs,  left_count,  object_split.left_bb),
-                                          Node(right_refs, right_count, object_split.right_bb));
-#ifdef STATISTICS
-                    object_splits_++;
-#endif
-                }
-            }
-
-            assert(multi_node.count > 0);
-            // Process the smallest nodes first
-            multi_node.sort_nodes();
-
-            // The multi-node is ready to be stored
-            if (multi_node.is_leaf()) {
-                // Store a leaf if it could not be split
-                const Node& node = multi_node.nodes[0];
-                assert(node.tested);
-                make_leaf(node, write_leaf);
-            } else {
-                // Store a multi-node
-                make_node(multi_node, write_node);
-                assert(N > 2 || multi_node.count == 2);
+        const float spatial_threshold = mesh_bb.half_area() * alpha;
 
-                if (stack.size() + multi_node.count < stack.capacity()) {
-                    for (int i = multi_node.count - 1; i >= 0; i--) {
-                        stack.push(multi_node.nodes[i]);
-                    }
-                } else {
-                    // Insufficient space on the stack, we have to stop recursion here
-                    for (int i = 0; i < multi_node.count; i++) {
-                        make_leaf(multi_node.nodes[i], write_leaf);
-                    }
-                }
-            }
-        }
+        // Build the tree in memory first, then write it in the order of the serial builder.
+        Node root(initial_refs, tri_count, mesh_bb);
+        TreeNode* build_root = build_subtree(root, 0, mesh, leaf_threshold, spatial_threshold);
+        if (build_root && optimization_budget_ > 0.0f)
+            optimize(build_root);
+        if (build_root)
+            emit(build_root, write_node, write_leaf);
+        else
+            make_leaf(root, write_leaf);
 
 #ifdef STATISTICS
         auto time_end = std::chrono::high_resolution_clock::now();
         total_time_ += std::chrono::duration_cast<std::chrono::milliseconds>(time_end - time_start).count();
 #endif
 
-        mem_pool_.cleanup();
+        for (auto& pool : mem_pool_) pool.cleanup();
     }
 
+    /// Spends up to the given time (in milliseconds) reducing the SAH cost of every tree, before it is written.
+    void set_optimization_budget(float ms) { optimization_budget_ = ms; }
+
 #ifdef STATISTICS
     void print_stats() const {
         std::cout << "BVH built in " << total_time_ << "ms ("
@@ -173,6 +89,12 @@ public:
                   << spatial_splits_ << " spatial splits, "
                   << "+" << (total_refs_ - total_tris_) * 100  / total_tris_ << "% references)"
                   << std::endl;
+        if (optimization_budget_ > 0.0f) {
+            std::cout << "BVH optimized in " << total_opt_time_ << "ms ("
+                      << total_swaps_ << " exchanged subtrees, SAH cost reduced by "
+                      << (cost_before_ > 0.0f ? 100.0f * (1.0f - cost_after_ / cost_before_) : 0.0f) << "%)"
+                      << std::endl;
+        }
     }
 #endif
 
@@ -180,6 +102,11 @@ private:
     static constexpr int spatial_bins = 64;
     static constexpr int binning_passes = 2;
 
+    /// Subtrees with at least this many references are built by a separate task.
+    static constexpr int parallel_build_threshold = 4096;
+    /// Nodes with at least this many references have their split searches parallelized.
+    static constexpr int parallel_split_threshold = 1 << 16;
+
     struct Ref {
         uint32_t id;
         BBox bb;
@@ -228,6 +155,170 @@ private:
         int size() const { return ref_count; }
     };
 
+    typedef imba::BuildNode<Node, N> TreeNode;
+
+    /// Splits the given node as long as it is beneficial, and returns the resulting subtree, or nullptr for a leaf.
+    /// The stack size is the number of nodes that would be on the stack of the serial builder after popping this node.
+    TreeNode* build_subtree(const Node& node, int stack_size, const Mesh& mesh, int leaf_threshold, float spatial_threshold) {
+        MultiNode<Node, N> multi_node(node);
+
+        // Iterate over the available split candidates in the multi-node
+        while (!multi_node.is_full() && multi_node.node_available()) {
+            const int node_id = multi_node.next_node();
+            Node node = multi_node.nodes[node_id];
+            Ref* refs = node.refs;
+            int ref_count = node.ref_count;
+            const BBox& parent_bb = node.bbox;
+            assert(ref_count != 0);
+
+            if (ref_count <= leaf_threshold) {
+                // This candidate does not have enough triangles
+                multi_node.nodes[node_id].tested = true;
+                continue;
+            }
+
+            // Try object splits
+            ObjectSplit object_split;
+            std::vector<Ref> sorted_refs[2];
+            if (ref_count >= parallel_split_threshold) {
+                // The last axis sorts the references in-place, as in the serial loop.
+                sorted_refs[0].assign(refs, refs + ref_count);
+                sorted_refs[1].assign(refs, refs + ref_count);
+                ObjectSplit axis_splits[3];
+                tbb::parallel_invoke(
+                    [&] { find_object_split(axis_splits[0], 0, sorted_refs[0].data(), ref_count); },
+                    [&] { find_object_split(axis_splits[1], 1, sorted_refs[1].data(), ref_count); },
+                    [&] { find_object_split(axis_splits[2], 2, refs, ref_count); });
+                for (int axis = 0; axis < 3; axis++) {
+                    if (axis_splits[axis].cost < object_split.cost)
+                        object_split = axis_splits[axis];
+                }
+            } else {
+                for (int axis = 0; axis < 3; axis++)
+                    find_object_split(object_split, axis, refs, ref_count);
+            }
+
+            SpatialSplit spatial_split;
+            if (BBox(object_split.left_bb).overlap(object_split.right_bb).half_area() > spatial_threshold) {
+                // Try spatial splits
+                for (int axis = 0; axis < 3; axis++) {
+                    if (parent_bb.min[axis] == parent_bb.max[axis])
+                        continue;
+                    find_spatial_split(spatial_split, parent_bb, mesh, axis, refs, ref_count);
+                }
+            }
+
+            bool spatial = spatial_split.cost < object_split.cost;
+            const float split_cost = spatial ? spatial_split.cost : object_split.cost;
+
+            if (split_cost + CostFn::traversal_cost(parent_bb.half_area()) >= node.cost) {
+                // Split is not beneficial
+                multi_node.nodes[node_id].tested = true;
+                continue;
+            }
+
+            if (spatial) {
+                Ref* left_refs, *right_refs;
+                BBox left_bb, right_bb;
+                int left_count, right_count;
+                apply_spatial_split(spatial_split, mesh,
+                                    refs, ref_count,
+                                    left_refs, left_count, left_bb,
+                                    right_refs, right_count, right_bb);
+
+                multi_node.split_node(node_id,
+                                      Node(left_refs,  left_count,  left_bb),
+                                      Node(right_refs, right_count, right_bb));
+
+#ifdef STATISTICS
+                spatial_splits_++;
+#endif
+            } else {
+                // Partitioning can be done in-place
+                if (object_split.axis < 2 && !sorted_refs[object_split.axis].empty())
+                    std::copy(sorted_refs[object_split.axis].begin(), sorted_refs[object_split.axis].end(), refs);
+                else
+                    apply_object_split(object_split, refs, ref_count);
+
+                const int right_count = ref_count - object_split.left_count;
+                const int left_count = object_split.left_count;
+
+                Ref *right_refs = refs + object_split.left_count;
+                Ref* left_refs = refs;
+
+                multi_node.split_node(node_id,
+                                      Node(left_refs,  left_count,  object_split.left_bb),
+                                      Node(right_refs, right_count, object_split.right_bb));
+#ifdef STATISTICS
+                object_splits_++;
+#endif
+            }
+        }
+
+        assert(multi_node.count > 0);
+        // Process the smallest nodes first
+        multi_node.sort_nodes();
+
+        // Leaves are stored by the parent
+        if (multi_node.is_leaf()) {
+            assert(multi_node.nodes[0].tested);
+            return nullptr;
+        }
+
+        assert(N > 2 || multi_node.count == 2);
+        TreeNode* build_node = new (mem_pool_.local().template alloc<TreeNode>(1)) TreeNode(multi_node);
+
+        if (stack_size + multi_node.count >= Stack<Node>::capacity()) {
+            // Insufficient space on the stack, we have to stop recursion here
+            build_node->cut = true;
+            return build_node;
+        }
+
+        // The children are disjoint sets of references, and can thus be built independently.
+        tbb::task_group children;
+        for (int i = 0; i < multi_node.count; i++) {
+            const Node& child = multi_node.nodes[i];
+            const int child_stack_size = stack_size + multi_node.count - 1 - i;
+            if (child.ref_count >= parallel_build_threshold) {
+                children.run([=, &mesh] {
+                    build_node->children[i] = build_subtree(child, child_stack_size, mesh, leaf_threshold, spatial_threshold);
+                });
+            } else {
+                build_node->children[i] = build_subtree(child, child_stack_size, mesh, leaf_threshold, spatial_threshold);
+            }
+        }
+        children.wait();
+
+        return build_node;
+    }
+
+    void optimize(TreeNode* root) {
+        BvhOptimizer<Node, N, CostFn> optimizer(optimization_budget_, Stack<Node>::capacity());
+#ifdef STATISTICS
+        auto time_start = std::chrono::high_resolution_clock::now();
+        cost_before_ += optimizer.cost(root);
+        total_swaps_ += optimizer.optimize(root);
+        cost_after_ += optimizer.cost(root);
+        auto time_end = std::chrono::high_resolution_clock::now();
+        total_opt_time_ += std::chrono::duration_cast<std::chrono::milliseconds>(time_end - time_start).count();
+#else
+        optimizer.optimize(root);
+#endif
+    }
+
+    template <typename NodeWriter, typename LeafWriter>
+    void emit(const TreeNode* build_node, NodeWriter write_node, LeafWriter write_leaf) {
+        const auto& multi_node = build_node->multi_node;
+        make_node(multi_node, write_node);
+
+        for (int i = 0; i < multi_node.count; i++) {
+            if (build_node->cut || !build_node->children[i])
+                make_leaf(multi_node.nodes[i], write_leaf);
+            else
+                emit(build_node->children[i], write_node, write_leaf);
+        }
+    }
+
     template <typename NodeWriter>
     void make_node(const MultiNode<Node, N>& multi_node, NodeWriter write_node) {
         write_node(multi_node.bbox, multi_node.count, [&] (int i) {
@@ -249,13 +340,26 @@ private:
 #endif
     }
 
+    /// Returns a scratch array of at least the given size, local to the calling thread.
+    /// It must not be used across calls to TBB, as the thread could pick up another task in the meantime.
+    BBox* scratch_bbs(int count) {
+        auto& bbs = scratch_bbs_.local();
+        if (bbs.size() < size_t(count)) bbs.resize(count);
+        return bbs.data();
+    }
+
     void sort_refs(int axis, Ref* refs, int ref_count) {
-        // Sort the primitives based on their centroids
-        std::sort(refs, refs + ref_count, [axis] (const Ref& a, const Ref& b) {
+        // Sort the primitives based on their centroids.
+        // The order is total since a node never contains the same triangle twice, so both sorts give the same result.
+        auto cmp = [axis] (const Ref& a, const Ref& b) {
             const float ca = a.bb.min[axis] + a.bb.max[axis];
             const float cb = b.bb.min[axis] + b.bb.max[axis];
             return (ca < cb) || (ca == cb && a.id < b.id);
-        });
+        };
+        if (ref_count >= parallel_split_threshold)
+            tbb::parallel_sort(refs, refs + ref_count, cmp);
+        else
+            std::sort(refs, refs + ref_count, cmp);
     }
 
     void find_object_split(ObjectSplit& split, int axis, Ref* refs, int ref_count) {
@@ -264,23 +368,24 @@ private:
         sort_refs(axis, refs, ref_count);
 
         // Sweep from the right and accumulate the bounding boxes
+        BBox* right_bbs = scratch_bbs(ref_count);
         BBox cur_bb = BBox::empty();
         for (int i = ref_count - 1; i > 0; i--) {
             cur_bb.extend(refs[i].bb);
-            right_bbs_[i - 1] = cur_bb;
+            right_bbs[i - 1] = cur_bb;
         }
 
         // Sweep from the left and compute the SAH cost
         cur_bb = BBox::empty();
         for (int i = 0; i < ref_count - 1; i++) {
             cur_bb.extend(refs[i].bb);
-            const float cost = CostFn::leaf_cost(i + 1, cur_bb.half_area()) + CostFn::leaf_cost(ref_count - i - 1, right_bbs_[i].half_area());
+            const float cost = CostFn::leaf_cost(i + 1, cur_bb.half_area()) + CostFn::leaf_cost(ref_count - i - 1, right_bbs[i].half_area());
             if (cost < split.cost) {
                 split.axis = axis;
                 split.cost = cost;
                 split.left_count = i + 1;
                 split.left_bb = cur_bb;
-                split.right_bb = right_bbs_[i];
+                split.right_bb = right_bbs[i];
             }
         }
 
@@ -291,18 +396,24 @@ private:
         sort_refs(split.axis, refs, ref_count);
     }
 
-    int spatial_binning(Bin* bins, int num_bins, SpatialSplit& split,
-                         const Mesh& mesh, int axis,
-                         Ref* refs, int ref_count,
-                         float axis_min, float axis_max) {
-        // Initialize bins
+    struct BinSet {
+        std::vector<Bin> bins;
+
+        BinSet(int num_bins) : bins(num_bins) { clear_bins(bins.data(), num_bins); }
+    };
+
+    static void clear_bins(Bin* bins, int num_bins) {
         for (int i = 0; i < num_bins; i++) {
             bins[i].entry = 0;
             bins[i].exit = 0;
             bins[i].bb = BBox::empty();
         }
+    }
 
-        // Put the primitives in the bins
+    static void fill_bins(Bin* bins, int num_bins,
+                          const Mesh& mesh, int axis,
+                          const Ref* refs, int ref_count,
+                          float axis_min, float axis_max) {
         const float bin_size = (axis_max - axis_min) / num_bins;
         const float inv_size = 1.0f / bin_size;
         for (int i = 0; i < ref_count; i++) {
@@ -323,12 +434,41 @@ private:
             bins[first_bin].entry++;
             bins[last_bin].exit++;
         }
+    }
+
+    int spatial_binning(Bin* bins, int num_bins, SpatialSplit& split,
+                         const Mesh& mesh, int axis,
+                         Ref* refs, int ref_count,
+                         float axis_min, float axis_max) {
+        // Put the primitives in the bins
+        const float bin_size = (axis_max - axis_min) / num_bins;
+        if (ref_count >= parallel_split_threshold) {
+            // Bounding box unions and counts are exact, hence the bins do not depend on the order of the merges.
+            BinSet bin_set = tbb::parallel_reduce(tbb::blocked_range<int>(0, ref_count), BinSet(num_bins),
+                [&] (const tbb::blocked_range<int>& range, BinSet set) {
+                    fill_bins(set.bins.data(), num_bins, mesh, axis, refs + range.begin(), range.size(), axis_min, axis_max);
+                    return set;
+                },
+                [num_bins] (BinSet a, const BinSet& b) {
+                    for (int i = 0; i < num_bins; i++) {
+                        a.bins[i].bb.extend(b.bins[i].bb);
+                        a.bins[i].entry += b.bins[i].entry;
+                        a.bins[i].exit  += b.bins[i].exit;
+                    }
+                    return a;
+                });
+            std::copy(bin_set.bins.begin(), bin_set.bins.end(), bins);
+        } else {
+            clear_bins(bins, num_bins);
+            fill_bins(bins, num_bins, mesh, axis, refs, ref_count, axis_min, axis_max);
+        }
 
         // Sweep from the right and accumulate the bounding boxes
+        BBox* right_bbs = scratch_bbs(num_bins);
         BBox cur_bb = BBox::empty();
         for (int i = num_bins - 1; i > 0; i--) {
             cur_bb.extend(bins[i].bb);
-            right_bbs_[i - 1] = cur_bb;
+            right_bbs[i - 1] = cur_bb;
         }
 
         // Sweep from the left and compute the SAH cost
@@ -341,7 +481,7 @@ private:
             right_count -= bins[i].exit;
             cur_bb.extend(bins[i].bb);
 
-            const float cost = CostFn::leaf_cost(left_count, cur_bb.half_area()) + CostFn::leaf_cost(right_count, right_bbs_[i].half_area());
+            const float cost = CostFn::leaf_cost(left_count, cur_bb.half_area()) + CostFn::leaf_cost(right_count, right_bbs[i].half_area());
             if (cost < split.cost) {
                 split.axis = axis;
                 split.cost = cost;
@@ -456,7 +596,7 @@ private:
         } else {
             // We need to reallocate a new array for the right child
             left_refs = refs;
-            right_refs = mem_pool_.alloc<Ref>(right_count);
+            right_refs = mem_pool_.local().template alloc<Ref>(right_count);
             std::copy(refs + first_right, refs + ref_count, right_refs + dup_refs.size());
             std::copy(dup_refs.begin(), dup_refs.end(), right_refs);
         }
@@ -466,18 +606,24 @@ private:
     }
 
 
+    float optimization_budget_ = 0.0f;
+
 #ifdef STATISTICS
     long total_time_ = 0;
+    long total_opt_time_ = 0;
+    int total_swaps_ = 0;
+    float cost_before_ = 0.0f;
+    float cost_after_ = 0.0f;
     int total_nodes_ = 0;
     int total_leaves_ = 0;
     int total_refs_ = 0;
     int total_tris_ = 0;
-    int spatial_splits_ = 0;
-    int object_splits_ = 0;
+    std::atomic<int> spatial_splits_{0};
+    std::atomic<int> object_splits_{0};
 #endif
 
-    BBox* right_bbs_;
-    MemoryPool<> mem_pool_;
+    tbb::enumerable_thread_specific<std::vector<BBox> > scratch_bbs_;
+    tbb::enumerable_thread_specific<MemoryPool<> > mem_pool_;
 };
 
 } // namespace imba
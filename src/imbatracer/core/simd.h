@@ -0,0 +1,172 @@
+#ifndef IMBA_SIMD_H
+#define IMBA_SIMD_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define IMBA_HAS_SSE
+#endif
+
+#ifdef __AVX__
+#include <immintrin.h>
+#define IMBA_HAS_AVX
+#endif
+
+namespace imba {
+
+/// Vector of N floats. Mapped to SSE registers for N = 4 and to AVX registers for N = 8,
+/// when the instruction sets are enabled. Otherwise, the lanes are processed one by one.
+template <int N>
+struct vfloat {
+    float v[N];
+
+    vfloat() {}
+    explicit vfloat(float f) { for (int i = 0; i < N; i++) v[i] = f; }
+
+    static vfloat load(const float* p) { vfloat r; for (int i = 0; i < N; i++) r.v[i] = p[i]; return r; }
+    /// Loads N bytes, and converts them to floats.
+    static vfloat load(const uint8_t* p) { vfloat r; for (int i = 0; i < N; i++) r.v[i] = p[i]; return r; }
+    void store(float* p) const { for (int i = 0; i < N; i++) p[i] = v[i]; }
+};
+
+/// Mask of N lanes, result of a comparison between vectors.
+template <int N>
+struct vbool {
+    bool v[N];
+
+    /// Returns the mask as an integer, with one bit per lane.
+    int bits() const { int r = 0; for (int i = 0; i < N; i++) r |= v[i] ? 1 << i : 0; return r; }
+};
+
+#define IMBA_VFLOAT_OP(op) \
+    template <int N> inline vfloat<N> operator op (const vfloat<N>& a, const vfloat<N>& b) { \
+        vfloat<N> r; for (int i = 0; i < N; i++) r.v[i] = a.v[i] op b.v[i]; return r; \
+    }
+#define IMBA_VFLOAT_CMP(op) \
+    template <int N> inline vbool<N> operator op (const vfloat<N>& a, const vfloat<N>& b) { \
+        vbool<N> r; for (int i = 0; i < N; i++) r.v[i] = a.v[i] op b.v[i]; return r; \
+    }
+
+IMBA_VFLOAT_OP(+)
+IMBA_VFLOAT_OP(-)
+IMBA_VFLOAT_OP(*)
+IMBA_VFLOAT_OP(/)
+IMBA_VFLOAT_CMP(<)
+IMBA_VFLOAT_CMP(<=)
+IMBA_VFLOAT_CMP(>)
+IMBA_VFLOAT_CMP(>=)
+IMBA_VFLOAT_CMP(!=)
+
+#undef IMBA_VFLOAT_OP
+#undef IMBA_VFLOAT_CMP
+
+template <int N> inline vbool<N> operator & (const vbool<N>& a, const vbool<N>& b) {
+    vbool<N> r; for (int i = 0; i < N; i++) r.v[i] = a.v[i] && b.v[i]; return r;
+}
+template <int N> inline vfloat<N> min(const vfloat<N>& a, const vfloat<N>& b) {
+    vfloat<N> r; for (int i = 0; i < N; i++) r.v[i] = std::min(a.v[i], b.v[i]); return r;
+}
+template <int N> inline vfloat<N> max(const vfloat<N>& a, const vfloat<N>& b) {
+    vfloat<N> r; for (int i = 0; i < N; i++) r.v[i] = std::max(a.v[i], b.v[i]); return r;
+}
+template <int N> inline vfloat<N> abs(const vfloat<N>& a) {
+    vfloat<N> r; for (int i = 0; i < N; i++) r.v[i] = std::fabs(a.v[i]); return r;
+}
+/// Flips the sign of the lanes of a for which the lane of b is negative.
+template <int N> inline vfloat<N> mulsign(const vfloat<N>& a, const vfloat<N>& b) {
+    vfloat<N> r; for (int i = 0; i < N; i++) r.v[i] = std::signbit(b.v[i]) ? -a.v[i] : a.v[i]; return r;
+}
+
+#ifdef IMBA_HAS_SSE
+template <>
+struct vfloat<4> {
+    __m128 v;
+
+    vfloat() {}
+    vfloat(__m128 v) : v(v) {}
+    explicit vfloat(float f) : v(_mm_set1_ps(f)) {}
+
+    static vfloat load(const float* p) { return _mm_loadu_ps(p); }
+    static vfloat load(const uint8_t* p) { return _mm_cvtepi32_ps(load_bytes(p)); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+
+    /// Loads 4 bytes and zero-extends them to 32-bit integers.
+    static __m128i load_bytes(const uint8_t* p) {
+        int32_t bytes;
+        std::memcpy(&bytes, p, sizeof(bytes));
+        const __m128i zero = _mm_setzero_si128();
+        return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+    }
+};
+
+template <>
+struct vbool<4> {
+    __m128 v;
+
+    vbool(__m128 v) : v(v) {}
+    int bits() const { return _mm_movemask_ps(v); }
+};
+
+inline vfloat<4> operator + (const vfloat<4>& a, const vfloat<4>& b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat<4> operator - (const vfloat<4>& a, const vfloat<4>& b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat<4> operator * (const vfloat<4>& a, const vfloat<4>& b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat<4> operator / (const vfloat<4>& a, const vfloat<4>& b) { return _mm_div_ps(a.v, b.v); }
+inline vbool<4> operator <  (const vfloat<4>& a, const vfloat<4>& b) { return _mm_cmplt_ps(a.v, b.v); }
+inline vbool<4> operator <= (const vfloat<4>& a, const vfloat<4>& b) { return _mm_cmple_ps(a.v, b.v); }
+inline vbool<4> operator >  (const vfloat<4>& a, const vfloat<4>& b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline vbool<4> operator >= (const vfloat<4>& a, const vfloat<4>& b) { return _mm_cmpge_ps(a.v, b.v); }
+inline vbool<4> operator != (const vfloat<4>& a, const vfloat<4>& b) { return _mm_cmpneq_ps(a.v, b.v); }
+inline vbool<4> operator & (const vbool<4>& a, const vbool<4>& b) { return _mm_and_ps(a.v, b.v); }
+inline vfloat<4> min(const vfloat<4>& a, const vfloat<4>& b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat<4> max(const vfloat<4>& a, const vfloat<4>& b) { return _mm_max_ps(a.v, b.v); }
+inline vfloat<4> abs(const vfloat<4>& a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+inline vfloat<4> mulsign(const vfloat<4>& a, const vfloat<4>& b) { return _mm_xor_ps(a.v, _mm_and_ps(b.v, _mm_set1_ps(-0.0f))); }
+#endif // IMBA_HAS_SSE
+
+#ifdef IMBA_HAS_AVX
+template <>
+struct vfloat<8> {
+    __m256 v;
+
+    vfloat() {}
+    vfloat(__m256 v) : v(v) {}
+    explicit vfloat(float f) : v(_mm256_set1_ps(f)) {}
+
+    static vfloat load(const float* p) { return _mm256_loadu_ps(p); }
+    static vfloat load(const uint8_t* p) {
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(vfloat<4>::load(p).v), vfloat<4>::load(p + 4).v, 1);
+    }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+};
+
+template <>
+struct vbool<8> {
+    __m256 v;
+
+    vbool(__m256 v) : v(v) {}
+    int bits() const { return _mm256_movemask_ps(v); }
+};
+
+inline vfloat<8> operator + (const vfloat<8>& a, const vfloat<8>& b) { return _mm256_add_ps(a.v, b.v); }
+inline vfloat<8> operator - (const vfloat<8>& a, const vfloat<8>& b) { return _mm256_sub_ps(a.v, b.v); }
+inline vfloat<8> operator * (const vfloat<8>& a, const vfloat<8>& b) { return _mm256_mul_ps(a.v, b.v); }
+inline vfloat<8> operator / (const vfloat<8>& a, const vfloat<8>& b) { return _mm256_div_ps(a.v, b.v); }
+inline vbool<8> operator <  (const vfloat<8>& a, const vfloat<8>& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline vbool<8> operator <= (const vfloat<8>& a, const vfloat<8>& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline vbool<8> operator >  (const vfloat<8>& a, const vfloat<8>& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline vbool<8> operator >= (const vfloat<8>& a, const vfloat<8>& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline vbool<8> operator != (const vfloat<8>& a, const vfloat<8>& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_NEQ_UQ); }
+inline vbool<8> operator & (const vbool<8>& a, const vbool<8>& b) { return _mm256_and_ps(a.v, b.v); }
+inline vfloat<8> min(const vfloat<8>& a, const vfloat<8>& b) { return _mm256_min_ps(a.v, b.v); }
+inline vfloat<8> max(const vfloat<8>& a, const vfloat<8>& b) { return _mm256_max_ps(a.v, b.v); }
+inline vfloat<8> abs(const vfloat<8>& a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline vfloat<8> mulsign(const vfloat<8>& a, const vfloat<8>& b) { return _mm256_xor_ps(a.v, _mm256_and_ps(b.v, _mm256_set1_ps(-0.0f))); }
+#endif // IMBA_HAS_AVX
+
+} // namespace imba
+
+#endif // IMBA_SIMD_H
@@ -0,0 +1,124 @@
+#ifndef IMBA_THREAD_LOCAL_IMAGE_H
+#define IMBA_THREAD_LOCAL_IMAGE_H
+
+#include "imbatracer/core/image.h"
+#include "imbatracer/core/rgb.h"
+
+#define NOMINMAX
+#include <tbb/tbb.h>
+
+#include <cassert>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace imba {
+
+/// Accumulates contributions in one buffer per thread, so that no atomic operation is needed per contribution.
+/// The buffers are split into blocks of pixels, which are allocated when a thread first writes to them. Only the
+/// blocks written during an iteration are added to the image by merge(), and the others are released.
+class ThreadLocalImage {
+public:
+    ThreadLocalImage() : pixel_count_(0), block_count_(0) {}
+
+    ThreadLocalImage(const ThreadLocalImage&) = delete;
+    ThreadLocalImage& operator= (const ThreadLocalImage&) = delete;
+
+    /// Prepares the buffers for an image with the given number of pixels. Not thread-safe.
+    void resize(int pixel_count) {
+        if (pixel_count == pixel_count_)
+            return;
+
+        // Buffers are allocated by every thread on its first contribution.
+        pixel_count_ = pixel_count;
+        block_count_ = (pixel_count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        buffers_.clear();
+    }
+
+    /// Adds a contribution to the buffer of the calling thread.
+    void add(int pixel_id, const rgb& contrib) {
+        auto& buffer = buffers_.local();
+        if (buffer.blocks.empty()) {
+            buffer.blocks.resize(block_count_);
+            buffer.dirty_flags.resize(block_count_, false);
+        }
+
+        const int b = pixel_id / BLOCK_SIZE;
+        if (!buffer.dirty_flags[b]) {
+            buffer.dirty_flags[b] = true;
+            buffer.dirty.push_back(b);
+            if (!buffer.blocks[b]) {
+                buffer.blocks[b].reset(new rgb[BLOCK_SIZE]);
+                std::fill(buffer.blocks[b].get(), buffer.blocks[b].get() + BLOCK_SIZE, rgb(0.0f));
+            }
+        }
+        buffer.blocks[b][pixel_id % BLOCK_SIZE] += contrib;
+    }
+
+    /// Adds the contributions of all threads to the given image and clears the buffers.
+    /// Must not be called concurrently with add().
+    void merge(AtomicImage& out) {
+        assert(out.size() == pixel_count_);
+
+        // Gather the written blocks of all threads, sorted by position in the image.
+        std::vector<std::pair<int, rgb*> > used;
+        for (auto& buffer : buffers_) {
+            for (int b = 0; b < int(buffer.blocks.size()); b++) {
+                if (buffer.dirty_flags[b])
+                    used.emplace_back(b, buffer.blocks[b].get());
+                else
+                    buffer.blocks[b].reset();
+            }
+            for (auto b : buffer.dirty)
+                buffer.dirty_flags[b] = false;
+            buffer.dirty.clear();
+        }
+
+        if (used.empty())
+            return;
+
+        std::sort(used.begin(), used.end());
+        std::vector<int> starts;
+        for (int i = 0; i < int(used.size()); i++) {
+            if (i == 0 || used[i].first != used[i - 1].first)
+                starts.push_back(i);
+        }
+        starts.push_back(used.size());
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, starts.size() - 1),
+            [&] (const tbb::blocked_range<int>& range)
+        {
+            for (auto k = range.begin(); k != range.end(); ++k) {
+                const int first = used[starts[k]].first * BLOCK_SIZE;
+                const int count = std::min(pixel_count_ - first, int(BLOCK_SIZE));
+                for (int i = 0; i < count; ++i) {
+                    rgb sum(0.0f);
+                    for (int j = starts[k]; j < starts[k + 1]; j++) {
+                        sum += used[j].second[i];
+                        used[j].second[i] = rgb(0.0f);
+                    }
+
+                    // Every pixel is written by one thread only, no need for atomic read-modify-write operations.
+                    out.pixels()[first + i] = rgb(out.pixels()[first + i]) + sum;
+                }
+            }
+        });
+    }
+
+private:
+    static constexpr int BLOCK_SIZE = 1024;
+
+    struct Buffer {
+        std::vector<std::unique_ptr<rgb[]> > blocks; ///< Blocks of pixels, or null if not allocated
+        std::vector<bool> dirty_flags;               ///< True for the blocks written since the last merge
+        std::vector<int> dirty;                      ///< Indices of the blocks written since the last merge
+    };
+
+    tbb::enumerable_thread_specific<Buffer> buffers_;
+    int pixel_count_;
+    int block_count_;
+};
+
+} // namespace imba
+
+#endif // IMBA_THREAD_LOCAL_IMAGE_H
@@ -0,0 +1,465 @@
+#include <cmath>
+#include <cassert>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include "imbatracer/core/traversal_native.h"
+#include "imbatracer/core/common.h"
+#include "imbatracer/core/simd.h"
+#include "imbatracer/core/stack.h"
+
+namespace traversal_native {
+
+using imba::float_as_int;
+using imba::vfloat;
+
+namespace {
+
+/// Block of N triangles in a leaf, as written by the CPU mesh adapters. Unused slots have an id of 0x80000000.
+/// The edges are e1 = v0 - v1 and e2 = v2 - v0, and the normal is n = cross(e1, e2).
+template <int N>
+struct TriBlock {
+    float v0_x[N], v0_y[N], v0_z[N];
+    float e1_x[N], e1_y[N], e1_z[N];
+    float e2_x[N], e2_y[N], e2_z[N];
+    float n_x[N], n_y[N], n_z[N];
+    int ids[N];
+};
+
+/// Ray in the space of the BVH that is traversed.
+struct TraversalRay {
+    float org[3];
+    float dir[3];
+    float inv_dir[3];
+    float tmin;
+
+    TraversalRay(float ox, float oy, float oz, float dx, float dy, float dz, float tmin)
+        : tmin(tmin)
+    {
+        org[0] = ox; org[1] = oy; org[2] = oz;
+        dir[0] = dx; dir[1] = dy; dir[2] = dz;
+        for (int i = 0; i < 3; i++) {
+            // Avoid infinities, that would produce NaNs in the slab test.
+            const float d = std::fabs(dir[i]) > 1e-20f ? dir[i] : std::copysign(1e-20f, dir[i]);
+            inv_dir[i] = 1.0f / d;
+        }
+    }
+};
+
+/// Buffers used to look up the opacity masks.
+struct MaskData {
+    const int* indices;
+    const Vec2* texcoords;
+    const TransparencyMask* masks;
+    const char* buffer;
+
+    /// Returns true if the point of the triangle with the given barycentric coordinates is opaque.
+    bool is_opaque(int tri_id, float u, float v) const {
+        const int* idx = indices + tri_id * 4;
+        const TransparencyMask& mask = masks[idx[3]];
+
+        const Vec2& t0 = texcoords[idx[0]];
+        const Vec2& t1 = texcoords[idx[1]];
+        const Vec2& t2 = texcoords[idx[2]];
+        const float w = 1.0f - u - v;
+        float s = t0.x * w + t1.x * u + t2.x * v;
+        float t = t0.y * w + t1.y * u + t2.y * v;
+
+        // Masks are repeated over the texture space.
+        s -= std::floor(s);
+        t -= std::floor(t);
+        const int x = std::min(int(s * mask.width),  mask.width  - 1);
+        const int y = std::min(int(t * mask.height), mask.height - 1);
+        return buffer[mask.offset + y * mask.width + x] != 0;
+    }
+};
+
+#ifdef STATISTICS
+struct Counters {
+    std::atomic<uint64_t> rays;
+    std::atomic<uint64_t> nodes;
+    std::atomic<uint64_t> tri_blocks;
+    std::atomic<uint64_t> instances;
+} counters;
+
+/// Counts the work done for a set of rays, and adds it to the global counters at the end.
+struct LocalCounters {
+    uint64_t rays, nodes, tri_blocks, instances;
+
+    LocalCounters() : rays(0), nodes(0), tri_blocks(0), instances(0) {}
+    ~LocalCounters() {
+        counters.rays += rays;
+        counters.nodes += nodes;
+        counters.tri_blocks += tri_blocks;
+        counters.instances += instances;
+    }
+};
+#define COUNT(stats, counter) (stats).counter++
+#else
+struct LocalCounters {};
+#define COUNT(stats, counter) (void)(stats)
+#endif
+
+/// Bounds of the children of a node, one lane per child.
+template <int N>
+struct ChildBoxes {
+    vfloat<N> min_x, min_y, min_z;
+    vfloat<N> max_x, max_y, max_z;
+};
+
+template <int N>
+inline ChildBoxes<N> child_boxes(const WideNode<N>& node) {
+    ChildBoxes<N> boxes;
+    boxes.min_x = vfloat<N>::load(node.min_x);
+    boxes.min_y = vfloat<N>::load(node.min_y);
+    boxes.min_z = vfloat<N>::load(node.min_z);
+    boxes.max_x = vfloat<N>::load(node.max_x);
+    boxes.max_y = vfloat<N>::load(node.max_y);
+    boxes.max_z = vfloat<N>::load(node.max_z);
+    return boxes;
+}
+
+template <int N>
+inline ChildBoxes<N> child_boxes(const QuantizedNode<N>& node) {
+    const vfloat<N> origin_x(node.origin[0]), origin_y(node.origin[1]), origin_z(node.origin[2]);
+    const vfloat<N> scale_x(node.scale[0]), scale_y(node.scale[1]), scale_z(node.scale[2]);
+    ChildBoxes<N> boxes;
+    boxes.min_x = origin_x + vfloat<N>::load(node.min_x) * scale_x;
+    boxes.min_y = origin_y + vfloat<N>::load(node.min_y) * scale_y;
+    boxes.min_z = origin_z + vfloat<N>::load(node.min_z) * scale_z;
+    boxes.max_x = origin_x + vfloat<N>::load(node.max_x) * scale_x;
+    boxes.max_y = origin_y + vfloat<N>::load(node.max_y) * scale_y;
+    boxes.max_z = origin_z + vfloat<N>::load(node.max_z) * scale_z;
+    return boxes;
+}
+
+/// Traverses a BVH with N-wide nodes, and calls intersect_leaf on every leaf that the ray hits.
+/// The traversal stops when intersect_leaf returns true. Nodes farther than tmax are skipped.
+template <int N, typename Node, typename LeafFn>
+void traverse_nodes(int root, const Node* nodes, const TraversalRay& ray, const float& tmax, LeafFn intersect_leaf, LocalCounters& stats) {
+    struct StackElem {
+        int node;
+        float t;
+    };
+    // The builders limit the depth of the trees, so that they can be written with a stack of that capacity.
+    // The traversal pushes at most as many nodes as the writers, and can thus use the same capacity.
+    StackElem stack[imba::Stack<StackElem>::capacity()];
+    int top = 0;
+
+    // Select the near and far planes once, according to the direction of the ray.
+    // The signs of the reciprocals are used, since they also hold for components that are -0.0.
+    const bool neg[3] = { ray.inv_dir[0] < 0.0f, ray.inv_dir[1] < 0.0f, ray.inv_dir[2] < 0.0f };
+    const vfloat<N> inv_dir_x(ray.inv_dir[0]), inv_dir_y(ray.inv_dir[1]), inv_dir_z(ray.inv_dir[2]);
+    const vfloat<N> org_inv_dir_x(ray.org[0] * ray.inv_dir[0]);
+    const vfloat<N> org_inv_dir_y(ray.org[1] * ray.inv_dir[1]);
+    const vfloat<N> org_inv_dir_z(ray.org[2] * ray.inv_dir[2]);
+    const vfloat<N> tmin(ray.tmin);
+
+    int node_id = root;
+    while (true) {
+        COUNT(stats, nodes);
+        const Node& node = nodes[node_id];
+        const ChildBoxes<N> boxes = child_boxes(node);
+        const vfloat<N>& near_x = neg[0] ? boxes.max_x : boxes.min_x;
+        const vfloat<N>& far_x  = neg[0] ? boxes.min_x : boxes.max_x;
+        const vfloat<N>& near_y = neg[1] ? boxes.max_y : boxes.min_y;
+        const vfloat<N>& far_y  = neg[1] ? boxes.min_y : boxes.max_y;
+        const vfloat<N>& near_z = neg[2] ? boxes.max_z : boxes.min_z;
+        const vfloat<N>& far_z  = neg[2] ? boxes.min_z : boxes.max_z;
+
+        const vfloat<N> t0 = max(max(near_x * inv_dir_x - org_inv_dir_x,
+                                     near_y * inv_dir_y - org_inv_dir_y),
+                                 max(near_z * inv_dir_z - org_inv_dir_z, tmin));
+        const vfloat<N> t1 = min(min(far_x * inv_dir_x - org_inv_dir_x,
+                                     far_y * inv_dir_y - org_inv_dir_y),
+                                 min(far_z * inv_dir_z - org_inv_dir_z, vfloat<N>(tmax)));
+        const int hit = (t0 <= t1).bits();
+
+        float tnear[N];
+        t0.store(tnear);
+
+        // Leaves are intersected first, as they may shorten the ray before the inner nodes are pushed.
+        int inner[N];
+        int inner_count = 0;
+        for (int j = 0; j < N; j++) {
+            const int child = node.children[j];
+            if (!(hit & (1 << j)) || child == 0) continue;
+
+            if (child < 0) {
+                if (tnear[j] <= tmax && intersect_leaf(~child))
+                    return;
+            } else {
+                // Insertion sort, from the farthest to the nearest child
+                int k = inner_count++;
+                for (; k > 0 && tnear[inner[k - 1]] < tnear[j]; k--)
+                    inner[k] = inner[k - 1];
+                inner[k] = j;
+            }
+        }
+
+        for (int k = 0; k < inner_count; k++) {
+            const int j = inner[k];
+            if (tnear[j] <= tmax) {
+                assert(top < imba::Stack<StackElem>::capacity());
+                stack[top].node = node.children[j];
+                stack[top].t = tnear[j];
+                top++;
+            }
+        }
+
+        do {
+            if (top == 0) return;
+            top--;
+        } while (stack[top].t > tmax);
+        node_id = stack[top].node;
+    }
+}
+
+/// Intersects the ray with the triangles of a leaf. Returns true if a hit was found.
+template <int N, bool any_hit>
+bool intersect_tris(const Vec4* tris, int leaf, const TraversalRay& ray, const MaskData& masks, float& tmax, Hit& hit, LocalCounters& stats) {
+    const vfloat<N> org_x(ray.org[0]), org_y(ray.org[1]), org_z(ray.org[2]);
+    const vfloat<N> dir_x(ray.dir[0]), dir_y(ray.dir[1]), dir_z(ray.dir[2]);
+    const vfloat<N> zero(0.0f);
+
+    bool found = false;
+    while (true) {
+        COUNT(stats, tri_blocks);
+        const TriBlock<N>& block = *reinterpret_cast<const TriBlock<N>*>(tris + leaf);
+        const vfloat<N> n_x = vfloat<N>::load(block.n_x);
+        const vfloat<N> n_y = vfloat<N>::load(block.n_y);
+        const vfloat<N> n_z = vfloat<N>::load(block.n_z);
+
+        const vfloat<N> c_x = vfloat<N>::load(block.v0_x) - org_x;
+        const vfloat<N> c_y = vfloat<N>::load(block.v0_y) - org_y;
+        const vfloat<N> c_z = vfloat<N>::load(block.v0_z) - org_z;
+
+        const vfloat<N> r_x = dir_y * c_z - dir_z * c_y;
+        const vfloat<N> r_y = dir_z * c_x - dir_x * c_z;
+        const vfloat<N> r_z = dir_x * c_y - dir_y * c_x;
+
+        const vfloat<N> det = n_x * dir_x + n_y * dir_y + n_z * dir_z;
+        const vfloat<N> abs_det = abs(det);
+
+        const vfloat<N> uu = mulsign(r_x * vfloat<N>::load(block.e2_x) + r_y * vfloat<N>::load(block.e2_y) + r_z * vfloat<N>::load(block.e2_z), det);
+        const vfloat<N> vv = mulsign(r_x * vfloat<N>::load(block.e1_x) + r_y * vfloat<N>::load(block.e1_y) + r_z * vfloat<N>::load(block.e1_z), det);
+        const vfloat<N> tt = mulsign(n_x * c_x + n_y * c_y + n_z * c_z, det);
+
+        const int valid = ((det != zero) & (uu >= zero) & (vv >= zero) & (uu + vv <= abs_det) &
+                           (tt > abs_det * vfloat<N>(ray.tmin)) & (tt < abs_det * vfloat<N>(tmax))).bits();
+
+        if (valid) {
+            const vfloat<N> inv_det = vfloat<N>(1.0f) / abs_det;
+            float u[N], v[N], t[N];
+            (uu * inv_det).store(u);
+            (vv * inv_det).store(v);
+            (tt * inv_det).store(t);
+
+            for (int j = 0; j < N; j++) {
+                const int id = block.ids[j];
+                if (!(valid & (1 << j)) || id < 0 || t[j] >= tmax || !masks.is_opaque(id, u[j], v[j]))
+                    continue;
+
+                tmax = t[j];
+                hit.tri_id = id;
+                hit.u = u[j];
+                found = true;
+                if (any_hit) return true;
+            }
+        }
+
+        // The blocks of a leaf are followed by a sentinel.
+        leaf += sizeof(TriBlock<N>) / sizeof(Vec4);
+        if (float_as_int(tris[leaf].x) == int(0x80000000))
+            return found;
+    }
+}
+
+template <int N, bool any_hit, typename Node>
+void traverse_ray(int root, const Node* nodes, const InstanceNode* instances, const Vec4* tris,
+                  const MaskData& masks, const Ray& r, Hit& hit, LocalCounters& stats) {
+    const TraversalRay ray(r.org.x, r.org.y, r.org.z, r.dir.x, r.dir.y, r.dir.z, r.org.w);
+    hit.tri_id = -1;
+    hit.inst_id = -1;
+    hit.tmax = r.dir.w;
+    hit.u = 0.0f;
+    COUNT(stats, rays);
+
+    traverse_nodes<N>(root, nodes, ray, hit.tmax, [&] (int leaf) {
+        // The leaves of the top-level BVH are lists of instances, terminated by a sentinel.
+        for (int i = leaf; ; i++) {
+            COUNT(stats, instances);
+            const InstanceNode& inst = instances[i];
+            const float* m = inst.transf;
+            const TraversalRay local_ray(
+                m[0] * ray.org[0] + m[1] * ray.org[1] + m[ 2] * ray.org[2] + m[ 3],
+                m[4] * ray.org[0] + m[5] * ray.org[1] + m[ 6] * ray.org[2] + m[ 7],
+                m[8] * ray.org[0] + m[9] * ray.org[1] + m[10] * ray.org[2] + m[11],
+                m[0] * ray.dir[0] + m[1] * ray.dir[1] + m[ 2] * ray.dir[2],
+                m[4] * ray.dir[0] + m[5] * ray.dir[1] + m[ 6] * ray.dir[2],
+                m[8] * ray.dir[0] + m[9] * ray.dir[1] + m[10] * ray.dir[2],
+                ray.tmin);
+
+            bool found = false;
+            traverse_nodes<N>(inst.next, nodes, local_ray, hit.tmax, [&] (int tri_leaf) {
+                found |= intersect_tris<N, any_hit>(tris, tri_leaf, local_ray, masks, hit.tmax, hit, stats);
+                return any_hit && found;
+            }, stats);
+
+            if (found) {
+                hit.inst_id = inst.id;
+                if (any_hit) return true;
+            }
+
+            if (inst.pad[0] == -1) break;
+        }
+        return false;
+    }, stats);
+}
+
+template <int N, bool any_hit, typename Node>
+void traverse_rays(int root, const Node* nodes, const InstanceNode* instances, const Vec4* tris, const Ray* rays, Hit* hits,
+                   const int* indices, const Vec2* texcoords, const TransparencyMask* masks, const char* mask_buffer, int count) {
+    const MaskData mask_data = { indices, texcoords, masks, mask_buffer };
+    LocalCounters stats;
+    for (int i = 0; i < count; i++)
+        traverse_ray<N, any_hit>(root, nodes, instances, tris, mask_data, rays[i], hits[i], stats);
+}
+
+/// Number of rays compared in validation mode, and number of rays with different results.
+std::atomic<uint64_t> validated_rays(0);
+std::atomic<uint64_t> mismatches(0);
+
+/// Returns true if two hits returned by the library and by the native routines are the same.
+/// The intersection distances are allowed to differ slightly, as the operations are not done in the same order.
+bool same_hit(const Hit& a, const Hit& b, bool any_hit) {
+    if (any_hit) return (a.tri_id >= 0) == (b.tri_id >= 0);
+    if (a.tri_id != b.tri_id) return false;
+    if (a.tri_id < 0) return true;
+    return a.inst_id == b.inst_id &&
+           std::fabs(a.tmax - b.tmax) <= 1e-4f * std::max(1.0f, std::fabs(a.tmax)) &&
+           std::fabs(a.u - b.u) <= 1e-3f;
+}
+
+/// Compares the hits of the library and of the native routines, and returns the number of differences.
+int count_mismatches(const Hit* hits, const Hit* native_hits, int count, bool any_hit) {
+    int different = 0;
+    for (int i = 0; i < count; i++) {
+        if (same_hit(hits[i], native_hits[i], any_hit)) continue;
+
+        // Report the first few differences in detail.
+        if (mismatches + different < 16) {
+            std::cout << "Traversal mismatch (" << (any_hit ? "occluded" : "intersect") << "): library "
+                      << hits[i].tri_id << "/" << hits[i].inst_id << " t=" << hits[i].tmax << ", native "
+                      << native_hits[i].tri_id << "/" << native_hits[i].inst_id << " t=" << native_hits[i].tmax << std::endl;
+        }
+        different++;
+    }
+    return different;
+}
+
+template <bool any_hit, typename LibraryFn>
+void validate(LibraryFn traverse_library, int root, traversal_cpu::Node* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+              int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count) {
+    traverse_library(root, nodes, instances, tris, rays, hits, indices, texcoords, masks, mask_buffer, count);
+
+    thread_local std::vector<Hit> native_hits;
+    native_hits.resize(count);
+    traverse_rays<4, any_hit>(root, reinterpret_cast<WideNode<4>*>(nodes), instances, tris, rays, native_hits.data(),
+                              indices, texcoords, masks, mask_buffer, count);
+    int different = count_mismatches(hits, native_hits.data(), count, any_hit);
+
+    // Axis-aligned rays, whose other direction components are -0.0, are rare in rendered images:
+    // they are also traced from the origin of the first ray.
+    if (count > 0) {
+        const int probe_count = 6;
+        Ray probes[probe_count];
+        Hit probe_hits[probe_count], native_probe_hits[probe_count];
+        for (int i = 0; i < probe_count; i++) {
+            float dir[3] = { -0.0f, -0.0f, -0.0f };
+            dir[i / 2] = i % 2 ? -1.0f : 1.0f;
+            probes[i] = rays[0];
+            probes[i].dir.x = dir[0];
+            probes[i].dir.y = dir[1];
+            probes[i].dir.z = dir[2];
+        }
+        traverse_library(root, nodes, instances, tris, probes, probe_hits, indices, texcoords, masks, mask_buffer, probe_count);
+        traverse_rays<4, any_hit>(root, reinterpret_cast<WideNode<4>*>(nodes), instances, tris, probes, native_probe_hits,
+                                  indices, texcoords, masks, mask_buffer, probe_count);
+        different += count_mismatches(probe_hits, native_probe_hits, probe_count, any_hit);
+        validated_rays += probe_count;
+    }
+
+    validated_rays += count;
+    mismatches += different;
+}
+
+} // namespace
+
+static_assert(sizeof(WideNode<4>) == sizeof(traversal_cpu::Node), "The 4-wide native node must match the node of the traversal library");
+
+void intersect_cpu_masked_instanced(int root, traversal_cpu::Node* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                    int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count) {
+    traverse_rays<4, false>(root, reinterpret_cast<WideNode<4>*>(nodes), instances, tris, rays, hits, indices, texcoords, masks, mask_buffer, count);
+}
+
+void occluded_cpu_masked_instanced(int root, traversal_cpu::Node* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                   int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count) {
+    traverse_rays<4, true>(root, reinterpret_cast<WideNode<4>*>(nodes), instances, tris, rays, hits, indices, texcoords, masks, mask_buffer, count);
+}
+
+void intersect_cpu8_masked_instanced(int root, Node8* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                     int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count) {
+    traverse_rays<8, false>(root, nodes, instances, tris, rays, hits, indices, texcoords, masks, mask_buffer, count);
+}
+
+void occluded_cpu8_masked_instanced(int root, Node8* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                    int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count) {
+    traverse_rays<8, true>(root, nodes, instances, tris, rays, hits, indices, texcoords, masks, mask_buffer, count);
+}
+
+void intersect_cpu4q_masked_instanced(int root, QNode4* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                      int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count) {
+    traverse_rays<4, false>(root, nodes, instances, tris, rays, hits, indices, texcoords, masks, mask_buffer, count);
+}
+
+void occluded_cpu4q_masked_instanced(int root, QNode4* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                     int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count) {
+    traverse_rays<4, true>(root, nodes, instances, tris, rays, hits, indices, texcoords, masks, mask_buffer, count);
+}
+
+void validate_intersect_cpu_masked_instanced(int root, traversal_cpu::Node* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                             int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count) {
+    validate<false>(traversal_cpu::intersect_cpu_masked_instanced, root, nodes, instances, tris, rays, hits, indices, texcoords, masks, mask_buffer, count);
+}
+
+void validate_occluded_cpu_masked_instanced(int root, traversal_cpu::Node* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                            int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count) {
+    validate<true>(traversal_cpu::occluded_cpu_masked_instanced, root, nodes, instances, tris, rays, hits, indices, texcoords, masks, mask_buffer, count);
+}
+
+bool has_wide_vectors() {
+#ifdef IMBA_HAS_AVX
+    return true;
+#else
+    return false;
+#endif
+}
+
+void print_validation_stats() {
+    std::cout << "Traversal validation: " << mismatches << " of " << validated_rays << " rays differ from the traversal library." << std::endl;
+}
+
+#ifdef STATISTICS
+void print_stats() {
+    const double rays = std::max<uint64_t>(counters.rays, 1);
+    std::cout << "Native traversal: " << counters.rays << " rays, "
+              << counters.nodes / rays << " nodes/ray, "
+              << counters.tri_blocks / rays << " triangle blocks/ray, "
+              << counters.instances / rays << " instances/ray" << std::endl;
+}
+#endif
+
+} // namespace traversal_native
@@ -0,0 +1,93 @@
+#ifndef IMBA_TRAVERSAL_NATIVE_H
+#define IMBA_TRAVERSAL_NATIVE_H
+
+#include <cstdint>
+
+#include "imbatracer/core/traversal_interface.h"
+
+/// Traversal routines written in C++ with SSE/AVX intrinsics. They support the node layout of the traversal
+/// library, and the layouts that it does not support. They use the same buffers and the same ray and hit formats.
+/// The types of the library are shared, so its headers are still needed, and the buffers are allocated by the AnyDSL runtime.
+namespace traversal_native {
+
+using traversal_cpu::InstanceNode;
+using traversal_cpu::Vec4;
+using traversal_cpu::Vec2;
+using traversal_cpu::TransparencyMask;
+using traversal_cpu::Ray;
+using traversal_cpu::Hit;
+
+/// BVH node with N children. With N = 4, this is the layout of traversal_cpu::Node.
+/// A positive child is the index of a node, a negative child is the complement of the index of a leaf
+/// in the triangle (or instance) array, and a zero child is empty.
+template <int N>
+struct WideNode {
+    float min_x[N];
+    float min_y[N];
+    float min_z[N];
+    float max_x[N];
+    float max_y[N];
+    float max_z[N];
+    int children[N];
+};
+
+/// 8-wide node, for CPUs with 256-bit vector units or wider.
+/// The leaves hold blocks of 8 triangles, in the same format as the blocks of 4 triangles of the library.
+typedef WideNode<8> Node8;
+
+/// BVH node with N children, whose bounds are quantized on 8 bits relative to the bounding box of the node.
+/// On each axis, the bounds of a child are origin + q * scale, with q in [0, 255]. The quantized bounds always
+/// enclose the bounds of the child. The children are encoded as in WideNode.
+template <int N>
+struct QuantizedNode {
+    float origin[3];
+    float scale[3];
+    uint8_t min_x[N];
+    uint8_t min_y[N];
+    uint8_t min_z[N];
+    uint8_t max_x[N];
+    uint8_t max_y[N];
+    uint8_t max_z[N];
+    int children[N];
+};
+
+/// Quantized 4-wide node, a bit more than half the size of traversal_cpu::Node. Uses the same triangle blocks.
+typedef QuantizedNode<4> QNode4;
+
+/// Same as the routines of the traversal library, for 4-wide nodes.
+void intersect_cpu_masked_instanced(int root, traversal_cpu::Node* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                    int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count);
+void occluded_cpu_masked_instanced(int root, traversal_cpu::Node* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                   int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count);
+
+void intersect_cpu8_masked_instanced(int root, Node8* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                     int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count);
+void occluded_cpu8_masked_instanced(int root, Node8* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                    int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count);
+
+void intersect_cpu4q_masked_instanced(int root, QNode4* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                      int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count);
+void occluded_cpu4q_masked_instanced(int root, QNode4* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                     int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count);
+
+/// Returns true if the 8-wide routines are compiled with 256-bit vector instructions.
+/// Otherwise, they process the lanes of the nodes one by one.
+bool has_wide_vectors();
+
+/// Traverse the rays with both the traversal library and the native routines, and count the rays for which the results differ.
+/// The hits of the library are returned.
+void validate_intersect_cpu_masked_instanced(int root, traversal_cpu::Node* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                             int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count);
+void validate_occluded_cpu_masked_instanced(int root, traversal_cpu::Node* nodes, InstanceNode* instances, Vec4* tris, Ray* rays, Hit* hits,
+                                            int* indices, Vec2* texcoords, TransparencyMask* masks, char* mask_buffer, int count);
+/// Prints the number of rays that have been validated, and the number of differences.
+void print_validation_stats();
+
+#ifdef STATISTICS
+/// Prints the number of nodes, triangle blocks and instances visited per ray by the native routines.
+void print_stats();
+#endif
+
+} // namespace traversal_native
+
+#endif // IMBA_TRAVERSAL_NATIVE_H
@@ -20,9 +20,25 @@ struct UserSettings {
         hybrid
     } traversal_platform;
 
+    enum CpuNodes {
+        mbvh4,
+        mbvh8,
+        mbvh4q
+    } cpu_nodes;
+
+    enum CpuTraversal {
+        library,
+        native,
+        validate
+    } cpu_traversal;
+
     // If specified, BVH data will be written to this file.
     std::string accel_output;
 
+    // If specified, the acceleration structures of the meshes are cached in this directory.
+    std::string accel_cache;
+    unsigned int accel_cache_size;
+
     // Camera and canvas
     unsigned int width, height;
     float fov;
@@ -56,26 +72,39 @@ struct UserSettings {
     unsigned int concurrent_spp;
     unsigned int tile_size;
     unsigned int thread_count;
+    unsigned int worker_count;
+    bool pin_threads;
+    unsigned int reorder_min_size;
+    bool pipeline;
+    bool sort_hits;
+    bool fast_bvh;
+    float bvh_optimization_ms;
     unsigned int num_connections;
 
     UserSettings()
-        : input_file("")
+        : input_file(""), output_file("render.png")
+        , traversal_platform(cpu)
+        , cpu_nodes(mbvh4)
+        , cpu_traversal(library)
         , accel_output("")
-        , output_file("render.png")
-        , algorithm(PT)
+        , accel_cache(""), accel_cache_size(1024)
         , width(512), height(512)
+        , fov(60.0f)
+        , gamma(0.5f)
         , max_samples(INT_MAX), max_time_sec(FLT_MAX)
         , background(false)
-        , fov(60.0f)
+        , intermediate_image_time(10.0f), intermediate_image_name("")
+        , algorithm(PT)
         , radius_factor(2.0f)
+        , num_knn(10)
         , max_path_len(10)
         , light_path_count(512 * 512 / 2)
         , concurrent_spp(1), tile_size(256), thread_count(4)
-        , intermediate_image_time(10.0f), intermediate_image_name("")
+        , worker_count(0), pin_threads(false)
+        , reorder_min_size(0), pipeline(false)
+        , sort_hits(false)
+        , fast_bvh(false), bvh_optimization_ms(0.0f)
         , num_connections(1)
-        , traversal_platform(cpu)
-        , gamma(0.5f)
-        , num_knn(10)
     {}
 };
 
@@ -91,17 +120,28 @@ inline void print_help() {
               << "    -f  Sets the horizontal field of view (default: 60)" << std::endl
               << "    -r  Sets the initial radius for photon mapping as a factor of the approx. pixel size (default: 2)" << std::endl
               << "    -c  Sets the number of vertices form the light path that any vertex on a camera path is connected to (default: 1)" << std::endl
-              << "    -k  Sets the number of photons to use for density estimation (default: 10)" << std::endl
+              << "    -k  Sets the number of photons to use for density estimation, 0 uses all photons within the radius (default: 10)" << std::endl
               << "    --gamma   Sets the gamma correction value (default: 0.5)"
               << "    --gpu     Enables GPU traversal (default)" << std::endl
               << "    --cpu     Enables CPU traversal" << std::endl
               << "    --hybrid  Enables hybrid traversal (not yet implemented)" << std::endl
+              << "    --cpu-nodes <layout>       Selects the node layout for CPU traversal, 'mbvh4', 'mbvh8' or 'mbvh4q' (quantized) (default: mbvh4)" << std::endl
+              << "    --cpu-traversal <impl>     Selects the CPU traversal for 4-wide nodes, 'library', 'native' or 'validate' (default: library)" << std::endl
               << "    --write-accel <filename>   Writes the acceleration structure to the specified file." << std::endl
+              << "    --accel-cache <dir>        Caches the acceleration structures of the meshes in the given directory." << std::endl
+              << "    --accel-cache-size <MB>    Specifies the maximum size of the acceleration structure cache. (default: 1024)" << std::endl
+              << "    --fast-bvh                 Builds lower quality acceleration structures for meshes, in a fraction of the time." << std::endl
+              << "    --optimize-bvh <ms>        Spends about the given time reducing the cost of every acceleration structure after it is built. (default: 0)" << std::endl
               << "    --max-path-len <len>       Specifies the maximum number of vertices within any path. (default: 10)" << std::endl
               << "    --light-path-count <nr>    Specifies the number of light paths to be traced per frame. (default: width * height * 0.5)" << std::endl
               << "    --spp <nr>                 Specifies the number of samples per pixel within a single frame. (default: 1)" << std::endl
               << "    --tile-size <size>         Specifies the size of the rectangular tiles. (default: 256)" << std::endl
               << "    --thread-count <nr>        Specifies the number of threads for processing tiles. (default: 4)" << std::endl
+              << "    --worker-count <nr>        Specifies the number of threads in the worker pool. (default: number of cores)" << std::endl
+              << "    --pin-threads              Pins the threads of the worker pool to fixed cores." << std::endl
+              << "    --reorder-rays <size>      Sorts queues with at least <size> rays by direction and origin before traversal. (default: 0, disabled)" << std::endl
+              << "    --pipeline                 Overlaps traversal and shading within every thread, using two queues per thread." << std::endl
+              << "    --sort-hits                Sorts the hits of every material by triangle before shading." << std::endl
               << "    --intermediate-time <sec>  Specifies the rate in seconds at which to store intermediate results. (default: 10)" << std::endl
               << "    --intermediate-path <path> When given, store intermediate results with filename starting with <path>. (default: not given)" << std::endl
               << "  If time (-t) and number of samples (-s) are both given, rendering will be stopped once either of the two has been reached." << std::endl;
@@ -148,6 +188,18 @@ inline bool parse_cmd_line(int argc, char* argv[], UserSettings& settings) {
         {"vcm_pt", UserSettings::VCM_PT}
     };
 
+    std::unordered_map<std::string, UserSettings::CpuNodes> supported_cpu_nodes = {
+        {"mbvh4", UserSettings::mbvh4},
+        {"mbvh8", UserSettings::mbvh8},
+        {"mbvh4q", UserSettings::mbvh4q}
+    };
+
+    std::unordered_map<std::string, UserSettings::CpuTraversal> supported_cpu_traversals = {
+        {"library", UserSettings::library},
+        {"native", UserSettings::native},
+        {"validate", UserSettings::validate}
+    };
+
     bool lp_count_given = false;
 
     for (int i = 2; i < argc; ++i) {
@@ -170,6 +222,36 @@ inline bool parse_cmd_line(int argc, char* argv[], UserSettings& settings) {
             } else {
                 settings.algorithm = alg_iter->second;
             }
+        } else if (arg == "--cpu-nodes") {
+            if (++i >= argc) {
+                std::cout << "Too few arguments." << std::endl;
+                return false;
+            }
+            std::string layout = argv[i];
+
+            auto layout_iter = supported_cpu_nodes.find(layout);
+            if (layout_iter == supported_cpu_nodes.end()) {
+                std::cout << "Invalid node layout: " << layout
+                          << " Supported layouts are: 'mbvh4', 'mbvh8', and 'mbvh4q'. Defaulting to 'mbvh4'..." << std::endl;
+                settings.cpu_nodes = UserSettings::mbvh4;
+            } else {
+                settings.cpu_nodes = layout_iter->second;
+            }
+        } else if (arg == "--cpu-traversal") {
+            if (++i >= argc) {
+                std::cout << "Too few arguments." << std::endl;
+                return false;
+            }
+            std::string traversal = argv[i];
+
+            auto traversal_iter = supported_cpu_traversals.find(traversal);
+            if (traversal_iter == supported_cpu_traversals.end()) {
+                std::cout << "Invalid traversal: " << traversal
+                          << " Supported traversals are: 'library', 'native', and 'validate'. Defaulting to 'library'..." << std::endl;
+                settings.cpu_traversal = UserSettings::library;
+            } else {
+                settings.cpu_traversal = traversal_iter->second;
+            }
         } else if (arg == "--write-accel"){
             if (++i >= argc) {
                 std::cout << "Too few arguments." << std::endl;
@@ -194,6 +276,24 @@ inline bool parse_cmd_line(int argc, char* argv[], UserSettings& settings) {
             parse_argument(++i, argc, argv, settings.tile_size);
         else if (arg == "--thread-count")
             parse_argument(++i, argc, argv, settings.thread_count);
+        else if (arg == "--worker-count")
+            parse_argument(++i, argc, argv, settings.worker_count);
+        else if (arg == "--pin-threads")
+            settings.pin_threads = true;
+        else if (arg == "--reorder-rays")
+            parse_argument(++i, argc, argv, settings.reorder_min_size);
+        else if (arg == "--pipeline")
+            settings.pipeline = true;
+        else if (arg == "--sort-hits")
+            settings.sort_hits = true;
+        else if (arg == "--accel-cache")
+            parse_argument(++i, argc, argv, settings.accel_cache);
+        else if (arg == "--accel-cache-size")
+            parse_argument(++i, argc, argv, settings.accel_cache_size);
+        else if (arg == "--fast-bvh")
+            settings.fast_bvh = true;
+        else if (arg == "--optimize-bvh")
+            parse_argument(++i, argc, argv, settings.bvh_optimization_ms);
         else if (arg == "-f")
             parse_argument(++i, argc, argv, settings.fov);
         else if (arg == "-r")
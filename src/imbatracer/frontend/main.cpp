@@ -84,6 +84,16 @@ private:
     PerspectiveCamera& cam_;
 };
 
+static void print_traversal_stats(const UserSettings& settings, const Scene& scene) {
+    if (scene.has_cpu_buffers())
+        scene.print_cpu_traversal_stats();
+    if (settings.cpu_traversal == UserSettings::validate)
+        traversal_native::print_validation_stats();
+#ifdef STATISTICS
+    traversal_native::print_stats();
+#endif
+}
+
 int main(int argc, char* argv[]) {
     std::cout << "Imbatracer - An interactive raytracer" << std::endl;
 
@@ -93,6 +103,20 @@ int main(int argc, char* argv[]) {
 
     Scene scene(settings.traversal_platform == UserSettings::cpu || settings.traversal_platform == UserSettings::hybrid,
                 settings.traversal_platform == UserSettings::gpu || settings.traversal_platform == UserSettings::hybrid);
+    scene.set_fast_mesh_accels(settings.fast_bvh);
+    scene.set_bvh_optimization_budget(settings.bvh_optimization_ms);
+    scene.set_cpu_node_layout(settings.cpu_nodes == UserSettings::mbvh8  ? CpuNodeLayout::MBVH8 :
+                              settings.cpu_nodes == UserSettings::mbvh4q ? CpuNodeLayout::QMBVH4 :
+                                                                           CpuNodeLayout::MBVH4);
+    if (settings.cpu_nodes == UserSettings::mbvh8 && !traversal_native::has_wide_vectors()) {
+        std::cout << "Warning: AVX is not enabled, 8-wide nodes are traversed without vector instructions."
+                  << " Configure with IMBA_NATIVE_ARCH to enable it." << std::endl;
+    }
+    scene.set_cpu_traversal(settings.cpu_traversal == UserSettings::native   ? CpuTraversal::NATIVE :
+                            settings.cpu_traversal == UserSettings::validate ? CpuTraversal::VALIDATE :
+                                                                               CpuTraversal::LIBRARY);
+    if (settings.accel_cache != "")
+        scene.set_accel_cache(settings.accel_cache, uint64_t(settings.accel_cache_size) << 20);
     float3 cam_pos, cam_dir, cam_up;
     if (!build_scene(Path(settings.input_file), scene, cam_pos, cam_dir, cam_up)) {
         std::cerr << "ERROR: Scene could not be built" << std::endl;
@@ -109,28 +133,37 @@ int main(int argc, char* argv[]) {
     if (settings.algorithm == UserSettings::PT) {
 #ifdef QUEUE_SCHEDULER
         PixelRayGen<PTState> ray_gen(settings.width, settings.height, settings.concurrent_spp);
-        QueueScheduler<PTState, ShadowState> scheduler(ray_gen, scene, 1, gpu_traversal);
+        QueueScheduler<PTState, ShadowState> scheduler(ray_gen, scene, gpu_traversal);
 #else
-        DefaultTileGen<PTState> ray_gen(settings.width, settings.height, settings.concurrent_spp, settings.tile_size);
-        TileScheduler<PTState, ShadowState> scheduler(ray_gen, scene, 1, settings.thread_count, settings.tile_size * settings.tile_size * settings.concurrent_spp, gpu_traversal);
+        DefaultTileGen<PTState> ray_gen(settings.width, settings.height, settings.concurrent_spp, settings.tile_size, settings.thread_count);
+        TileScheduler<PTState, ShadowState> scheduler(ray_gen, scene, settings.thread_count, settings.tile_size * settings.tile_size * settings.concurrent_spp, gpu_traversal,
+                                                      settings.worker_count, settings.pin_threads);
+        scheduler.set_pipelining(settings.pipeline);
 #endif
+        scheduler.set_reordering(settings.reorder_min_size);
+
         PathTracer integrator(scene, cam, scheduler, settings.max_path_len);
+        integrator.set_hit_sorting(settings.sort_hits);
         integrator.preprocess();
         ctrl.set_speed(integrator.pixel_size() * 10.0f);
 
         RenderWindow wnd(settings, integrator, ctrl, settings.concurrent_spp);
         wnd.render_loop();
 
+        print_traversal_stats(settings, scene);
         return 0;
     }
 
 #ifdef QUEUE_SCHEDULER
     PixelRayGen<VCMState> ray_gen(settings.width, settings.height, settings.concurrent_spp);
-    QueueScheduler<VCMState, VCMShadowState> scheduler(ray_gen, scene, settings.num_connections + 1, gpu_traversal);
+    QueueScheduler<VCMState, VCMShadowState> scheduler(ray_gen, scene, gpu_traversal);
 #else
-    DefaultTileGen<VCMState> ray_gen(settings.width, settings.height, settings.concurrent_spp, settings.tile_size);
-    TileScheduler<VCMState, VCMShadowState> scheduler(ray_gen, scene, settings.num_connections + 1, settings.thread_count, settings.tile_size * settings.tile_size * settings.concurrent_spp, gpu_traversal);
+    DefaultTileGen<VCMState> ray_gen(settings.width, settings.height, settings.concurrent_spp, settings.tile_size, settings.thread_count);
+    TileScheduler<VCMState, VCMShadowState> scheduler(ray_gen, scene, settings.thread_count, settings.tile_size * settings.tile_size * settings.concurrent_spp, gpu_traversal,
+                                                      settings.worker_count, settings.pin_threads);
+    scheduler.set_pipelining(settings.pipeline);
 #endif
+    scheduler.set_reordering(settings.reorder_min_size);
 
     Integrator* integrator;
 
@@ -156,12 +189,15 @@ int main(int argc, char* argv[]) {
         break;
     }
 
+    integrator->set_hit_sorting(settings.sort_hits);
     integrator->preprocess();
     ctrl.set_speed(integrator->pixel_size() * 10.0f);
 
     RenderWindow wnd(settings, *integrator, ctrl, settings.concurrent_spp);
     wnd.render_loop();
 
+    integrator->print_stats();
     delete integrator;
+    print_traversal_stats(settings, scene);
     return 0;
 }
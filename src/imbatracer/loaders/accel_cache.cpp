@@ -0,0 +1,124 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "imbatracer/loaders/accel_cache.h"
+#include "imbatracer/loaders/loaders.h"
+#include "imbatracer/loaders/path.h"
+
+namespace imba {
+
+static void make_dir(const std::string& dir) {
+#ifdef _WIN32
+    _mkdir(dir.c_str());
+#else
+    mkdir(dir.c_str(), 0755);
+#endif
+}
+
+static uint64_t file_size(const std::string& filename) {
+    std::ifstream in(filename, std::ifstream::binary | std::ifstream::ate);
+    return in ? uint64_t(in.tellg()) : 0;
+}
+
+static uint64_t combine(uint64_t h, uint64_t k) {
+    return (h ^ k) * 0x100000001b3ull;
+}
+
+AccelCache::AccelCache(const std::string& dir, uint64_t max_size)
+    : dir_(Path(dir).path()), max_size_(max_size), use_counter_(0)
+{
+    make_dir(dir_);
+    read_index();
+}
+
+AccelCache::~AccelCache() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    write_index();
+}
+
+std::string AccelCache::filename(const Mesh& mesh, const std::string& builder_desc) const {
+    uint64_t h = 0xcbf29ce484222325ull;
+    h = combine(h, checksum(mesh.vertices(), sizeof(float4) * mesh.vertex_count()));
+    h = combine(h, checksum(mesh.indices(), sizeof(uint32_t) * mesh.index_count()));
+    h = combine(h, checksum(builder_desc.data(), builder_desc.size()));
+
+    // Mix the bits, so that the low bits of the hash depend on all the data.
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+
+    std::ostringstream name;
+    name << dir_ << '/' << std::hex << std::setw(16) << std::setfill('0') << h << ".bvh";
+    return name.str();
+}
+
+bool AccelCache::verified(const std::string& filename) {
+    const uint64_t size = file_size(filename);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(Path(filename).file_name());
+    return it != entries_.end() && it->second.size == size;
+}
+
+void AccelCache::touch(const std::string& filename) {
+    const uint64_t size = file_size(filename);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& entry = entries_[Path(filename).file_name()];
+    entry.size = size;
+    entry.last_use = ++use_counter_;
+}
+
+void AccelCache::evict() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    uint64_t total_size = 0;
+    for (auto& e : entries_)
+        total_size += e.second.size;
+
+    while (total_size > max_size_ && !entries_.empty()) {
+        auto lru = entries_.begin();
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->second.last_use < lru->second.last_use)
+                lru = it;
+        }
+
+        std::remove((dir_ + '/' + lru->first).c_str());
+        total_size -= lru->second.size;
+        entries_.erase(lru);
+    }
+
+    write_index();
+}
+
+void AccelCache::read_index() {
+    std::ifstream in(index_filename());
+
+    std::string name;
+    Entry entry;
+    while (in >> name >> entry.size >> entry.last_use) {
+        // Files that have been removed by hand are forgotten.
+        if (file_size(dir_ + '/' + name) == 0)
+            continue;
+
+        entries_[name] = entry;
+        use_counter_ = std::max(use_counter_, entry.last_use);
+    }
+}
+
+void AccelCache::write_index() const {
+    std::ofstream out(index_filename());
+    for (auto& e : entries_)
+        out << e.first << ' ' << e.second.size << ' ' << e.second.last_use << '\n';
+}
+
+} // namespace imba
@@ -0,0 +1,58 @@
+#ifndef IMBA_ACCEL_CACHE_H
+#define IMBA_ACCEL_CACHE_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "imbatracer/core/mesh.h"
+
+namespace imba {
+
+/// Directory of acceleration structures, named after a hash of the mesh data and of a description of the builder.
+/// A changed mesh or builder thus never matches an old file. The least recently used files are removed
+/// when the total size of the cache exceeds a limit. All the methods are thread-safe.
+class AccelCache {
+public:
+    /// Opens the cache in the given directory, which is created if it does not exist yet.
+    AccelCache(const std::string& dir, uint64_t max_size);
+    ~AccelCache();
+
+    AccelCache(const AccelCache&) = delete;
+    AccelCache& operator= (const AccelCache&) = delete;
+
+    /// Returns the name of the file holding the acceleration structure of a mesh, built with the given builder.
+    /// The builder description must identify the builder, its parameters, and the layout of the nodes.
+    std::string filename(const Mesh& mesh, const std::string& builder_desc) const;
+
+    /// Returns true if a file has been stored or verified by the cache before, and has not changed in size since.
+    /// The checksums of such files do not need to be checked again.
+    bool verified(const std::string& filename);
+
+    /// Marks a file of the cache as used, after it has been loaded or stored.
+    void touch(const std::string& filename);
+
+    /// Removes the least recently used files until the total size is below the limit.
+    void evict();
+
+private:
+    struct Entry {
+        uint64_t size;
+        uint64_t last_use;
+    };
+
+    void read_index();
+    void write_index() const;
+    std::string index_filename() const { return dir_ + "/index"; }
+
+    std::string dir_;
+    uint64_t max_size_;
+    uint64_t use_counter_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::mutex mutex_;
+};
+
+} // namespace imba
+
+#endif // IMBA_ACCEL_CACHE_H
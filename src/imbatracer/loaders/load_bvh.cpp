@@ -1,9 +1,15 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <cstring>
+#include <algorithm>
 #include <anydsl_runtime.hpp>
 
+#define NOMINMAX
+#include <tbb/tbb.h>
+
 #include "imbatracer/loaders/loaders.h"
+#include "imbatracer/loaders/mapped_file.h"
 #include "imbatracer/core/common.h"
 #include "imbatracer/core/traversal_interface.h"
 
@@ -11,18 +17,30 @@ namespace imba {
 
 enum class BlockType {
     BVH = 1,
-    MBVH = 2
+    MBVH = 2,
+    // Blocks with a versioned header and checksums, that are stored without any id offset.
+    BVH_VERSIONED = 3,
+    MBVH_VERSIONED = 4,
+    MBVH8_VERSIONED = 5,
+    QMBVH4_VERSIONED = 6
 };
 
-struct Header {
+static const uint32_t accel_magic = 0x313F1A57;
+static const uint32_t accel_version = 1;
+
+struct VersionedHeader {
+    uint32_t version;
     uint32_t node_count;
     uint32_t prim_count;
+    int32_t  tri_id_offset;     ///< Offset of the triangle ids when the block was stored
+    uint64_t node_checksum;
+    uint64_t prim_checksum;
 };
 
 inline bool check_header(std::istream& is) {
     uint32_t magic;
     is.read((char*)&magic, sizeof(uint32_t));
-    return magic == 0x313F1A57;
+    return magic == accel_magic;
 }
 
 inline bool locate_block(std::istream& is, BlockType type) {
@@ -42,117 +60,217 @@ inline bool locate_block(std::istream& is, BlockType type) {
     return static_cast<bool>(is);
 }
 
-bool load_accel_cpu(const std::string& filename, std::vector<traversal_cpu::Node>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset) {
-    const BlockType block_type = BlockType::MBVH;
-    using traversal_cpu::Node;
+/// Finds a block in a mapped file, and returns a pointer to its contents, or nullptr if there is no such block.
+static const uint8_t* locate_block(const MappedFile& file, BlockType type, uint64_t& block_size) {
+    uint32_t magic;
+    if (file.size() < sizeof(uint32_t)) return nullptr;
+    std::memcpy(&magic, file.data(), sizeof(uint32_t));
+    if (magic != accel_magic) return nullptr;
+
+    uint64_t pos = sizeof(uint32_t);
+    while (pos + sizeof(uint64_t) + sizeof(uint32_t) <= file.size()) {
+        uint64_t size;
+        uint32_t block_type;
+        std::memcpy(&size, file.data() + pos, sizeof(uint64_t));
+        std::memcpy(&block_type, file.data() + pos + sizeof(uint64_t), sizeof(uint32_t));
+
+        // The size of a block includes its type, but not the size field itself.
+        if (size < sizeof(uint32_t) || size > file.size() - pos - sizeof(uint64_t))
+            return nullptr;
+
+        if (block_type == (uint32_t)type) {
+            block_size = size - sizeof(uint32_t);
+            return file.data() + pos + sizeof(uint64_t) + sizeof(uint32_t);
+        }
+        pos += sizeof(uint64_t) + size;
+    }
+    return nullptr;
+}
 
-    // Account for the nodes of other BVHs that might already be inside the array.
-    const int node_offset = nodes_out.size();
-    const int tris_offset = tris_out.size();
+uint64_t checksum(const void* data, size_t size) {
+    const size_t chunk_size = 1 << 20;
+    const size_t chunk_count = (size + chunk_size - 1) / chunk_size;
+    std::vector<uint64_t> hashes(chunk_count);
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, chunk_count), [&] (const tbb::blocked_range<size_t>& range) {
+        for (auto c = range.begin(); c != range.end(); ++c) {
+            const uint8_t* chunk = (const uint8_t*)data + c * chunk_size;
+            const size_t bytes = std::min(chunk_size, size - c * chunk_size);
+
+            // FNV-1a on 64-bit words, and on the remaining bytes
+            uint64_t h = 0xcbf29ce484222325ull;
+            size_t i = 0;
+            for (; i + sizeof(uint64_t) <= bytes; i += sizeof(uint64_t)) {
+                uint64_t word;
+                std::memcpy(&word, chunk + i, sizeof(uint64_t));
+                h = (h ^ word) * 0x100000001b3ull;
+            }
+            for (; i < bytes; ++i)
+                h = (h ^ chunk[i]) * 0x100000001b3ull;
+            hashes[c] = h;
+        }
+    });
 
-    std::ifstream in(filename, std::ifstream::binary);
-    if (!in || !check_header(in) || !locate_block(in, block_type))
-        return false;
+    uint64_t h = 0xcbf29ce484222325ull ^ size;
+    for (auto c : hashes)
+        h = (h ^ c) * 0x100000001b3ull;
+    return h;
+}
 
-    Header h;
-    in.read((char*)&h, sizeof(Header));
+/// Adds the given value to the ids of the triangles in a CPU acceleration structure with blocks of N triangles.
+template <int N>
+static void offset_tri_ids_cpu(Vec4* tris, int count, int offset) {
+    for (int i = 0; i < count; ) {
+        i += 13 * N / 4;
+
+        // The ids are stored in the last row of the block.
+        float* ids = &tris[i].x - N;
+        for (int j = 0; j < N; j++) {
+            if (float_as_int(ids[j]) != int(0x80000000))
+                ids[j] = int_as_float(float_as_int(ids[j]) + offset);
+        }
 
-    nodes_out.resize(nodes_out.size() + h.node_count);
-    tris_out .resize( tris_out.size() + h.prim_count);
+        if (float_as_int(tris[i].x) == int(0x80000000))
+            i++; // Skip the sentinel
+    }
+}
 
-    in.read((char*)(nodes_out.data() + node_offset), sizeof(Node) * h.node_count);
-    in.read((char*)( tris_out.data() + tris_offset), sizeof(Vec4) * h.prim_count);
+/// Adds the given value to the ids of the triangles in a GPU acceleration structure.
+static void offset_tri_ids_gpu(Vec4* tris, int count, int offset) {
+    for (int i = 0; i < count; i += 3)
+        tris[i + 1].w = int_as_float(float_as_int(tris[i + 1].w) + offset);
+}
 
-    if (node_offset > 0) {
-        for (int i = node_offset; i < nodes_out.size(); ++i) {
-            for (int j = 0; j < 4; ++j) {
-                if (nodes_out[i].children[j] > 0)
-                    nodes_out[i].children[j] += node_offset;
-                else if (nodes_out[i].children[j] < 0)
-                    nodes_out[i].children[j] = ~(~nodes_out[i].children[j] + tris_offset);
-            }
+template <typename Node, int N>
+static void relocate_accel_wide(Node* nodes, int node_count, int node_offset, int tris_offset) {
+    for (int i = 0; i < node_count; ++i) {
+        for (int j = 0; j < N; ++j) {
+            if (nodes[i].children[j] > 0)
+                nodes[i].children[j] += node_offset;
+            else if (nodes[i].children[j] < 0)
+                nodes[i].children[j] = ~(~nodes[i].children[j] + tris_offset);
         }
     }
+}
 
-    if (tri_id_offset != 0) {
-        for (int i = tris_offset; i < tris_out.size(); ) {
-            for (int j = 0; j < 13; ++j)
-                i++;
+void relocate_accel_cpu(traversal_cpu::Node* nodes, int node_count, int node_offset, int tris_offset) {
+    relocate_accel_wide<traversal_cpu::Node, 4>(nodes, node_count, node_offset, tris_offset);
+}
 
-            auto set = [tri_id_offset] (float& val) {
-                if (float_as_int(val) != 0x80000000)
-                    val = int_as_float(float_as_int(val) + tri_id_offset);
-            };
+void relocate_accel_cpu8(traversal_native::Node8* nodes, int node_count, int node_offset, int tris_offset) {
+    relocate_accel_wide<traversal_native::Node8, 8>(nodes, node_count, node_offset, tris_offset);
+}
 
-            set(tris_out[i - 1].x);
-            set(tris_out[i - 1].y);
-            set(tris_out[i - 1].z);
-            set(tris_out[i - 1].w);
+void relocate_accel_cpu4q(traversal_native::QNode4* nodes, int node_count, int node_offset, int tris_offset) {
+    relocate_accel_wide<traversal_native::QNode4, 4>(nodes, node_count, node_offset, tris_offset);
+}
+
+void relocate_accel_gpu(traversal_gpu::Node* nodes, int node_count, int node_offset, int tris_offset) {
+    for (int i = 0; i < node_count; ++i) {
+        if (nodes[i].left < 0)
+            nodes[i].left = ~(~nodes[i].left + tris_offset);
+        else
+            nodes[i].left += node_offset;
+
+        if (nodes[i].right < 0)
+            nodes[i].right = ~(~nodes[i].right + tris_offset);
+        else
+            nodes[i].right += node_offset;
+    }
+}
 
-            if (float_as_int(tris_out[i].x) == 0x80000000)
-                i++; // Skip the sentinel
+/// Rewrites a file without its blocks of the given type. Returns false if the file could not be rewritten.
+static bool remove_blocks(const std::string& filename, BlockType type) {
+    std::vector<uint8_t> contents;
+    {
+        MappedFile file(filename);
+        if (!file || file.size() < sizeof(uint32_t)) return false;
+
+        contents.assign(file.data(), file.data() + sizeof(uint32_t));
+        uint64_t pos = sizeof(uint32_t);
+        while (pos + sizeof(uint64_t) + sizeof(uint32_t) <= file.size()) {
+            uint64_t size;
+            uint32_t block_type;
+            std::memcpy(&size, file.data() + pos, sizeof(uint64_t));
+            std::memcpy(&block_type, file.data() + pos + sizeof(uint64_t), sizeof(uint32_t));
+
+            // Everything after a truncated block is dropped.
+            if (size < sizeof(uint32_t) || size > file.size() - pos - sizeof(uint64_t))
+                break;
+
+            const uint64_t next = pos + sizeof(uint64_t) + size;
+            if (block_type != (uint32_t)type)
+                contents.insert(contents.end(), file.data() + pos, file.data() + next);
+            pos = next;
         }
     }
 
-    return true;
+    std::ofstream out(filename, std::ofstream::binary | std::ofstream::trunc);
+    out.write((const char*)contents.data(), contents.size());
+    return static_cast<bool>(out);
 }
 
-bool load_accel_gpu(const std::string& filename, std::vector<traversal_gpu::Node>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset) {
-    const BlockType block_type = BlockType::BVH;
-    using traversal_gpu::Node;
-
+template <typename Node, typename RelocateFn, typename OffsetTriIdsFn>
+static bool load_accel(const std::string& filename, BlockType block_type,
+                       std::vector<Node>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset, bool verify,
+                       RelocateFn relocate, OffsetTriIdsFn offset_tri_ids) {
     // Account for the nodes of other BVHs that might already be inside the array.
     const int node_offset = nodes_out.size();
     const int tris_offset = tris_out.size();
 
-    std::ifstream in(filename, std::ifstream::binary);
-    if (!in || !check_header(in) || !locate_block(in, block_type))
+    MappedFile file(filename);
+    uint64_t block_size;
+    const uint8_t* block = file ? locate_block(file, block_type, block_size) : nullptr;
+    if (!block || block_size < sizeof(VersionedHeader))
+        return false;
+
+    VersionedHeader h;
+    std::memcpy(&h, block, sizeof(VersionedHeader));
+    if (h.version != accel_version ||
+        block_size != sizeof(VersionedHeader) + sizeof(Node) * uint64_t(h.node_count) + sizeof(Vec4) * uint64_t(h.prim_count))
         return false;
 
-    Header h;
-    in.read((char*)&h, sizeof(Header));
+    const uint8_t* node_data = block + sizeof(VersionedHeader);
+    const uint8_t* prim_data = node_data + sizeof(Node) * h.node_count;
+    if (verify &&
+        (checksum(node_data, sizeof(Node) * h.node_count) != h.node_checksum ||
+         checksum(prim_data, sizeof(Vec4) * h.prim_count) != h.prim_checksum))
+        return false;
 
     nodes_out.resize(nodes_out.size() + h.node_count);
     tris_out .resize( tris_out.size() + h.prim_count);
 
-    in.read((char*)(nodes_out.data() + node_offset), sizeof(Node) * h.node_count);
-    in.read((char*)( tris_out.data() + tris_offset), sizeof(Vec4) * h.prim_count);
+    std::memcpy(nodes_out.data() + node_offset, node_data, sizeof(Node) * h.node_count);
+    std::memcpy( tris_out.data() + tris_offset, prim_data, sizeof(Vec4) * h.prim_count);
 
-    if (node_offset > 0) {
-        for (int i = node_offset; i < nodes_out.size(); ++i) {
-            if (nodes_out[i].left < 0)
-                nodes_out[i].left = ~(~nodes_out[i].left + tris_offset);
-            else
-                nodes_out[i].left += node_offset;
-
-            if (nodes_out[i].right < 0)
-                nodes_out[i].right = ~(~nodes_out[i].right + tris_offset);
-            else
-                nodes_out[i].right += node_offset;
-        }
-    }
+    // Blocks are stored relative to the beginning of the arrays, so this is only needed when appending.
+    if (node_offset > 0)
+        relocate(nodes_out.data() + node_offset, h.node_count, node_offset, tris_offset);
 
-    if (tri_id_offset != 0) {
-        for (int i = tris_offset; i < tris_out.size(); i += 3) {
-            tris_out[i + 1].w = int_as_float(float_as_int(tris_out[i + 1].w) + tri_id_offset);
-        }
-    }
+    // The ids only need to be changed when the meshes of the scene have changed since the block was stored.
+    if (tri_id_offset != h.tri_id_offset)
+        offset_tri_ids(tris_out.data() + tris_offset, h.prim_count, tri_id_offset - h.tri_id_offset);
 
     return true;
 }
 
-bool store_accel_cpu(const std::string& filename, const std::vector<traversal_cpu::Node>& nodes, const int node_offset, const std::vector<Vec4>& tris, const int tris_offset, const int tri_id_offset) {
-    const BlockType block_type = BlockType::MBVH;
-    using traversal_cpu::Node;
-
+template <typename Node, typename RelocateFn>
+static bool store_accel(const std::string& filename, BlockType block_type,
+                        const std::vector<Node>& nodes, const int node_offset,
+                        const std::vector<Vec4>& tris, const int tris_offset, const int tri_id_offset,
+                        RelocateFn relocate) {
     // Check if the file exists and has the correct signature.
     bool exists;
     {
         std::ifstream in(filename, std::ifstream::binary);
         exists = in && check_header(in);
 
-        if (exists && locate_block(in, block_type))
-            return false; // The file already contains a BVH for this platform.
+        // The file already contains a BVH for this platform, which could not be loaded: it is replaced.
+        if (exists && locate_block(in, block_type)) {
+            in.close();
+            if (!remove_blocks(filename, block_type))
+                return false;
+        }
     }
 
     // Open the file and write the BVH block.
@@ -162,143 +280,70 @@ bool store_accel_cpu(const std::string& filename, const std::vector<traversal_cp
         return false;
 
     // Write the header if the file did not exist already.
-    if (!exists) {
-        const uint32_t magic = 0x313F1A57;
-        out.write((const char*)&magic, sizeof(uint32_t));
+    if (!exists)
+        out.write((const char*)&accel_magic, sizeof(uint32_t));
+
+    // Store the nodes relative to the beginning of the array.
+    const Node* node_data = nodes.data() + node_offset;
+    std::vector<Node> buf;
+    if (node_offset > 0) {
+        buf.assign(nodes.begin() + node_offset, nodes.end());
+        relocate(buf.data(), buf.size(), -node_offset, -tris_offset);
+        node_data = buf.data();
     }
+    const Vec4* prim_data = tris.data() + tris_offset;
 
     // Write the block header: size, type, header data
-    Header h;
+    VersionedHeader h;
+    h.version = accel_version;
     h.node_count = nodes.size() - node_offset;
     h.prim_count = tris.size() - tris_offset;
+    h.tri_id_offset = tri_id_offset;
+    h.node_checksum = checksum(node_data, sizeof(Node) * h.node_count);
+    h.prim_checksum = checksum(prim_data, sizeof(Vec4) * h.prim_count);
 
-    const uint64_t block_size = sizeof(uint32_t) + sizeof(Header) + sizeof(Node) * h.node_count + sizeof(Vec4) * h.prim_count;
+    const uint64_t block_size = sizeof(uint32_t) + sizeof(VersionedHeader) + sizeof(Node) * h.node_count + sizeof(Vec4) * h.prim_count;
     out.write((char*)&block_size, sizeof(uint64_t));
     out.write((const char*)&block_type, sizeof(uint32_t));
-    out.write((char*)&h, sizeof(Header));
+    out.write((char*)&h, sizeof(VersionedHeader));
 
     // Write the actual data.
-    if (node_offset == 0)
-        out.write((const char*)nodes.data(), sizeof(Node) * h.node_count);
-    else {
-        std::vector<Node> buf;
-        for (int i = node_offset; i < nodes.size(); ++i) {
-            buf.emplace_back(nodes[i]);
-
-            for (int j = 0; j < 4; ++j) {
-                if (buf.back().children[j] > 0)
-                    buf.back().children[j] -= node_offset;
-                else if (buf.back().children[j] < 0)
-                    buf.back().children[j] = ~(~buf.back().children[j] - tris_offset);
-            }
-        }
+    out.write((const char*)node_data, sizeof(Node) * h.node_count);
+    out.write((const char*)prim_data, sizeof(Vec4) * h.prim_count);
 
-        out.write((const char*)buf.data(), sizeof(Node) * h.node_count);
-    }
+    return static_cast<bool>(out);
+}
 
-    if (tri_id_offset != 0) {
-        std::vector<Vec4> buf;
-        for (int i = tris_offset; i < tris.size(); ) {
-            for (int j = 0; j < 13; ++j)
-                buf.emplace_back(tris[i++]);
+bool load_accel_cpu(const std::string& filename, std::vector<traversal_cpu::Node>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset, bool verify) {
+    return load_accel(filename, BlockType::MBVH_VERSIONED, nodes_out, tris_out, tri_id_offset, verify, relocate_accel_cpu, offset_tri_ids_cpu<4>);
+}
 
-            auto set = [tri_id_offset] (float& val) {
-                if (float_as_int(val) != 0x80000000)
-                    val = int_as_float(float_as_int(val) - tri_id_offset);
-            };
+bool load_accel_cpu8(const std::string& filename, std::vector<traversal_native::Node8>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset, bool verify) {
+    return load_accel(filename, BlockType::MBVH8_VERSIONED, nodes_out, tris_out, tri_id_offset, verify, relocate_accel_cpu8, offset_tri_ids_cpu<8>);
+}
 
-            set(buf.back().x);
-            set(buf.back().y);
-            set(buf.back().z);
-            set(buf.back().w);
+bool load_accel_cpu4q(const std::string& filename, std::vector<traversal_native::QNode4>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset, bool verify) {
+    return load_accel(filename, BlockType::QMBVH4_VERSIONED, nodes_out, tris_out, tri_id_offset, verify, relocate_accel_cpu4q, offset_tri_ids_cpu<4>);
+}
 
-            if (float_as_int(tris[i].x) == 0x80000000)
-                buf.emplace_back(tris[i++]); // Push the sentinel
-        }
+bool load_accel_gpu(const std::string& filename, std::vector<traversal_gpu::Node>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset, bool verify) {
+    return load_accel(filename, BlockType::BVH_VERSIONED, nodes_out, tris_out, tri_id_offset, verify, relocate_accel_gpu, offset_tri_ids_gpu);
+}
 
-        out.write((const char*)buf.data(), sizeof(Vec4) * h.prim_count);
+bool store_accel_cpu(const std::string& filename, const std::vector<traversal_cpu::Node>& nodes, const int node_offset, const std::vector<Vec4>& tris, const int tris_offset, const int tri_id_offset) {
+    return store_accel(filename, BlockType::MBVH_VERSIONED, nodes, node_offset, tris, tris_offset, tri_id_offset, relocate_accel_cpu);
+}
 
-    } else
-        out.write((const char*)(tris.data() + tris_offset), sizeof(Vec4) * h.prim_count);
+bool store_accel_cpu8(const std::string& filename, const std::vector<traversal_native::Node8>& nodes, const int node_offset, const std::vector<Vec4>& tris, const int tris_offset, const int tri_id_offset) {
+    return store_accel(filename, BlockType::MBVH8_VERSIONED, nodes, node_offset, tris, tris_offset, tri_id_offset, relocate_accel_cpu8);
+}
 
-    return true;
+bool store_accel_cpu4q(const std::string& filename, const std::vector<traversal_native::QNode4>& nodes, const int node_offset, const std::vector<Vec4>& tris, const int tris_offset, const int tri_id_offset) {
+    return store_accel(filename, BlockType::QMBVH4_VERSIONED, nodes, node_offset, tris, tris_offset, tri_id_offset, relocate_accel_cpu4q);
 }
 
 bool store_accel_gpu(const std::string& filename, const std::vector<traversal_gpu::Node>& nodes, const int node_offset, const std::vector<Vec4>& tris, const int tris_offset, const int tri_id_offset) {
-    const BlockType block_type = BlockType::BVH;
-    using traversal_gpu::Node;
-
-    // Check if the file exists and has the correct signature.
-    bool exists;
-    {
-        std::ifstream in(filename, std::ifstream::binary);
-        exists = in && check_header(in);
-
-        if (exists && locate_block(in, block_type))
-            return false; // The file already contains a BVH for this platform.
-    }
-
-    // Open the file and write the BVH block.
-    auto mode = exists ? std::ofstream::binary | std::ofstream::app : std::ofstream::binary;
-    std::ofstream out(filename, mode);
-    if (!out)
-        return false;
-
-    // Write the header if the file did not exist already.
-    if (!exists) {
-        const uint32_t magic = 0x313F1A57;
-        out.write((const char*)&magic, sizeof(uint32_t));
-    }
-
-    // Write the block header: size, type, header data
-    Header h;
-    h.node_count = nodes.size() - node_offset;
-    h.prim_count = tris.size() - tris_offset;
-
-    const uint64_t block_size = sizeof(uint32_t) + sizeof(Header) + sizeof(Node) * h.node_count + sizeof(Vec4) * h.prim_count;
-    out.write((char*)&block_size, sizeof(uint64_t));
-    out.write((const char*)&block_type, sizeof(uint32_t));
-    out.write((char*)&h, sizeof(Header));
-
-    // Write the actual data.
-    if (node_offset == 0)
-        out.write((const char*)nodes.data(), sizeof(Node) * h.node_count);
-    else {
-        std::vector<Node> buf;
-        for (int i = node_offset; i < nodes.size(); ++i) {
-            buf.emplace_back(nodes[i]);
-
-            if (buf.back().left < 0)
-                buf.back().left = ~(~buf.back().left - tris_offset);
-            else
-                buf.back().left -= node_offset;
-
-            if (buf.back().right < 0)
-                buf.back().right = ~(~buf.back().right - tris_offset);
-            else
-                buf.back().right -= node_offset;
-        }
-
-        out.write((const char*)buf.data(), sizeof(Node) * h.node_count);
-    }
-
-    if (tri_id_offset != 0) {
-        std::vector<Vec4> buf;
-        for (int i = tris_offset; i < tris.size(); ) {
-            buf.emplace_back(tris[i++]);
-            buf.emplace_back(tris[i++]);
-
-            buf.back().w = int_as_float(float_as_int(buf.back().w) - tri_id_offset);
-
-            buf.emplace_back(tris[i++]);
-        }
-
-        out.write((const char*)buf.data(), sizeof(Vec4) * h.prim_count);
-
-    } else
-        out.write((const char*)(tris.data() + tris_offset), sizeof(Vec4) * h.prim_count);
-
-    return true;
+    return store_accel(filename, BlockType::BVH_VERSIONED, nodes, node_offset, tris, tris_offset, tri_id_offset, relocate_accel_gpu);
 }
 
 }
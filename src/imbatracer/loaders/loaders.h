@@ -7,6 +7,7 @@
 #include "imbatracer/loaders/store_png.h"
 
 #include "imbatracer/render/scheduling/ray_queue.h"
+#include "imbatracer/core/traversal_native.h"
 
 namespace imba {
 
@@ -21,10 +22,27 @@ inline bool load_image(const Path& path, Image& image) {
     return true;
 }
 
-bool load_accel_cpu (const std::string& filename, std::vector<traversal_cpu::Node>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset);
+/// Computes a 64-bit checksum of the given data. Chunks are hashed in parallel, and their hashes are combined in order.
+uint64_t checksum(const void* data, size_t size);
+
+/// Offsets the child indices of BVH nodes that are moved behind node_offset other nodes and tris_offset other triangle vectors.
+void relocate_accel_cpu(traversal_cpu::Node* nodes, int node_count, int node_offset, int tris_offset);
+void relocate_accel_cpu8(traversal_native::Node8* nodes, int node_count, int node_offset, int tris_offset);
+void relocate_accel_cpu4q(traversal_native::QNode4* nodes, int node_count, int node_offset, int tris_offset);
+void relocate_accel_gpu(traversal_gpu::Node* nodes, int node_count, int node_offset, int tris_offset);
+
+/// Loads or stores the acceleration structure of a mesh. When loading, the checksums are only checked if verify is true.
+/// Storing replaces the block of the same type, if the file already contains one.
+bool load_accel_cpu (const std::string& filename, std::vector<traversal_cpu::Node>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset, bool verify);
 bool store_accel_cpu(const std::string& filename, const std::vector<traversal_cpu::Node>& nodes, const int node_offset, const std::vector<Vec4>& tris, const int tris_offset, const int tri_id_offset);
 
-bool load_accel_gpu (const std::string& filename, std::vector<traversal_gpu::Node>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset);
+bool load_accel_cpu8 (const std::string& filename, std::vector<traversal_native::Node8>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset, bool verify);
+bool store_accel_cpu8(const std::string& filename, const std::vector<traversal_native::Node8>& nodes, const int node_offset, const std::vector<Vec4>& tris, const int tris_offset, const int tri_id_offset);
+
+bool load_accel_cpu4q (const std::string& filename, std::vector<traversal_native::QNode4>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset, bool verify);
+bool store_accel_cpu4q(const std::string& filename, const std::vector<traversal_native::QNode4>& nodes, const int node_offset, const std::vector<Vec4>& tris, const int tris_offset, const int tri_id_offset);
+
+bool load_accel_gpu (const std::string& filename, std::vector<traversal_gpu::Node>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset, bool verify);
 bool store_accel_gpu(const std::string& filename, const std::vector<traversal_gpu::Node>& nodes, const int node_offset, const std::vector<Vec4>& tris, const int tris_offset, const int tri_id_offset);
 
 } // namespace imba
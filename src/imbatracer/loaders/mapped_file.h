@@ -0,0 +1,78 @@
+#ifndef IMBA_MAPPED_FILE_H
+#define IMBA_MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define IMBA_HAS_MMAP
+#endif
+
+namespace imba {
+
+/// Read-only view on the contents of a file. The file is memory-mapped when the platform
+/// supports it, so that only the pages that are accessed are read from the disk.
+/// Otherwise, the whole file is read into memory.
+class MappedFile {
+public:
+    MappedFile(const std::string& filename)
+        : data_(nullptr), size_(0)
+    {
+#ifdef IMBA_HAS_MMAP
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr != MAP_FAILED) {
+                data_ = static_cast<const uint8_t*>(ptr);
+                size_ = st.st_size;
+            }
+        }
+        close(fd);
+#else
+        std::ifstream in(filename, std::ifstream::binary | std::ifstream::ate);
+        if (!in) return;
+
+        buffer_.resize(in.tellg());
+        in.seekg(0);
+        if (in.read((char*)buffer_.data(), buffer_.size())) {
+            data_ = buffer_.data();
+            size_ = buffer_.size();
+        }
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef IMBA_HAS_MMAP
+        if (data_) munmap(const_cast<uint8_t*>(data_), size_);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator= (const MappedFile&) = delete;
+
+    operator bool() const { return data_ != nullptr; }
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const uint8_t* data_;
+    size_t size_;
+#ifndef IMBA_HAS_MMAP
+    std::vector<uint8_t> buffer_;
+#endif
+};
+
+} // namespace imba
+
+#endif // IMBA_MAPPED_FILE_H
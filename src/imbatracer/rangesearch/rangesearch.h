@@ -2,8 +2,13 @@
 #define IMBA_RANGESEARCH_H
 
 #include "imbatracer/core/float4.h"
+#include "imbatracer/core/simd.h"
+#include "imbatracer/core/radix_sort.h"
 
+#include <cstdint>
 #include <vector>
+#include <iterator>
+#include <algorithm>
 
 #define NOMINMAX
 #include <tbb/tbb.h>
@@ -18,20 +23,29 @@ struct CellIdx {
     CellIdx() : x(0), y(0) {}
 };
 
-template<typename Iter, typename Photon>
+/// Uniform grid of photons. The photons are sorted by the Morton code of their cell, so that the photons of a cell,
+/// and those of neighbouring cells, are close in memory. Only the non-empty cells are stored, sorted by Morton code,
+/// and they are found by binary search.
+/// The grid only stores the positions and the indices of the photons: the photons themselves are not copied,
+/// and must not be moved or modified until the grid is rebuilt.
+template<typename Iter>
 class HashGrid {
-    typedef unsigned int uint;
 public:
+    typedef typename std::iterator_traits<Iter>::value_type Photon;
+
     void build(const Iter& photons_begin, const Iter& photons_end, float radius) {
-        constexpr int inv_load_factor = 2;
+        photons_ = photons_begin;
         radius_        = radius;
         radius_sqr_    = sqr(radius_);
         cell_size_     = radius_ * 2.f;
         inv_cell_size_ = 1.f / cell_size_;
 
         int photon_count = photons_end - photons_begin;
-        if (cell_ends_.size() < photon_count * inv_load_factor)
-            cell_ends_ = std::vector<std::atomic<int>>(photon_count * inv_load_factor);
+        if (photon_count == 0) {
+            bbox_ = BBox::empty();
+            cell_keys_.clear();
+            return;
+        }
 
         // Compute the extents of the bounding box.
         bbox_ = tbb::parallel_reduce(tbb::blocked_range<Iter>(photons_begin, photons_end), BBox::empty(),
@@ -45,39 +59,102 @@ public:
         bbox_.max += extents * 0.001f;
         bbox_.min -= extents * 0.001f;
 
-        // Distribute the photons to the HashGrid cells using Counting Sort.
-        photons_.resize(photon_count);
-        std::fill(cell_ends_.begin(), cell_ends_.end(), 0);
+        // Use as many bits per axis as needed to give every cell its own Morton code, up to 21.
+        const float max_extent = std::max(std::max(bbox_.max.x - bbox_.min.x, bbox_.max.y - bbox_.min.y), bbox_.max.z - bbox_.min.z);
+        const float cells_per_axis = std::min(max_extent * inv_cell_size_ + 1.0f, float(1 << max_axis_bits));
+        int axis_bits = 0;
+        while ((1 << axis_bits) < cells_per_axis) axis_bits++;
+        axis_mask_ = (1 << axis_bits) - 1;
 
-        // Count the number of photons in each cell.
-        tbb::parallel_for(tbb::blocked_range<Iter>(photons_begin, photons_end), [this](const tbb::blocked_range<Iter>& range){
-            for (Iter it = range.begin(); it != range.end(); ++it) {
-                cell_ends_[cell_index(it->position())]++;
-            }
+        // Sort the photons by the Morton code of their cell.
+        keys_.resize(photon_count);
+        order_.resize(photon_count);
+        tbb::parallel_for(tbb::blocked_range<int>(0, photon_count), [&] (const tbb::blocked_range<int>& range) {
+            for (int i = range.begin(); i != range.end(); i++)
+                keys_[i] = cell_key(photons_begin[i].position());
         });
+        radix_sort_.sort(keys_.data(), photon_count, 3 * axis_bits, order_.data());
 
-        // Set the cell_ends_[x] to the first index that belongs to the respective cell.
-        int sum = 0;
-        for(size_t i = 0; i < cell_ends_.size(); i++) {
-            int temp = cell_ends_[i];
-            cell_ends_[i] = sum;
-            sum += temp;
-        }
-
-        // Assign the photons to the cells.
-        tbb::parallel_for(tbb::blocked_range<Iter>(photons_begin, photons_end), [this](const tbb::blocked_range<Iter>& range){
-            for (Iter it = range.begin(); it != range.end(); ++it) {
-                const float3 &pos = it->position();
-                const int target_idx = cell_ends_[cell_index(pos)]++;
-                photons_[target_idx] = *it;
+        // The positions are padded, so that the last cell can be read with vector loads.
+        pos_x_.resize(photon_count + simd_width);
+        pos_y_.resize(photon_count + simd_width);
+        pos_z_.resize(photon_count + simd_width);
+        tbb::parallel_for(tbb::blocked_range<int>(0, photon_count), [&] (const tbb::blocked_range<int>& range) {
+            for (int i = range.begin(); i != range.end(); i++) {
+                const float3& pos = photons_begin[order_[i]].position();
+                pos_x_[i] = pos.x;
+                pos_y_[i] = pos.y;
+                pos_z_[i] = pos.z;
             }
         });
+
+        // Find the first photon of every cell, with a parallel prefix sum over the cell boundaries.
+        cell_keys_.resize(photon_count);
+        cell_starts_.resize(photon_count + 1);
+        const int cell_count = tbb::parallel_scan(tbb::blocked_range<int>(0, photon_count), 0,
+            [&] (const tbb::blocked_range<int>& range, int sum, bool is_final_scan) {
+                for (int i = range.begin(); i != range.end(); i++) {
+                    const uint64_t key = keys_[order_[i]];
+                    if (i > 0 && key == keys_[order_[i - 1]]) continue;
+                    if (is_final_scan) {
+                        cell_keys_[sum] = key;
+                        cell_starts_[sum] = i;
+                    }
+                    sum++;
+                }
+                return sum;
+            },
+            [] (int a, int b) { return a + b; });
+        cell_keys_.resize(cell_count);
+        cell_starts_.resize(cell_count + 1);
+        cell_starts_[cell_count] = photon_count;
     }
 
+    /// Fills the container with the k nearest photons within the radius around the given point, sorted by distance.
+    /// \returns The number of photons found
     template <typename Container>
     int query(const float3& query_pos, Container& out, int k) const {
+        auto distances = V_ARRAY(float, k);
+        int count = 0;
+        for_each_in_radius(query_pos, [&] (int i, float dist_sqr) {
+            if (count == k) {
+                if (distances[count - 1] < dist_sqr) return;
+            } else count++;
+
+            // Insertion sort
+            distances[count - 1] = dist_sqr;
+            out[count - 1] = &photons_[order_[i]];
+            for (int l = count - 2; l >= 0; --l) {
+                if (distances[l] > dist_sqr) {
+                    std::swap(distances[l], distances[l + 1]);
+                    std::swap(out[l], out[l + 1]);
+                } else break;
+            }
+        });
+
+        return count;
+    }
+
+    /// Calls fn(photon, dist_sqr) for every photon within the radius around the given point, in no particular order.
+    template <typename Fn>
+    void query_radius(const float3& query_pos, Fn fn) const {
+        for_each_in_radius(query_pos, [&] (int i, float dist_sqr) { fn(photons_[order_[i]], dist_sqr); });
+    }
+
+private:
+#ifdef IMBA_HAS_AVX
+    static constexpr int simd_width = 8;
+#else
+    static constexpr int simd_width = 4;
+#endif
+    typedef vfloat<simd_width> vfloat_t;
+
+    /// Calls fn(index, dist_sqr) for every photon within the radius around the given point.
+    /// The distances to the photons of a cell are computed simd_width at a time.
+    template <typename Fn>
+    void for_each_in_radius(const float3& query_pos, Fn fn) const {
         // Check if the position is outside the bounding box.
-        if (!bbox_.is_inside(query_pos)) return 0;
+        if (!bbox_.is_inside(query_pos)) return;
 
         const float3 cell = inv_cell_size_ * (query_pos - bbox_.min);
         const float3 coord(
@@ -95,61 +172,85 @@ public:
         const int pyo = py + (fract_coord.y < 0.5f ? -1 : 1);
         const int pzo = pz + (fract_coord.z < 0.5f ? -1 : 1);
 
-        auto distances = V_ARRAY(float, k);
-        int count = 0;
+        const vfloat_t qx(query_pos.x), qy(query_pos.y), qz(query_pos.z);
+        const vfloat_t radius_sqr(radius_sqr_);
+
         for (int j = 0; j < 8; j++) {
             const int x = j & 4 ? pxo : px;
             const int y = j & 2 ? pyo : py;
             const int z = j & 1 ? pzo : pz;
-            CellIdx active_range = cell_range(cell_index(x , y , z ));
-
-            for (; active_range.x < active_range.y; active_range.x++) {
-                const auto& photon = photons_[active_range.x];
-                const float dist_sqr = lensqr(query_pos - photon.position);
-
-                if (dist_sqr <= radius_sqr_) {
-                    if (count == k) {
-                        if (distances[count - 1] < dist_sqr) continue;
-                    } else count++;
-
-                    // Insertion sort
-                    distances[count - 1] = dist_sqr;
-                    out[count - 1] = &photon;
-                    for (int l = count - 2; l >= 0; --l) {
-                        if (distances[l] > dist_sqr) {
-                            std::swap(distances[l], distances[l + 1]);
-                            std::swap(out[l], out[l + 1]);
-                        } else break;
-                    }
+            const CellIdx active_range = cell_range(x, y, z);
+
+            for (int i = active_range.x; i < active_range.y; i += simd_width) {
+                const vfloat_t dx = vfloat_t::load(pos_x_.data() + i) - qx;
+                const vfloat_t dy = vfloat_t::load(pos_y_.data() + i) - qy;
+                const vfloat_t dz = vfloat_t::load(pos_z_.data() + i) - qz;
+                const vfloat_t dist_sqr = dx * dx + dy * dy + dz * dz;
+
+                int inside = (dist_sqr <= radius_sqr).bits();
+                // Ignore the photons that belong to the next cells.
+                if (active_range.y - i < simd_width)
+                    inside &= (1 << (active_range.y - i)) - 1;
+                if (!inside) continue;
+
+                float d[simd_width];
+                dist_sqr.store(d);
+                for (int l = 0; l < simd_width; l++) {
+                    if (inside & (1 << l)) fn(i + l, d[l]);
                 }
             }
         }
+    }
 
-        return count;
+    static constexpr int max_axis_bits = 21;
+
+    /// Returns the range of photons in the given cell, which is empty if the cell has no photon.
+    CellIdx cell_range(int x, int y, int z) const {
+        if (x < 0 || y < 0 || z < 0) return CellIdx(0, 0);
+
+        const uint64_t key = cell_key(x, y, z);
+        auto it = std::lower_bound(cell_keys_.begin(), cell_keys_.end(), key);
+        if (it == cell_keys_.end() || *it != key) return CellIdx(0, 0);
+
+        const int cell = it - cell_keys_.begin();
+        return CellIdx(cell_starts_[cell], cell_starts_[cell + 1]);
     }
 
-private:
-    CellIdx cell_range(int cell_idx) const {
-        if(cell_idx == 0) return CellIdx(0, cell_ends_[0]);
-        return CellIdx(cell_ends_[cell_idx-1], cell_ends_[cell_idx]);
+    /// Spreads the lowest 21 bits of an integer, so that there are two zero bits between each of them.
+    static uint64_t spread_bits(uint64_t x) {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x <<  8) & 0x100f00f00f00f00full;
+        x = (x | x <<  4) & 0x10c30c30c30c30c3ull;
+        x = (x | x <<  2) & 0x1249249249249249ull;
+        return x;
     }
 
-    int cell_index(uint x, uint y, uint z) const {
-        return int(((x * 73856093) ^ (y * 19349663) ^
-            (z * 83492791)) % uint(cell_ends_.size()));
+    /// Returns the Morton code of a cell. The coordinates are wrapped when the grid is too large,
+    /// in which case distant cells may share their photons.
+    uint64_t cell_key(int x, int y, int z) const {
+        return spread_bits(x & axis_mask_) << 2 | spread_bits(y & axis_mask_) << 1 | spread_bits(z & axis_mask_);
     }
 
-    int cell_index(const float3 &point) const {
+    uint64_t cell_key(const float3 &point) const {
         const float3 dist_min = inv_cell_size_ * (point - bbox_.min);
         int coord_x = std::floor(dist_min.x);
         int coord_y = std::floor(dist_min.y);
         int coord_z = std::floor(dist_min.z);
-        return cell_index(coord_x, coord_y, coord_z);
+        return cell_key(coord_x, coord_y, coord_z);
     }
 
     BBox bbox_;
-    std::vector<Photon> photons_;
-    std::vector<std::atomic<int>> cell_ends_;
+    Iter photons_;
+    std::vector<int> order_;                   ///< Indices of the photons, sorted by cell
+    std::vector<float> pos_x_, pos_y_, pos_z_; ///< Positions of the photons, in the same order
+    std::vector<uint64_t> cell_keys_;          ///< Morton codes of the non-empty cells, in increasing order
+    std::vector<int> cell_starts_;             ///< Index of the first photon of every cell, followed by the number of photons
+    int axis_mask_;
+
+    std::vector<uint64_t> keys_;
+    RadixSort radix_sort_;
 
     float radius_;
     float radius_sqr_;
@@ -30,7 +30,7 @@ void Integrator::estimate_pixel_size() {
     if (use_gpu)
         q.traverse_gpu(scene_.traversal_data_gpu());
     else
-        q.traverse_cpu(scene_.traversal_data_cpu());
+        scene_.traverse_cpu(q);
     auto hits = q.hits();
     auto rays = q.rays();
 
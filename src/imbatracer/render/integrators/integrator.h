@@ -9,6 +9,7 @@
 
 #include "imbatracer/core/mesh.h"
 #include "imbatracer/core/image.h"
+#include "imbatracer/core/thread_local_image.h"
 #include "imbatracer/core/rgb.h"
 
 #include <functional>
@@ -19,7 +20,7 @@ namespace imba {
 class Integrator {
 public:
     Integrator(const Scene& scene, const PerspectiveCamera& cam)
-        : scene_(scene), cam_(cam)
+        : scene_(scene), cam_(cam), sort_hits_(false)
     {}
 
     virtual ~Integrator() {}
@@ -33,20 +34,36 @@ public:
     /// Called once per scene at the beginning, before the other methods.
     virtual void preprocess() { estimate_pixel_size(); }
 
+    /// Prints the statistics collected while rendering.
+    virtual void print_stats() const {}
+
     /// Estimate of the average distance between hit points of rays from the same pixel.
     /// The value is computed during the preprocessing phase.
     /// The result of calling this function before preprocess() is undefined.
     float pixel_size() const { return pixel_size_; }
 
+    /// Enables sorting the hits of every material by triangle before they are shaded.
+    /// The accesses to the mesh data become more coherent, but every material bin has to be sorted.
+    void set_hit_sorting(bool enable) { sort_hits_ = enable; }
+
 protected:
     const Scene& scene_;
     const PerspectiveCamera& cam_;
 
-    inline static void add_contribution(AtomicImage& out, int pixel_id, const rgb& contrib) {
-        out.pixels()[pixel_id].apply<std::plus<float> >(contrib);
+    /// Collects the contributions of an iteration, merged into the output image at its end.
+    ThreadLocalImage local_image_;
+
+    /// Returns the secondary key to sort the hits of every material with, or nullptr if hit sorting is disabled.
+    std::function<int (const Hit&)> hit_sort_key() const {
+        if (!sort_hits_) return nullptr;
+        return [] (const Hit& hit) { return hit.tri_id; };
+    }
+
+    inline static void add_contribution(ThreadLocalImage& out, int pixel_id, const rgb& contrib) {
+        out.add(pixel_id, contrib);
     }
 
-    inline void process_shadow_rays(RayQueue<ShadowState>& ray_in, AtomicImage& out) {
+    inline void process_shadow_rays(RayQueue<ShadowState>& ray_in, ThreadLocalImage& out) {
         ShadowState* states = ray_in.states();
         Hit* hits = ray_in.hits();
 
@@ -64,6 +81,7 @@ protected:
 
 private:
     float pixel_size_;
+    bool sort_hits_;
 
     void estimate_pixel_size();
 };
@@ -109,7 +127,7 @@ inline Intersection calculate_intersection(const Scene& scene, const Hit& hit, c
     local_coordinates(normal, u_tangent, v_tangent);
 
     Intersection res {
-        pos, w_out, normal, uv_coords, geom_normal, u_tangent, v_tangent, mat.get()
+        pos, w_out, normal, uv_coords, geom_normal, u_tangent, v_tangent, mat.get(), m
     };
 
     // If the material has a bump map, modify the shading normal accordingly.
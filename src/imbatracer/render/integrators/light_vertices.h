@@ -9,78 +9,143 @@
 
 #include "imbatracer/render/random.h"
 
+#include <cstdint>
+#include <cstring>
+
 #define NOMINMAX
 #include <tbb/tbb.h>
+#include <tbb/concurrent_vector.h>
+#include <tbb/enumerable_thread_specific.h>
 
 namespace imba {
 
+/// Packs a unit vector in 32 bits, with an octahedral mapping quantized on 16 bits per coordinate.
+/// See Cigolle et al., "A Survey of Efficient Representations for Independent Unit Vectors", 2014
+inline uint32_t encode_unit_vector(const float3& n) {
+    const float inv_norm = 1.0f / (fabsf(n.x) + fabsf(n.y) + fabsf(n.z));
+    float u = n.x * inv_norm;
+    float v = n.y * inv_norm;
+    if (n.z < 0.0f) {
+        const float fold_u = (1.0f - fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+        const float fold_v = (1.0f - fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+        u = fold_u;
+        v = fold_v;
+    }
+    const uint32_t qu = uint32_t(std::round(clamp(u, -1.0f, 1.0f) * 32767.0f) + 32767.0f);
+    const uint32_t qv = uint32_t(std::round(clamp(v, -1.0f, 1.0f) * 32767.0f) + 32767.0f);
+    return qu | qv << 16;
+}
+
+inline float3 decode_unit_vector(uint32_t e) {
+    const float u = (int(e & 0xFFFF) - 32767) / 32767.0f;
+    const float v = (int(e >> 16)    - 32767) / 32767.0f;
+    float3 n(u, v, 1.0f - fabsf(u) - fabsf(v));
+    if (n.z < 0.0f) {
+        n.x = (1.0f - fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+        n.y = (1.0f - fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+    }
+    return normalize(n);
+}
+
+/// Stores a float in 16 bits, as its 8 exponent bits and the 7 most significant bits of its mantissa (bfloat16).
+/// Unlike half floats, this covers the whole range of the partial MIS weights.
+inline uint16_t encode_bfloat16(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    bits += 0x7FFF + ((bits >> 16) & 1); // Round to nearest even
+    return uint16_t(bits >> 16);
+}
+
+inline float decode_bfloat16(uint16_t h) {
+    const uint32_t bits = uint32_t(h) << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
 /// Stores the data required for connecting (or merging) a camera vertex to (with) a light vertex.
+/// The cache holds many vertices, so they are packed: the directions are stored in 32 bits each, the partial
+/// MIS weights in 16 bits each, and the tangent frame is rebuilt from the shading normal.
+/// The textures of the material are sampled once, when the vertex is stored.
 struct LightPathVertex {
-    Intersection isect;
+    float3 pos;
+    uint32_t packed_out_dir;
+    uint32_t packed_normal;
+    uint32_t packed_geom_normal;
+    rgb color; ///< Surface color of the material, see Material::surface_color()
     rgb throughput;
-
-    int path_length;
+    int mat_id;
 
     // partial weights for MIS, see VCM technical report
-    float dVC;
-    float dVCM;
-    float dVM;
-
-    LightPathVertex(Intersection isect, rgb tp, float dVC, float dVCM, float dVM, int path_length)
-        : isect(isect), throughput(tp), dVC(dVC), dVCM(dVCM), dVM(dVM), path_length(path_length)
+    uint16_t packed_dVC;
+    uint16_t packed_dVCM;
+    uint16_t packed_dVM;
+
+    uint16_t path_length;
+
+    LightPathVertex(const Intersection& isect, const rgb& color, rgb tp, float dVC, float dVCM, float dVM, int path_length)
+        : pos(isect.pos)
+        , packed_out_dir(encode_unit_vector(isect.out_dir))
+        , packed_normal(encode_unit_vector(isect.normal))
+        , packed_geom_normal(encode_unit_vector(isect.geom_normal))
+        , color(color)
+        , throughput(tp)
+        , mat_id(isect.mat_id)
+        , packed_dVC(encode_bfloat16(dVC))
+        , packed_dVCM(encode_bfloat16(dVCM))
+        , packed_dVM(encode_bfloat16(dVM))
+        , path_length(path_length)
     {}
 
     LightPathVertex() {}
 
-    float3& position() { return isect.pos; }
-    const float3& position() const { return isect.pos; }
-};
-
-using PhotonIterator = std::vector<LightPathVertex>::iterator;
-
-struct VCMPhoton {
-    float3 position;
-    float3 out_dir;
-    float dVCM;
-    float dVM;
-    rgb throughput;
-
-    VCMPhoton() {}
-    VCMPhoton(const LightPathVertex& r) {
-        position   = r.isect.pos;
-        out_dir    = r.isect.out_dir;
-        dVCM       = r.dVCM;
-        dVM        = r.dVM;
-        throughput = r.throughput;
+    float3& position() { return pos; }
+    const float3& position() const { return pos; }
+
+    float3 out_dir() const { return decode_unit_vector(packed_out_dir); }
+
+    float dVC()  const { return decode_bfloat16(packed_dVC); }
+    float dVCM() const { return decode_bfloat16(packed_dVCM); }
+    float dVM()  const { return decode_bfloat16(packed_dVM); }
+
+    /// Rebuilds the intersection at the vertex. The tangents are recomputed from the shading normal.
+    /// The texture coordinates are not stored, the BSDF must be built with the stored color.
+    Intersection intersection(const Scene& scene) const {
+        Intersection isect;
+        isect.pos         = pos;
+        isect.out_dir     = out_dir();
+        isect.normal      = decode_unit_vector(packed_normal);
+        isect.uv          = float2(0.0f, 0.0f);
+        isect.geom_normal = decode_unit_vector(packed_geom_normal);
+        local_coordinates(isect.normal, isect.u_tangent, isect.v_tangent);
+        isect.mat         = scene.material(mat_id).get();
+        isect.mat_id      = mat_id;
+        return isect;
     }
 };
 
+using PhotonIterator = tbb::concurrent_vector<LightPathVertex>::iterator;
+
 /// Stores the vertices of the light paths and implements selecting vertices for connecting and merging.
+/// The cache grows on demand: every thread reserves chunks of vertices in a concurrent vector, and fills them alone.
+/// The memory of the vector is kept from one iteration to the next.
 class LightVertices {
-    // Number of light paths to be traced when computing the average length and thus vertex cache size.
-    static const int LIGHT_PATH_LEN_PROBES = 10000;
+    /// Number of vertices reserved at once by a thread.
+    static const int CHUNK_SIZE = 1024;
 public:
-    LightVertices(int path_count)
-        : path_count_(path_count)
-    {}
-
-    void compute_cache_size(const Scene& scene, bool use_gpu);
+    LightVertices() : count_(0) {}
 
     /// Builds the acceleration structure etc to prepare the cache for usage during rendering
-    void build(float radius, bool use_merging) {
-        count_ = std::min<int>(cache_.size(), last_.load());
-        if (use_merging) {
-            accel_.build(cache_.begin(), cache_.begin() + count_, radius);
-        }
-    }
+    void build(float radius, bool use_merging);
 
     inline void add_vertex_to_cache(const LightPathVertex& v) {
-        int i = last_++;
-        if (i >= cache_.size()) {
-            std::cout << "A vertex did not fit into the cache!" << std::endl;
-            return; // Discard vertices that do not fit. This is very unlikely to happen.
+        Chunk& chunk = chunks_.local();
+        if (chunk.next == chunk.end) {
+            // Reserving a chunk is the only synchronization between the threads.
+            chunk.next = cache_.grow_by(CHUNK_SIZE) - cache_.begin();
+            chunk.end  = chunk.next + CHUNK_SIZE;
         }
-        cache_[i] = v;
+        cache_[chunk.next++] = v;
     }
 
     inline int count() const {
@@ -99,27 +164,48 @@ public:
         return accel_.query(pos, out, k);
     }
 
+    /// Calls fn(photon, dist_sqr) for all photons within the radius around the given point, in no particular order.
+    template <typename Fn>
+    inline void for_each_merge(const float3& pos, Fn fn) const {
+        accel_.query_radius(pos, fn);
+    }
+
     /// Removes all vertices currently inside the cache
     void clear() {
-        last_.store(0);
+        cache_.clear();
+        for (auto& chunk : chunks_) chunk = Chunk();
     }
 
+    /// Prints the number of vertices stored per iteration, and how much of the reserved memory they use.
+    void print_stats() const;
+
 private:
-    /// Stores all light vertices, without any path structure
-    std::vector<LightPathVertex> cache_;
+    /// Range of the cache reserved by a thread, and not filled yet.
+    struct Chunk {
+        int next, end;
+        Chunk() : next(0), end(0) {}
+    };
 
-    /// Index of the last free element in the vertex cache
-    std::atomic<int> last_;
+    /// Moves the vertices at the end of the cache to the unused parts of the chunks, so that the vertices are contiguous.
+    void compact();
 
-    /// Number of light vertices currently in the cache,
-    /// separated from last_ because overflow is ignored
+    /// Stores all light vertices, without any path structure
+    tbb::concurrent_vector<LightPathVertex> cache_;
+    tbb::enumerable_thread_specific<Chunk> chunks_;
+
+    /// Number of light vertices currently in the cache
     int count_;
 
     /// Acceleration structure for photon range queries
-    HashGrid<PhotonIterator, VCMPhoton> accel_;
-
-    /// Number of light paths that will be traced and stored in this cache
-    int path_count_;
+    HashGrid<PhotonIterator> accel_;
+
+    struct Stats {
+        int iterations;
+        uint64_t vertices;
+        uint64_t reserved;
+        int max_vertices;
+        Stats() : iterations(0), vertices(0), reserved(0), max_vertices(0) {}
+    } stats_;
 };
 
 } // namespace imba
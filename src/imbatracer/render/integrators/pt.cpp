@@ -14,7 +14,7 @@ namespace imba {
 using ThreadLocalMemArena = tbb::enumerable_thread_specific<MemoryArena, tbb::cache_aligned_allocator<MemoryArena>, tbb::ets_key_per_instance>;
 static ThreadLocalMemArena bsdf_memory_arenas;
 
-void PathTracer::compute_direct_illum(const Intersection& isect, PTState& state, RayQueue<ShadowState>& ray_out_shadow, BSDF* bsdf) {
+void PathTracer::compute_direct_illum(const Intersection& isect, PTState& state, RayBatch<ShadowState>& ray_out_shadow, BSDF* bsdf) {
     // Generate the shadow ray (sample one point on one lightsource)
     const auto& ls = scene_.light(state.rng.random_int(0, scene_.light_count()));
     const float pdf_lightpick = 1.0f / scene_.light_count();
@@ -79,7 +79,7 @@ void PathTracer::bounce(const Intersection& isect, PTState& state_out, Ray& ray_
     };
 }
 
-void PathTracer::process_primary_rays(RayQueue<PTState>& ray_in, RayQueue<ShadowState>& ray_out_shadow, AtomicImage& res_img) {
+void PathTracer::process_primary_rays(RayQueue<PTState>& ray_in, RayStream<ShadowState>& ray_out_shadow, ThreadLocalImage& res_img) {
     // Compact and sort the input hits.
     int hit_count = ray_in.compact_hits();
     ray_in.sort_by_material([this](const Hit& hit){
@@ -89,7 +89,7 @@ void PathTracer::process_primary_rays(RayQueue<PTState>& ray_in, RayQueue<Shadow
             const int m = mesh.indices()[local_tri_id * 4 + 3];
             return m;
         },
-        scene_.material_count(), hit_count);
+        scene_.material_count(), hit_count, hit_sort_key());
 
     // Process all rays that hit nothing, if there is an environment map.
     if (scene_.env_map() != nullptr) {
@@ -123,6 +123,7 @@ void PathTracer::process_primary_rays(RayQueue<PTState>& ray_in, RayQueue<Shadow
         [&] (const tbb::blocked_range<int>& range)
     {
         auto& bsdf_mem_arena = bsdf_memory_arenas.local();
+        RayBatch<ShadowState> shadow_batch(ray_out_shadow);
 
         for (auto i = range.begin(); i != range.end(); ++i) {
             bsdf_mem_arena.free_all();
@@ -151,7 +152,7 @@ void PathTracer::process_primary_rays(RayQueue<PTState>& ray_in, RayQueue<Shadow
             }
 
             const auto bsdf = isect.mat->get_bsdf(isect, bsdf_mem_arena);
-            compute_direct_illum(isect, state, ray_out_shadow, bsdf);
+            compute_direct_illum(isect, state, shadow_batch, bsdf);
             bounce(isect, state, ray_in.ray(i), bsdf, offset);
         }
     });
@@ -160,9 +161,11 @@ void PathTracer::process_primary_rays(RayQueue<PTState>& ray_in, RayQueue<Shadow
 }
 
 void PathTracer::render(AtomicImage& out) {
-    scheduler_.run_iteration(out,
-        [this] (RayQueue<ShadowState>& ray_in, AtomicImage& out) { process_shadow_rays(ray_in, out); },
-        [this] (RayQueue<PTState>& ray_in, RayQueue<ShadowState>& ray_out_shadow, AtomicImage& out) {
+    local_image_.resize(out.size());
+
+    scheduler_.run_iteration(local_image_,
+        [this] (RayQueue<ShadowState>& ray_in, ThreadLocalImage& out) { process_shadow_rays(ray_in, out); },
+        [this] (RayQueue<PTState>& ray_in, RayStream<ShadowState>& ray_out_shadow, ThreadLocalImage& out) {
             process_primary_rays(ray_in, ray_out_shadow, out);
         },
         [this] (int x, int y, ::Ray& ray_out, PTState& state_out) {
@@ -175,6 +178,8 @@ void PathTracer::render(AtomicImage& out) {
             state_out.bounces = 0;
             state_out.last_specular = false;
         });
+
+    local_image_.merge(out);
 }
 
 } // namespace imba
@@ -30,9 +30,9 @@ private:
 
     const int max_path_len_;
 
-    void process_primary_rays(RayQueue<PTState>& ray_in, RayQueue<ShadowState>& ray_out_shadow, AtomicImage& out);
+    void process_primary_rays(RayQueue<PTState>& ray_in, RayStream<ShadowState>& ray_out_shadow, ThreadLocalImage& out);
 
-    void compute_direct_illum(const Intersection& isect, PTState& state, RayQueue<ShadowState>& ray_out_shadow, BSDF* bsdf);
+    void compute_direct_illum(const Intersection& isect, PTState& state, RayBatch<ShadowState>& ray_out_shadow, BSDF* bsdf);
     void bounce(const Intersection& isect, PTState& state_out, Ray& ray_out, BSDF* bsdf, float offset);
 };
 
@@ -23,7 +23,7 @@ static ThreadLocalMemArena bsdf_memory_arenas;
 #define VCM_INTEGRATOR VCMIntegrator<algo>
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::render(AtomicImage& img) {
+void VCM_INTEGRATOR::render(AtomicImage& out) {
     // TODO: add command line option for this!
     const float radius_alpha = 0.75f;
 
@@ -32,6 +32,7 @@ void VCM_INTEGRATOR::render(AtomicImage& img) {
     techniques_dbg_.start_frame(settings_.width, settings_.height, settings_.concurrent_spp);
 
     light_vertices_.clear();
+    local_image_.resize(out.size());
 
     // Shrink the photon mapping radius for the next iteration. Every frame is an iteration of Progressive Photon Mapping.
     cur_iteration_++;
@@ -45,20 +46,22 @@ void VCM_INTEGRATOR::render(AtomicImage& img) {
     mis_eta_vm_ = algo == ALGO_BPT ? 0.0f : mis_pow(eta_vcm);
 
     if (algo != ALGO_PT)
-        trace_light_paths(img);
+        trace_light_paths(local_image_);
 
     if (algo != ALGO_LT)
-        trace_camera_paths(img);
+        trace_camera_paths(local_image_);
+
+    local_image_.merge(out);
 
     light_path_dbg_.end_frame(frame);
     techniques_dbg_.end_frame(frame);
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::trace_light_paths(AtomicImage& img) {
+void VCM_INTEGRATOR::trace_light_paths(ThreadLocalImage& img) {
     light_scheduler_.run_iteration(img,
-        [this] (RayQueue<VCMShadowState>& ray_in, AtomicImage& out) { process_shadow_rays_dbg(ray_in, out); },
-        [this] (RayQueue<VCMState>& ray_in, RayQueue<VCMShadowState>& ray_out_shadow, AtomicImage& out) {
+        [this] (RayQueue<VCMShadowState>& ray_in, ThreadLocalImage& out) { process_shadow_rays_dbg(ray_in, out); },
+        [this] (RayQueue<VCMState>& ray_in, RayStream<VCMShadowState>& ray_out_shadow, ThreadLocalImage& out) {
             process_light_rays(ray_in, ray_out_shadow, out);
         },
         [this] (int ray_id, int light_id, ::Ray& ray_out, VCMState& state_out) {
@@ -100,10 +103,10 @@ void VCM_INTEGRATOR::trace_light_paths(AtomicImage& img) {
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::trace_camera_paths(AtomicImage& img) {
+void VCM_INTEGRATOR::trace_camera_paths(ThreadLocalImage& img) {
     scheduler_.run_iteration(img,
-        [this] (RayQueue<VCMShadowState>& ray_in, AtomicImage& out) { process_shadow_rays_dbg(ray_in, out); },
-        [this] (RayQueue<VCMState>& ray_in, RayQueue<VCMShadowState>& ray_out_shadow, AtomicImage& out) {
+        [this] (RayQueue<VCMShadowState>& ray_in, ThreadLocalImage& out) { process_shadow_rays_dbg(ray_in, out); },
+        [this] (RayQueue<VCMState>& ray_in, RayStream<VCMShadowState>& ray_out_shadow, ThreadLocalImage& out) {
             process_camera_rays(ray_in, ray_out_shadow, out);
         },
         [this] (int x, int y, ::Ray& ray_out, VCMState& state_out) {
@@ -190,11 +193,7 @@ void VCM_INTEGRATOR::bounce(VCMState& state_out, const Intersection& isect, BSDF
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::process_light_rays(RayQueue<VCMState>& rays_in, RayQueue<VCMShadowState>& ray_out_shadow, AtomicImage& img) {
-    VCMState* states = rays_in.states();
-    const Hit* hits = rays_in.hits();
-    Ray* rays = rays_in.rays();
-
+void VCM_INTEGRATOR::process_light_rays(RayQueue<VCMState>& rays_in, RayStream<VCMShadowState>& ray_out_shadow, ThreadLocalImage& img) {
     const int hit_count = rays_in.compact_hits();
     rays_in.sort_by_material([this](const Hit& hit){
             const Mesh::Instance& inst = scene_.instance(hit.inst_id);
@@ -203,14 +202,14 @@ void VCM_INTEGRATOR::process_light_rays(RayQueue<VCMState>& rays_in, RayQueue<VC
             const int m = mesh.indices()[local_tri_id * 4 + 3];
             return m;
         },
-        scene_.material_count(), hit_count
-    );
+        scene_.material_count(), hit_count, hit_sort_key());
 
     // During light tracing, we ignore rays that do not intersect anything (no point in considering the environment map here)
     rays_in.shrink(hit_count);
 
     tbb::parallel_for(tbb::blocked_range<int>(0, rays_in.size()), [&] (const tbb::blocked_range<int>& range) {
         auto& bsdf_mem_arena = bsdf_memory_arenas.local();
+        RayBatch<VCMShadowState> shadow_batch(ray_out_shadow);
 
         for (auto i = range.begin(); i != range.end(); ++i) {
             bsdf_mem_arena.free_all();
@@ -232,12 +231,14 @@ void VCM_INTEGRATOR::process_light_rays(RayQueue<VCMState>& rays_in, RayQueue<VC
             state.dVC  *= 1.0f / mis_pow(cos_theta_o);
             state.dVM  *= 1.0f / mis_pow(cos_theta_o);
 
-            auto bsdf = isect.mat->get_bsdf(isect, bsdf_mem_arena, true);
+            const rgb color = isect.mat->surface_color(isect);
+            auto bsdf = isect.mat->get_bsdf(isect, color, bsdf_mem_arena, true);
 
             if (!isect.mat->is_specular()){ // Do not store vertices on materials described by a delta distribution.
                 if (algo != ALGO_LT) {
                     light_vertices_.add_vertex_to_cache(LightPathVertex(
                         isect,
+                        color,
                         state.throughput,
                         state.dVC,
                         state.dVCM,
@@ -246,7 +247,7 @@ void VCM_INTEGRATOR::process_light_rays(RayQueue<VCMState>& rays_in, RayQueue<VC
                 }
 
                 if (algo != ALGO_PPM)
-                    connect_to_camera(state, isect, bsdf, ray_out_shadow);
+                    connect_to_camera(state, isect, bsdf, shadow_batch);
             }
 
             const float offset = rays_in.hit(i).tmax * 1e-4f;
@@ -259,7 +260,7 @@ void VCM_INTEGRATOR::process_light_rays(RayQueue<VCMState>& rays_in, RayQueue<VC
 
 VCM_TEMPLATE
 void VCM_INTEGRATOR::connect_to_camera(const VCMState& light_state, const Intersection& isect,
-                                       const BSDF* bsdf, RayQueue<VCMShadowState>& ray_out_shadow) {
+                                       const BSDF* bsdf, RayBatch<VCMShadowState>& ray_out_shadow) {
     float3 dir_to_cam = cam_.pos() - isect.pos;
 
     if (dot(-dir_to_cam, cam_.dir()) < 0.0f)
@@ -320,11 +321,7 @@ void VCM_INTEGRATOR::connect_to_camera(const VCMState& light_state, const Inters
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::process_camera_rays(RayQueue<VCMState>& rays_in, RayQueue<VCMShadowState>& ray_out_shadow, AtomicImage& img) {
-    VCMState* states = rays_in.states();
-    const Hit* hits = rays_in.hits();
-    Ray* rays = rays_in.rays();
-
+void VCM_INTEGRATOR::process_camera_rays(RayQueue<VCMState>& rays_in, RayStream<VCMShadowState>& ray_out_shadow, ThreadLocalImage& img) {
     const int hit_count = rays_in.compact_hits();
     rays_in.sort_by_material([this](const Hit& hit){
             const Mesh::Instance& inst = scene_.instance(hit.inst_id);
@@ -333,7 +330,7 @@ void VCM_INTEGRATOR::process_camera_rays(RayQueue<VCMState>& rays_in, RayQueue<V
             const int m = mesh.indices()[local_tri_id * 4 + 3];
             return m;
         },
-        scene_.material_count(), hit_count);
+        scene_.material_count(), hit_count, hit_sort_key());
 
     // Process all rays that hit nothing, if there is an environment map.
     if (scene_.env_map() != nullptr) {
@@ -369,6 +366,7 @@ void VCM_INTEGRATOR::process_camera_rays(RayQueue<VCMState>& rays_in, RayQueue<V
 
     tbb::parallel_for(tbb::blocked_range<int>(0, rays_in.size()), [&] (const tbb::blocked_range<int>& range) {
         auto& bsdf_mem_arena = bsdf_memory_arenas.local();
+        RayBatch<VCMShadowState> shadow_batch(ray_out_shadow);
 
         for (auto i = range.begin(); i != range.end(); ++i) {
             bsdf_mem_arena.free_all();
@@ -414,7 +412,7 @@ void VCM_INTEGRATOR::process_camera_rays(RayQueue<VCMState>& rays_in, RayQueue<V
             // Compute direct illumination.
             if (state.path_length < settings_.max_path_len) {
                 if (algo != ALGO_PPM)
-                    direct_illum(state, isect, bsdf, ray_out_shadow);
+                    direct_illum(state, isect, bsdf, shadow_batch);
             } else {
                 terminate_path(state);
                 continue; // No point in continuing this path. It is too long already
@@ -422,7 +420,7 @@ void VCM_INTEGRATOR::process_camera_rays(RayQueue<VCMState>& rays_in, RayQueue<V
 
             // Connect to light path vertices.
             if (algo != ALGO_PT && algo != ALGO_PPM && !isect.mat->is_specular())
-                connect(state, isect, bsdf, bsdf_mem_arena, ray_out_shadow);
+                connect(state, isect, bsdf, bsdf_mem_arena, shadow_batch);
 
             if (algo != ALGO_BPT && algo != ALGO_PT) {
                 if (!isect.mat->is_specular())
@@ -439,7 +437,7 @@ void VCM_INTEGRATOR::process_camera_rays(RayQueue<VCMState>& rays_in, RayQueue<V
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::direct_illum(VCMState& cam_state, const Intersection& isect, BSDF* bsdf, RayQueue<VCMShadowState>& rays_out_shadow) {
+void VCM_INTEGRATOR::direct_illum(VCMState& cam_state, const Intersection& isect, BSDF* bsdf, RayBatch<VCMShadowState>& rays_out_shadow) {
     // Generate the shadow ray (sample one point on one lightsource)
     const auto& ls = scene_.light(cam_state.rng.random_int(0, scene_.light_count()));
     const float pdf_lightpick_inv = scene_.light_count();
@@ -486,12 +484,15 @@ void VCM_INTEGRATOR::direct_illum(VCMState& cam_state, const Intersection& isect
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::connect(VCMState& cam_state, const Intersection& isect, BSDF* bsdf_cam, MemoryArena& bsdf_arena, RayQueue<VCMShadowState>& rays_out_shadow) {
+void VCM_INTEGRATOR::connect(VCMState& cam_state, const Intersection& isect, BSDF* bsdf_cam, MemoryArena& bsdf_arena, RayBatch<VCMShadowState>& rays_out_shadow) {
     // PDF conversion factor from using the vertex cache.
     // Vertex Cache is equivalent to randomly sampling a path with pdf ~ path length and uniformly sampling a vertex on this path.
     const float vc_weight = light_vertices_.count() / (float(settings_.light_path_count) * float(settings_.num_connections));
 
     // Connect to num_connections randomly chosen vertices from the cache.
+    // They are chosen first, and sorted by material, so that the connections to the same material are evaluated together.
+    auto light_vertices = V_ARRAY(const LightPathVertex*, settings_.num_connections);
+    int count = 0;
     for (int i = 0; i < settings_.num_connections; ++i) {
         const auto& light_vertex = light_vertices_.get_connect(cam_state.rng);
 
@@ -499,10 +500,22 @@ void VCM_INTEGRATOR::connect(VCMState& cam_state, const Intersection& isect, BSD
         if (light_vertex.path_length + cam_state.path_length > settings_.max_path_len)
             continue;
 
-        const auto light_bsdf = light_vertex.isect.mat->get_bsdf(light_vertex.isect, bsdf_arena, true);
+        int j = count++;
+        for (; j > 0 && light_vertices[j - 1]->mat_id > light_vertex.mat_id; j--)
+            light_vertices[j] = light_vertices[j - 1];
+        light_vertices[j] = &light_vertex;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        const auto& light_vertex = *light_vertices[i];
+
+        // The BSDF refers to the intersection, which must live until the end of the iteration.
+        // It is built with the color stored in the vertex, without sampling the textures.
+        const auto light_isect = light_vertex.intersection(scene_);
+        const auto light_bsdf = light_isect.mat->get_bsdf(light_isect, light_vertex.color, bsdf_arena, true);
 
         // Compute connection direction and distance.
-        float3 connect_dir = light_vertex.isect.pos - isect.pos;
+        float3 connect_dir = light_isect.pos - isect.pos;
         const float connect_dist_sq = lensqr(connect_dir);
         const float connect_dist = std::sqrt(connect_dist_sq);
         connect_dir *= 1.0f / connect_dist;
@@ -520,9 +533,9 @@ void VCM_INTEGRATOR::connect(VCMState& cam_state, const Intersection& isect, BSD
         const float pdf_rev_cam_w = bsdf_cam->pdf(connect_dir, isect.out_dir);
 
         // Evaluate the bsdf at the light vertex.
-        const auto bsdf_value_light = light_bsdf->eval(light_vertex.isect.out_dir, -connect_dir, BSDF_ALL);
-        const float pdf_dir_light_w = light_bsdf->pdf(light_vertex.isect.out_dir, -connect_dir);
-        const float pdf_rev_light_w = light_bsdf->pdf(-connect_dir, light_vertex.isect.out_dir);
+        const auto bsdf_value_light = light_bsdf->eval(light_isect.out_dir, -connect_dir, BSDF_ALL);
+        const float pdf_dir_light_w = light_bsdf->pdf(light_isect.out_dir, -connect_dir);
+        const float pdf_rev_light_w = light_bsdf->pdf(-connect_dir, light_isect.out_dir);
 
         if (pdf_dir_cam_w == 0.0f || pdf_dir_light_w == 0.0f ||
             pdf_rev_cam_w == 0.0f || pdf_rev_light_w == 0.0f)
@@ -530,8 +543,8 @@ void VCM_INTEGRATOR::connect(VCMState& cam_state, const Intersection& isect, BSD
 
         // Compute the cosine terms. We need to use the adjoint for the light vertex BSDF.
         const float cos_theta_cam   = fabsf(dot(isect.normal, connect_dir));
-        const float cos_theta_light = fabsf(shading_normal_adjoint(light_vertex.isect.normal, light_vertex.isect.geom_normal,
-                                                                   light_vertex.isect.out_dir, -connect_dir));
+        const float cos_theta_light = fabsf(shading_normal_adjoint(light_isect.normal, light_isect.geom_normal,
+                                                                   light_isect.out_dir, -connect_dir));
 
         const float geom_term = cos_theta_cam * cos_theta_light / connect_dist_sq;
         if (geom_term <= 0.0f)
@@ -542,7 +555,7 @@ void VCM_INTEGRATOR::connect(VCMState& cam_state, const Intersection& isect, BSD
         const float pdf_light_a = pdf_dir_light_w * cos_theta_cam / connect_dist_sq;
 
         // Compute the full MIS weight from the partial weights and pdfs.
-        const float mis_weight_light = mis_pow(pdf_cam_a) * (mis_eta_vm_ + light_vertex.dVCM + light_vertex.dVC * mis_pow(pdf_rev_light_w));
+        const float mis_weight_light = mis_pow(pdf_cam_a) * (mis_eta_vm_ + light_vertex.dVCM() + light_vertex.dVC() * mis_pow(pdf_rev_light_w));
         const float mis_weight_camera = mis_pow(pdf_light_a) * (mis_eta_vm_ + cam_state.dVCM + cam_state.dVC * mis_pow(pdf_rev_cam_w));
 
         const float mis_weight = 1.0f / (mis_weight_camera + 1.0f + mis_weight_light);
@@ -569,39 +582,47 @@ void VCM_INTEGRATOR::connect(VCMState& cam_state, const Intersection& isect, BSD
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::vertex_merging(const VCMState& state, const Intersection& isect, const BSDF* bsdf, AtomicImage& img) {
+void VCM_INTEGRATOR::vertex_merging(const VCMState& state, const Intersection& isect, const BSDF* bsdf, ThreadLocalImage& img) {
     const int k = settings_.num_knn;
-    auto photons = V_ARRAY(const VCMPhoton*, k);
-    int count = light_vertices_.get_merge(isect.pos, photons, k);
-    const float radius_sqr = (count == k) ? lensqr(photons[k - 1]->position - isect.pos) : (pm_radius_ * pm_radius_);
+    float radius_sqr = pm_radius_ * pm_radius_;
 
     rgb contrib(0.0f);
-    for (int i = 0; i < count; ++i) {
-        auto p = photons[i];
-        const auto& photon_in_dir = p->out_dir;
+    auto merge = [&] (const LightPathVertex& p, float d) {
+        const auto photon_in_dir = p.out_dir();
 
         const auto& bsdf_value = bsdf->eval(isect.out_dir, photon_in_dir);
         const float pdf_dir_w = bsdf->pdf(isect.out_dir, photon_in_dir);
         const float pdf_rev_w = bsdf->pdf(photon_in_dir, isect.out_dir);
 
         if (pdf_dir_w == 0.0f || pdf_rev_w == 0.0f || is_black(bsdf_value))
-            continue;
+            return;
 
         // Compute MIS weight.
-        const float mis_weight_light = p->dVCM * mis_eta_vc_ + p->dVM * mis_pow(pdf_dir_w);
+        const float mis_weight_light = p.dVCM() * mis_eta_vc_ + p.dVM() * mis_pow(pdf_dir_w);
         const float mis_weight_camera = state.dVCM * mis_eta_vc_ + state.dVM * mis_pow(pdf_rev_w);
 
         const float mis_weight = algo == ALGO_PPM ? 1.0f : (1.0f / (mis_weight_light + 1.0f + mis_weight_camera));
 
         // Epanechnikov filter
-        const float d = lensqr(p->position - isect.pos);
         const float kernel = 1.0f - d / radius_sqr;
 
-        contrib += mis_weight * bsdf_value * kernel * p->throughput;
+        contrib += mis_weight * bsdf_value * kernel * p.throughput;
 
         techniques_dbg_.record(merging, mis_weight,
-                               state.throughput * bsdf_value * kernel * p->throughput * 2.0f / (pi * radius_sqr * settings_.light_path_count),
+                               state.throughput * bsdf_value * kernel * p.throughput * 2.0f / (pi * radius_sqr * settings_.light_path_count),
                                state.pixel_id, state.sample_id);
+    };
+
+    if (k == 0) {
+        // All the photons within the radius are used, there is no need to sort them.
+        light_vertices_.for_each_merge(isect.pos, merge);
+    } else {
+        auto photons = V_ARRAY(const LightPathVertex*, k);
+        int count = light_vertices_.get_merge(isect.pos, photons, k);
+        if (count == k) radius_sqr = lensqr(photons[k - 1]->position() - isect.pos);
+
+        for (int i = 0; i < count; ++i)
+            merge(*photons[i], lensqr(photons[i]->position() - isect.pos));
     }
 
     // Complete the Epanechnikov kernel
@@ -611,7 +632,7 @@ void VCM_INTEGRATOR::vertex_merging(const VCMState& state, const Intersection& i
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::process_shadow_rays_dbg(RayQueue<VCMShadowState>& ray_in, AtomicImage& out) {
+void VCM_INTEGRATOR::process_shadow_rays_dbg(RayQueue<VCMShadowState>& ray_in, ThreadLocalImage& out) {
     VCMShadowState* states = ray_in.states();
     Hit* hits = ray_in.hits();
 
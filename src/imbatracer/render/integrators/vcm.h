@@ -58,11 +58,13 @@ public:
         , settings_(settings)
         , cur_iteration_(0)
         , scheduler_(scheduler)
-        , light_vertices_(settings.light_path_count)
-        , light_tile_gen_(scene.light_count(), settings.light_path_count, settings.tile_size * settings.tile_size)
-        , light_scheduler_(light_tile_gen_, scene, 1, settings.thread_count, settings.tile_size * settings.tile_size * 1.75f,
-                           settings.traversal_platform == UserSettings::gpu) // TODO: make threshold explicit in TileGen
+        , light_tile_gen_(scene.light_count(), settings.light_path_count, settings.tile_size * settings.tile_size, settings.thread_count)
+        , light_scheduler_(light_tile_gen_, scene, settings.thread_count, settings.tile_size * settings.tile_size * 1.75f,
+                           settings.traversal_platform == UserSettings::gpu, // TODO: make threshold explicit in TileGen
+                           settings.worker_count, settings.pin_threads)
     {
+        light_scheduler_.set_reordering(settings.reorder_min_size);
+        light_scheduler_.set_pipelining(settings.pipeline);
     }
 
     virtual void render(AtomicImage& out) override;
@@ -75,9 +77,11 @@ public:
         Integrator::preprocess();
 
         base_radius_ = pixel_size() * settings_.radius_factor;
+    }
 
+    virtual void print_stats() const override {
         if (algo != ALGO_LT && algo != ALGO_PT)
-            light_vertices_.compute_cache_size(scene_, scheduler_.gpu_traversal);
+            light_vertices_.print_stats();
     }
 
 private:
@@ -124,21 +128,21 @@ private:
         return dot(out_dir, normal) * dot(in_dir, geom_normal) / dot(out_dir, geom_normal);
     }
 
-    void process_light_rays(RayQueue<VCMState>& rays_in, RayQueue<VCMShadowState>& rays_out_shadow, AtomicImage& img);
-    void process_camera_rays(RayQueue<VCMState>& rays_in, RayQueue<VCMShadowState>& shadow_rays, AtomicImage& img);
+    void process_light_rays(RayQueue<VCMState>& rays_in, RayStream<VCMShadowState>& rays_out_shadow, ThreadLocalImage& img);
+    void process_camera_rays(RayQueue<VCMState>& rays_in, RayStream<VCMShadowState>& shadow_rays, ThreadLocalImage& img);
 
-    void trace_light_paths(AtomicImage& img);
-    void trace_camera_paths(AtomicImage& img);
+    void trace_light_paths(ThreadLocalImage& img);
+    void trace_camera_paths(ThreadLocalImage& img);
 
-    void connect_to_camera(const VCMState& light_state, const Intersection& isect, const BSDF* bsdf, RayQueue<VCMShadowState>& rays_out_shadow);
+    void connect_to_camera(const VCMState& light_state, const Intersection& isect, const BSDF* bsdf, RayBatch<VCMShadowState>& rays_out_shadow);
 
-    void direct_illum(VCMState& cam_state, const Intersection& isect, BSDF* bsdf, RayQueue<VCMShadowState>& rays_out_shadow);
-    void connect(VCMState& cam_state, const Intersection& isect, BSDF* bsdf, MemoryArena& bsdf_arena, RayQueue<VCMShadowState>& rays_out_shadow);
-    void vertex_merging(const VCMState& state, const Intersection& isect, const BSDF* bsdf, AtomicImage& img);
+    void direct_illum(VCMState& cam_state, const Intersection& isect, BSDF* bsdf, RayBatch<VCMShadowState>& rays_out_shadow);
+    void connect(VCMState& cam_state, const Intersection& isect, BSDF* bsdf, MemoryArena& bsdf_arena, RayBatch<VCMShadowState>& rays_out_shadow);
+    void vertex_merging(const VCMState& state, const Intersection& isect, const BSDF* bsdf, ThreadLocalImage& img);
 
     void bounce(VCMState& state, const Intersection& isect, BSDF* bsdf, Ray& rays_out, bool adjoint, float offset);
 
-    void process_shadow_rays_dbg(RayQueue<VCMShadowState>& ray_in, AtomicImage& out);
+    void process_shadow_rays_dbg(RayQueue<VCMShadowState>& ray_in, ThreadLocalImage& out);
 };
 
 using VCM    = VCMIntegrator<ALGO_VCM>;
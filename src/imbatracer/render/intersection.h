@@ -17,6 +17,7 @@ struct Intersection {
     float3 v_tangent;
 
     Material* mat;
+    int mat_id; ///< Index of the material in the scene
 };
 
 } // namespace imba
@@ -20,7 +20,17 @@ public:
     // Duplicates the material
     virtual Material* duplicate() const = 0;
 
-    virtual BSDF* get_bsdf(const Intersection& isect, MemoryArena& mem_arena, bool adjoint = false) const = 0;
+    /// Builds the BSDF at the given intersection.
+    BSDF* get_bsdf(const Intersection& isect, MemoryArena& mem_arena, bool adjoint = false) const {
+        return get_bsdf(isect, surface_color(isect), mem_arena, adjoint);
+    }
+
+    /// Builds the BSDF at the given intersection, with a color previously returned by surface_color().
+    virtual BSDF* get_bsdf(const Intersection& isect, const rgb& color, MemoryArena& mem_arena, bool adjoint = false) const = 0;
+
+    /// Returns the parameter of the BSDF that varies over the surface, read from a texture if there is one.
+    /// It can be stored with the intersection, so that the BSDF is rebuilt later without sampling the texture.
+    virtual rgb surface_color(const Intersection&) const { return rgb(1.0f); }
 
     /// Associates the material with a light source.
     void set_emitter(const AreaEmitter* e) { emit_.reset(e); }
@@ -73,15 +83,15 @@ public:
             return new DiffuseMaterial(color_, bump_);
     };
 
-    BSDF* get_bsdf(const Intersection& isect, MemoryArena& mem_arena, bool adjoint) const override {
-        rgb color = color_;
-        if (sampler_)
-            color = sampler_->sample(isect.uv);
-
+    BSDF* get_bsdf(const Intersection& isect, const rgb& color, MemoryArena& mem_arena, bool adjoint) const override {
         auto brdf = mem_arena.alloc<Lambertian>(color);
         return mem_arena.alloc<BSDF>(isect, brdf, nullptr);
     }
 
+    rgb surface_color(const Intersection& isect) const override {
+        return sampler_ ? sampler_->sample(isect.uv) : color_;
+    }
+
 private:
     rgb color_;
     const TextureSampler* sampler_;
@@ -101,7 +111,7 @@ public:
         return new MirrorMaterial(*this);
     };
 
-    BSDF* get_bsdf(const Intersection& isect, MemoryArena& mem_arena, bool adjoint) const override {
+    BSDF* get_bsdf(const Intersection& isect, const rgb&, MemoryArena& mem_arena, bool adjoint) const override {
         auto brdf = mem_arena.alloc<SpecularReflection>(scale_, fresnel_);
         return mem_arena.alloc<BSDF>(isect, brdf, nullptr);
     }
@@ -127,7 +137,7 @@ public:
         return new GlassMaterial(*this);
     };
 
-    BSDF* get_bsdf(const Intersection& isect, MemoryArena& mem_arena, bool adjoint) const override {
+    BSDF* get_bsdf(const Intersection& isect, const rgb&, MemoryArena& mem_arena, bool adjoint) const override {
         auto brdf = mem_arena.alloc<SpecularReflection>(reflectance_, fresnel_);
 
         BxDF* btdf;
@@ -167,11 +177,7 @@ public:
         return new GlossyMaterial(*this);
     };
 
-    BSDF* get_bsdf(const Intersection& isect, MemoryArena& mem_arena, bool adjoint) const override {
-        rgb diff_color = diffuse_color_;
-        if (diff_sampler_)
-            diff_color = diff_sampler_->sample(isect.uv);
-
+    BSDF* get_bsdf(const Intersection& isect, const rgb& diff_color, MemoryArena& mem_arena, bool adjoint) const override {
         auto fresnel = mem_arena.alloc<FresnelConductor>(1.0f, exponent_);
         auto spec_brdf = mem_arena.alloc<CookTorrance>(specular_color_, fresnel, exponent_);
         auto diff_brdf = mem_arena.alloc<Lambertian>(diff_color);
@@ -181,6 +187,10 @@ public:
         return mem_arena.alloc<BSDF>(isect, brdf, nullptr);
     }
 
+    rgb surface_color(const Intersection& isect) const override {
+        return diff_sampler_ ? diff_sampler_->sample(isect.uv) : diffuse_color_;
+    }
+
 private:
     float exponent_;
     rgb specular_color_;
@@ -3,10 +3,8 @@
 
 #include "imbatracer/render/ray_gen/ray_gen.h"
 
-#include <numeric>
-
-// Macro for empty loop bodies to suppress compiler warnings
-#define NO_OP ((void)0)
+#include <algorithm>
+#include <vector>
 
 namespace imba {
 
@@ -31,35 +29,64 @@ public:
     virtual size_t sizeof_ray_gen() const = 0;
     /// Restarts the frame.
     virtual void start_frame() = 0;
+
+protected:
+    /// Repeatedly subdivides the last tiles of the given list, so that the amount of work per tile decreases towards
+    /// the end of the frame. In every round, the last tail_count tiles are replaced by the result of the split function.
+    /// Stops once none of those tiles can be split any further.
+    template <typename Tile, typename SplitFn>
+    static void split_tail(std::vector<Tile>& tiles, int tail_count, SplitFn split) {
+        std::vector<Tile> tail;
+        while (true) {
+            const int count = static_cast<int>(tiles.size());
+            const int first = std::max(0, count - tail_count);
+
+            bool any_split = false;
+            tail.clear();
+            for (int i = first; i < count; ++i) {
+                if (split(tiles[i], tail))
+                    any_split = true;
+                else
+                    tail.push_back(tiles[i]);
+            }
+
+            if (!any_split)
+                break;
+
+            tiles.erase(tiles.begin() + first, tiles.end());
+            tiles.insert(tiles.end(), tail.begin(), tail.end());
+        }
+    }
 };
 
 /// Generates quadratic tiles of a fixed size.
+/// Towards the end of the frame, the tiles are subdivided so that all threads finish at roughly the same time.
 template<typename StateType>
 class DefaultTileGen : public TileGen<StateType> {
     using typename TileGen<StateType>::TilePtr;
 
+    static constexpr int MIN_TILE_SIZE = 16;
+
 public:
-    DefaultTileGen(int w, int h, int spp, int tilesize)
+    /// Initializes the tile generator
+    ///
+    /// \param worker_count Number of threads that request tiles concurrently, used to decide how many tiles are subdivided.
+    DefaultTileGen(int w, int h, int spp, int tilesize, int worker_count = 1)
         : tile_size_(tilesize), spp_(spp), width_(w), height_(h)
     {
         // Compute the number of tiles required to cover the entire image.
-        tiles_per_row_ = width_ / tile_size_ + (width_ % tile_size_ == 0 ? 0 : 1);
-        tiles_per_col_ = height_ / tile_size_ + (height_ % tile_size_ == 0 ? 0 : 1);
-        tile_count_ = tiles_per_row_ * tiles_per_col_;
-    }
-
-    TilePtr next_tile(uint8_t* mem) override final {
-        int tile_id;
+        const int tiles_per_row = width_ / tile_size_ + (width_ % tile_size_ == 0 ? 0 : 1);
+        const int tiles_per_col = height_ / tile_size_ + (height_ % tile_size_ == 0 ? 0 : 1);
 
-        while ((tile_id = cur_tile_++) < tile_count_) {
-            // Get the next tile and compute its extents
-            int tile_pos_x  = (tile_id % tiles_per_row_) * tile_size_;
-            int tile_pos_y  = (tile_id / tiles_per_row_) * tile_size_;
+        for (int tile_id = 0; tile_id < tiles_per_row * tiles_per_col; ++tile_id) {
+            // Compute the extents of the tile
+            int tile_pos_x  = (tile_id % tiles_per_row) * tile_size_;
+            int tile_pos_y  = (tile_id / tiles_per_row) * tile_size_;
             int tile_width  = std::min(width_ - tile_pos_x, tile_size_);
             int tile_height = std::min(height_ - tile_pos_y, tile_size_);
 
-            // If the next tile is smaller than half the size, acquire it as well.
-            // If this tile is smaller than half the size, skip it (was acquired by one of its neighbours)
+            // If the next tile is smaller than half the size, merge it into this one.
+            // If this tile is smaller than half the size, skip it (was merged into one of its neighbours)
             if (tile_width < tile_size_ / 2 ||
                 tile_height < tile_size_ / 2)
                 continue;
@@ -70,10 +97,31 @@ public:
             if (height_ - (tile_pos_y + tile_height) < tile_size_ / 2)
                 tile_height += height_ - (tile_pos_y + tile_height);
 
-            return TilePtr(new (mem) TiledRayGen<StateType>(tile_pos_x, tile_pos_y, tile_width, tile_height, spp_, width_, height_));
+            tiles_.emplace_back(tile_pos_x, tile_pos_y, tile_width, tile_height);
         }
 
-        return nullptr;
+        // Split the last tiles into quarters until they reach the minimum size.
+        this->split_tail(tiles_, 2 * worker_count, [] (const Tile& t, std::vector<Tile>& out) {
+            if (t.width < 2 * MIN_TILE_SIZE || t.height < 2 * MIN_TILE_SIZE)
+                return false;
+
+            const int w = t.width / 2;
+            const int h = t.height / 2;
+            out.emplace_back(t.x,     t.y,     w,           h);
+            out.emplace_back(t.x + w, t.y,     t.width - w, h);
+            out.emplace_back(t.x,     t.y + h, w,           t.height - h);
+            out.emplace_back(t.x + w, t.y + h, t.width - w, t.height - h);
+            return true;
+        });
+    }
+
+    TilePtr next_tile(uint8_t* mem) override final {
+        int tile_id = cur_tile_++;
+        if (tile_id >= static_cast<int>(tiles_.size()))
+            return nullptr;
+
+        const Tile& t = tiles_[tile_id];
+        return TilePtr(new (mem) TiledRayGen<StateType>(t.x, t.y, t.width, t.height, spp_, width_, height_));
     }
 
     size_t sizeof_ray_gen() const override final {
@@ -85,13 +133,17 @@ public:
     }
 
 private:
+    struct Tile {
+        int x, y;
+        int width, height;
+
+        Tile(int x, int y, int w, int h) : x(x), y(y), width(w), height(h) {}
+    };
+
     int tile_size_;
     int spp_, width_, height_;
 
-    int tiles_per_row_;
-    int tiles_per_col_;
-    int tile_count_;
-
+    std::vector<Tile> tiles_;
     std::atomic<int> cur_tile_;
 };
 
@@ -108,12 +160,12 @@ public:
     /// \param light_count      Number of light sources in the scene
     /// \param path_count       Total number of light paths for all lights combined
     /// \param desired_per_tile Target number of rays per tile, might generate slightly more or less (due to rounding)
-    UniformLightTileGen(int light_count, int path_count, int desired_per_tile)
+    /// \param worker_count     Number of threads that request tiles concurrently, used to decide how many tiles are subdivided
+    UniformLightTileGen(int light_count, int path_count, int desired_per_tile, int worker_count = 1)
         : light_count_(light_count)
         , path_count_(path_count)
         , desired_per_tile_(desired_per_tile)
         , rays_per_light_(light_count, path_count / light_count)
-        , cumul_tiles_per_light_(light_count)
         , tile_threshold_(desired_per_tile / 2)
     {
         assert(light_count > 0);
@@ -124,37 +176,41 @@ public:
         // To still generate exactly path_count paths, we assign the leftovers to the first light
         rays_per_light_[0] += path_count % light_count;
 
-        // Compute the number of tiles for every light source
+        // Compute the tiles for every light source
         for (int i = 0; i < light_count; ++i) {
-            cumul_tiles_per_light_[i] = rays_per_light_[i] / desired_per_tile;
-            if ((rays_per_light_[i] % desired_per_tile) > tile_threshold_ || cumul_tiles_per_light_[i] == 0) {
+            int tile_count = rays_per_light_[i] / desired_per_tile;
+            if ((rays_per_light_[i] % desired_per_tile) > tile_threshold_ || tile_count == 0) {
                 // Only add another tile for the remainder if it is big enough or there is no tile yet
-                cumul_tiles_per_light_[i]++;
+                tile_count++;
             }
+
+            // The last tile for this light gets all remaining rays
+            for (int j = 0; j < tile_count - 1; ++j)
+                tiles_.emplace_back(i, desired_per_tile);
+            tiles_.emplace_back(i, rays_per_light_[i] - (tile_count - 1) * desired_per_tile);
         }
 
-        std::partial_sum(cumul_tiles_per_light_.begin(), cumul_tiles_per_light_.end(), cumul_tiles_per_light_.begin());
+        // Split the last tiles into quarters until they reach the minimum size.
+        const int min_per_tile = std::max(1, desired_per_tile / MIN_TILE_FRACTION);
+        this->split_tail(tiles_, 2 * worker_count, [min_per_tile] (const Tile& t, std::vector<Tile>& out) {
+            if (t.ray_count < 4 * min_per_tile)
+                return false;
+
+            const int count = t.ray_count / 4;
+            for (int i = 0; i < 3; ++i)
+                out.emplace_back(t.light, count);
+            out.emplace_back(t.light, t.ray_count - 3 * count);
+            return true;
+        });
     }
 
     TilePtr next_tile(uint8_t* mem) override final {
         int tile_id = cur_tile_++;
-
-        // Compute the light that this tile belongs to
-        if (tile_id >= cumul_tiles_per_light_.back())
+        if (tile_id >= static_cast<int>(tiles_.size()))
             return nullptr;
 
-        int light;
-        for (light = 0; cumul_tiles_per_light_[light] <= tile_id ; ++light)
-            NO_OP;
-
-        int ray_count = desired_per_tile_;
-        if (tile_id == cumul_tiles_per_light_[light] - 1) {
-            // If this is the last tile for this light, assign all remaining rays to it
-            int tiles = tile_id - (light == 0 ? 0 : cumul_tiles_per_light_[light - 1]);
-            ray_count = rays_per_light_[light] - tiles * desired_per_tile_;
-        }
-
-        return TilePtr(new (mem) LightRayGen<StateType>(light, ray_count));
+        const Tile& t = tiles_[tile_id];
+        return TilePtr(new (mem) LightRayGen<StateType>(t.light, t.ray_count));
     }
 
     size_t sizeof_ray_gen() const override final {
@@ -166,13 +222,23 @@ public:
     }
 
 private:
+    // The smallest tiles have this fraction of the desired number of rays per tile.
+    static constexpr int MIN_TILE_FRACTION = 16;
+
+    struct Tile {
+        int light;
+        int ray_count;
+
+        Tile(int l, int c) : light(l), ray_count(c) {}
+    };
+
     int light_count_;
     int path_count_;
     int desired_per_tile_;
     int tile_threshold_;
 
     std::vector<int> rays_per_light_;
-    std::vector<int> cumul_tiles_per_light_;
+    std::vector<Tile> tiles_;
     std::atomic<int> cur_tile_;
 };
 
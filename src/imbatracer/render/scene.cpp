@@ -1,4 +1,10 @@
 #include <cassert>
+#include <cstdio>
+#include <mutex>
+#include <unordered_set>
+
+#define NOMINMAX
+#include <tbb/tbb.h>
 
 #include "imbatracer/render/scene.h"
 #include "imbatracer/core/adapter.h"
@@ -16,8 +22,8 @@ void Scene::setup_traversal_buffers(BuildAccelData<Node>& build_data, TraversalD
     if (traversal_data.tris.size() < build_data.tris.size()) {
         traversal_data.tris = std::move(anydsl::Array<Vec4>(plat, anydsl::Device(0), build_data.tris.size()));
     }
-    if (traversal_data.instances.size() < instance_nodes_.size()) {
-        traversal_data.instances = std::move(anydsl::Array<InstanceNode>(plat, anydsl::Device(0), instance_nodes_.size()));
+    if (traversal_data.instances.size() < build_data.instance_nodes.size()) {
+        traversal_data.instances = std::move(anydsl::Array<InstanceNode>(plat, anydsl::Device(0), build_data.instance_nodes.size()));
     }
     if (traversal_data.indices.size() < index_buf_.size()) {
         traversal_data.indices = anydsl::Array<int>(plat, anydsl::Device(0), index_buf_.size());
@@ -28,46 +34,135 @@ void Scene::setup_traversal_buffers(BuildAccelData<Node>& build_data, TraversalD
 }
 
 void Scene::setup_traversal_buffers() {
-    if (cpu_buffers_)
-        setup_traversal_buffers(build_cpu_, traversal_cpu_, anydsl::Platform::Host);
+    if (cpu_buffers_) {
+        if      (cpu_layout_ == CpuNodeLayout::MBVH8)  setup_traversal_buffers(build_cpu8_,  traversal_cpu8_,  anydsl::Platform::Host);
+        else if (cpu_layout_ == CpuNodeLayout::QMBVH4) setup_traversal_buffers(build_cpu4q_, traversal_cpu4q_, anydsl::Platform::Host);
+        else                                           setup_traversal_buffers(build_cpu_,   traversal_cpu_,   anydsl::Platform::Host);
+    }
     if (gpu_buffers_)
         setup_traversal_buffers(build_gpu_, traversal_gpu_, anydsl::Platform::Cuda);
 }
 
-template <typename Node, typename NewAdapterFn, typename LoadAccelFn, typename StoreAccelFn>
+template <typename Node, typename NewAdapterFn, typename LoadAccelFn, typename StoreAccelFn, typename RelocateAccelFn>
 void Scene::build_mesh_accels(BuildAccelData<Node>& build_data,
                               const std::vector<std::string>& accel_filenames,
+                              const std::string& builder_desc,
                               NewAdapterFn new_adapter,
                               LoadAccelFn load_accel,
-                              StoreAccelFn store_accel) {
-    build_data.layout.clear();
-    build_data.nodes.clear();
-    build_data.tris.clear();
+                              StoreAccelFn store_accel,
+                              RelocateAccelFn relocate_accel) {
+    // Every mesh is loaded or built concurrently into its own buffers.
+    struct MeshAccel {
+        std::vector<Node> nodes;
+        std::vector<Vec4> tris;
+    };
+    std::vector<MeshAccel> accels(meshes_.size());
+    std::mutex out_mutex;
+
+    // Meshes without an explicit file use the cache, where files are named after the mesh data.
+    // The result of the optimizer only depends on its budget, which is thus part of the description.
+    const std::string cache_desc = bvh_optimization_budget_ > 0.0f
+        ? builder_desc + " optimization=" + std::to_string(bvh_optimization_budget_)
+        : builder_desc;
+    std::vector<std::string> filenames(accel_filenames);
+    std::vector<char> cached(meshes_.size(), false);
+    tbb::parallel_for(tbb::blocked_range<int>(0, meshes_.size(), 1), [&] (const tbb::blocked_range<int>& range) {
+        for (int mesh_id = range.begin(); mesh_id != range.end(); mesh_id++) {
+            cached[mesh_id] = filenames[mesh_id] == "" && accel_cache_;
+            if (cached[mesh_id])
+                filenames[mesh_id] = accel_cache_->filename(meshes_[mesh_id], cache_desc);
+        }
+    });
+
+    // Identical meshes share the same file, which is only written by the first of them.
+    // The others load it once it has been written, with their own triangle ids.
+    std::vector<int> first_meshes, other_meshes;
+    {
+        std::unordered_set<std::string> seen;
+        for (int mesh_id = 0, n = meshes_.size(); mesh_id < n; mesh_id++) {
+            if (filenames[mesh_id] == "" || seen.insert(filenames[mesh_id]).second)
+                first_meshes.push_back(mesh_id);
+            else
+                other_meshes.push_back(mesh_id);
+        }
+    }
 
-    // Add the nodes for all meshes. Assumes that the adapter appends nodes to the array.
-    auto adapter = new_adapter(build_data.nodes, build_data.tris);
-    for (int mesh_id = 0; mesh_id < meshes_.size(); mesh_id++) {
-        auto& mesh = meshes_[mesh_id];
+    auto load_or_build = [&] (int mesh_id, bool may_store) {
+        auto& accel = accels[mesh_id];
+        const auto& filename = filenames[mesh_id];
 
-        build_data.layout.push_back(build_data.nodes.size());
-        auto tris_offset = build_data.tris.size();
-        auto& filename = accel_filenames[mesh_id];
+        // Files written or already loaded by the cache are not checked again.
+        const bool verify = !cached[mesh_id] || !accel_cache_->verified(filename);
+        if (filename != "" && load_accel(filename, accel.nodes, accel.tris, tri_layout_[mesh_id], verify)) {
+            if (cached[mesh_id]) accel_cache_->touch(filename);
+            return;
+        }
 
-        if (filename != "" && load_accel(filename, build_data.nodes, build_data.tris, tri_layout_[mesh_id]))
-            continue;
+        {
+            std::lock_guard<std::mutex> lock(out_mutex);
+            std::cout << "Rebuilding the acceleration structure for mesh " << mesh_id << "..." << std::endl;
+        }
 
-        std::cout << "Rebuilding the acceleration structure for mesh " << mesh_id << "..." << std::flush;
-        adapter->build_accel(mesh, mesh_id, tri_layout_);
-        std::cout << std::endl;
+        auto adapter = new_adapter(accel.nodes, accel.tris, fast_mesh_accels_);
+        adapter->set_optimization_budget(bvh_optimization_budget_);
+        adapter->build_accel(meshes_[mesh_id], mesh_id, tri_layout_);
 
+        // A cached file that could not be loaded is corrupted, or was written by another version.
+        if (cached[mesh_id] && may_store)
+            std::remove(filename.c_str());
+
+        // Acceleration structures built with the fast builder are only worth storing in the cache.
+        const bool store = may_store && filename != "" && (cached[mesh_id] || !fast_mesh_accels_);
+        const bool stored = store && store_accel(filename, accel.nodes, 0, accel.tris, 0, tri_layout_[mesh_id]);
+        if (stored && cached[mesh_id])
+            accel_cache_->touch(filename);
+
+        std::lock_guard<std::mutex> lock(out_mutex);
 #ifdef STATISTICS
         adapter->print_stats();
 #endif
 
-        if (filename != "" && !store_accel(filename, build_data.nodes, build_data.layout.back(), build_data.tris, tris_offset, tri_layout_[mesh_id]))
+        if (store && !stored)
             std::cout << "The acceleration structure for mesh " << mesh_id << " could not be stored." << std::endl;
+    };
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, first_meshes.size(), 1), [&] (const tbb::blocked_range<size_t>& range) {
+        for (auto i = range.begin(); i != range.end(); i++) load_or_build(first_meshes[i], true);
+    });
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, other_meshes.size(), 1), [&] (const tbb::blocked_range<size_t>& range) {
+        for (auto i = range.begin(); i != range.end(); i++) load_or_build(other_meshes[i], false);
+    });
+
+    if (accel_cache_)
+        accel_cache_->evict();
+
+    // Concatenate the acceleration structures, and offset the indices of the nodes and triangles they refer to.
+    build_data.layout.clear();
+    std::vector<int> tris_layout;
+    int node_count = 0, tris_count = 0;
+    for (auto& accel : accels) {
+        build_data.layout.push_back(node_count);
+        tris_layout.push_back(tris_count);
+        node_count += accel.nodes.size();
+        tris_count += accel.tris.size();
     }
 
+    build_data.nodes.resize(node_count);
+    build_data.tris.resize(tris_count);
+    tbb::parallel_for(tbb::blocked_range<int>(0, meshes_.size(), 1), [&] (const tbb::blocked_range<int>& range) {
+        for (int mesh_id = range.begin(); mesh_id != range.end(); mesh_id++) {
+            auto& accel = accels[mesh_id];
+            Node* nodes = build_data.nodes.data() + build_data.layout[mesh_id];
+            std::copy(accel.nodes.begin(), accel.nodes.end(), nodes);
+            std::copy(accel.tris.begin(), accel.tris.end(), build_data.tris.begin() + tris_layout[mesh_id]);
+            relocate_accel(nodes, accel.nodes.size(), build_data.layout[mesh_id], tris_layout[mesh_id]);
+
+            // Release the memory early
+            std::vector<Node>().swap(accel.nodes);
+            std::vector<Vec4>().swap(accel.tris);
+        }
+    });
+
     build_data.node_count = build_data.nodes.size();
 }
 
@@ -96,8 +191,21 @@ void Scene::build_mesh_accels(const std::vector<std::string>& accel_filenames) {
         tri_offset += mesh.triangle_count();
     }
 
-    if (cpu_buffers_) build_mesh_accels(build_cpu_, accel_filenames, new_mesh_adapter_cpu, load_accel_cpu, store_accel_cpu);
-    if (gpu_buffers_) build_mesh_accels(build_gpu_, accel_filenames, new_mesh_adapter_gpu, load_accel_gpu, store_accel_gpu);
+    if (cpu_buffers_) {
+        if (cpu_layout_ == CpuNodeLayout::MBVH8)
+            build_mesh_accels(build_cpu8_, accel_filenames, mesh_accel_desc_cpu8(fast_mesh_accels_), new_mesh_adapter_cpu8, load_accel_cpu8, store_accel_cpu8, relocate_accel_cpu8);
+        else if (cpu_layout_ == CpuNodeLayout::QMBVH4) {
+            build_mesh_accels(build_cpu4q_, accel_filenames, mesh_accel_desc_cpu4q(fast_mesh_accels_), new_mesh_adapter_cpu4q, load_accel_cpu4q, store_accel_cpu4q, relocate_accel_cpu4q);
+
+            const size_t node_count = build_cpu4q_.nodes.size();
+            const float quantized_mb = node_count * sizeof(traversal_native::QNode4) / (1024.0f * 1024.0f);
+            const float full_mb = node_count * sizeof(traversal_cpu::Node) / (1024.0f * 1024.0f);
+            std::cout << "Quantized nodes: " << quantized_mb << " MB instead of " << full_mb << " MB ("
+                      << 100.0f * (1.0f - quantized_mb / full_mb) << "% saved)" << std::endl;
+        } else
+            build_mesh_accels(build_cpu_, accel_filenames, mesh_accel_desc_cpu(fast_mesh_accels_), new_mesh_adapter_cpu, load_accel_cpu, store_accel_cpu, relocate_accel_cpu);
+    }
+    if (gpu_buffers_) build_mesh_accels(build_gpu_, accel_filenames, mesh_accel_desc_gpu(fast_mesh_accels_), new_mesh_adapter_gpu, load_accel_gpu, store_accel_gpu, relocate_accel_gpu);
 }
 
 template <typename Node, typename NewAdapterFn>
@@ -105,14 +213,22 @@ void Scene::build_top_level_accel(BuildAccelData<Node>& build_data, NewAdapterFn
     assert(!build_data.layout.empty() && instances_.size() > 0);
 
     build_data.top_nodes.clear();
-    instance_nodes_.clear();
+    build_data.instance_nodes.clear();
 
-    auto adapter = new_adapter(build_data.top_nodes, instance_nodes_);
+    auto adapter = new_adapter(build_data.top_nodes, build_data.instance_nodes);
+    adapter->set_optimization_budget(bvh_optimization_budget_);
     adapter->build_accel(meshes_, instances_, build_data.layout, build_data.node_count);
+
+    // Refitting a tree that has just been built only computes its cost
+    build_data.top_level_cost = adapter->refit_accel(meshes_, instances_, build_data.node_count);
 }
 
 void Scene::build_top_level_accel() {
-    if (cpu_buffers_) build_top_level_accel(build_cpu_, new_top_level_adapter_cpu);
+    if (cpu_buffers_) {
+        if      (cpu_layout_ == CpuNodeLayout::MBVH8)  build_top_level_accel(build_cpu8_,  new_top_level_adapter_cpu8);
+        else if (cpu_layout_ == CpuNodeLayout::QMBVH4) build_top_level_accel(build_cpu4q_, new_top_level_adapter_cpu4q);
+        else                                           build_top_level_accel(build_cpu_,   new_top_level_adapter_cpu);
+    }
     if (gpu_buffers_) build_top_level_accel(build_gpu_, new_top_level_adapter_gpu);
 }
 
@@ -130,7 +246,11 @@ void Scene::upload_mask_buffer(TraversalData<Node>& traversal_data, anydsl::Plat
 }
 
 void Scene::upload_mask_buffer(const MaskBuffer& masks) {
-    if (cpu_buffers_) upload_mask_buffer(traversal_cpu_, anydsl::Platform::Host, masks);
+    if (cpu_buffers_) {
+        if      (cpu_layout_ == CpuNodeLayout::MBVH8)  upload_mask_buffer(traversal_cpu8_,  anydsl::Platform::Host, masks);
+        else if (cpu_layout_ == CpuNodeLayout::QMBVH4) upload_mask_buffer(traversal_cpu4q_, anydsl::Platform::Host, masks);
+        else                                           upload_mask_buffer(traversal_cpu_,   anydsl::Platform::Host, masks);
+    }
     if (gpu_buffers_) upload_mask_buffer(traversal_gpu_, anydsl::Platform::Cuda, masks);
 }
 
@@ -157,7 +277,11 @@ void Scene::upload_mesh_accels(BuildAccelData<Node>& build_data, TraversalData<N
 void Scene::upload_mesh_accels() {
     setup_traversal_buffers();
 
-    if (cpu_buffers_) upload_mesh_accels(build_cpu_, traversal_cpu_);
+    if (cpu_buffers_) {
+        if      (cpu_layout_ == CpuNodeLayout::MBVH8)  upload_mesh_accels(build_cpu8_,  traversal_cpu8_);
+        else if (cpu_layout_ == CpuNodeLayout::QMBVH4) upload_mesh_accels(build_cpu4q_, traversal_cpu4q_);
+        else                                           upload_mesh_accels(build_cpu_,   traversal_cpu_);
+    }
     if (gpu_buffers_) upload_mesh_accels(build_gpu_, traversal_gpu_);
 
     std::vector<Vec2>().swap(texcoord_buf_);
@@ -169,22 +293,53 @@ void Scene::upload_top_level_accel(BuildAccelData<Node>& build_data, TraversalDa
     anydsl_copy(0, build_data.top_nodes.data(), 0,
                 traversal_data.nodes.device(), traversal_data.nodes.data(), sizeof(Node) * build_data.node_count,
                 sizeof(Node) * build_data.top_nodes.size());
-    anydsl_copy(0, instance_nodes_.data(), 0,
+    anydsl_copy(0, build_data.instance_nodes.data(), 0,
                 traversal_data.instances.device(), traversal_data.instances.data(), 0,
-                sizeof(InstanceNode) * instance_nodes_.size());
+                sizeof(InstanceNode) * build_data.instance_nodes.size());
     traversal_data.root = build_data.node_count;
 
-    // Keep the layout, as it is necessary to rebuild the top level
-    std::vector<Node>().swap(build_data.top_nodes);
+    // Keep the layout and the top-level nodes, as they are necessary to update the top level
 }
 
 void Scene::upload_top_level_accel() {
     setup_traversal_buffers();
 
-    if (cpu_buffers_) upload_top_level_accel(build_cpu_, traversal_cpu_);
+    if (cpu_buffers_) {
+        if      (cpu_layout_ == CpuNodeLayout::MBVH8)  upload_top_level_accel(build_cpu8_,  traversal_cpu8_);
+        else if (cpu_layout_ == CpuNodeLayout::QMBVH4) upload_top_level_accel(build_cpu4q_, traversal_cpu4q_);
+        else                                           upload_top_level_accel(build_cpu_,   traversal_cpu_);
+    }
     if (gpu_buffers_) upload_top_level_accel(build_gpu_, traversal_gpu_);
+}
+
+template <typename Node, typename NewAdapterFn>
+void Scene::update_top_level_accel(BuildAccelData<Node>& build_data, TraversalData<Node>& traversal_data,
+                                   NewAdapterFn new_adapter, float rebuild_threshold) {
+    auto adapter = new_adapter(build_data.top_nodes, build_data.instance_nodes);
+    const float cost = adapter->refit_accel(meshes_, instances_, build_data.node_count);
+    if (cost > build_data.top_level_cost * rebuild_threshold)
+        build_top_level_accel(build_data, new_adapter);
+
+    // The number of nodes is bounded by the number of instances, so the buffers are large enough
+    upload_top_level_accel(build_data, traversal_data);
+}
+
+void Scene::update_top_level_accel(float rebuild_threshold) {
+    if (cpu_buffers_) {
+        if      (cpu_layout_ == CpuNodeLayout::MBVH8)  update_top_level_accel(build_cpu8_,  traversal_cpu8_,  new_top_level_adapter_cpu8,  rebuild_threshold);
+        else if (cpu_layout_ == CpuNodeLayout::QMBVH4) update_top_level_accel(build_cpu4q_, traversal_cpu4q_, new_top_level_adapter_cpu4q, rebuild_threshold);
+        else                                           update_top_level_accel(build_cpu_,   traversal_cpu_,   new_top_level_adapter_cpu,   rebuild_threshold);
+    }
+    if (gpu_buffers_) update_top_level_accel(build_gpu_, traversal_gpu_, new_top_level_adapter_gpu, rebuild_threshold);
+
+    compute_bounding_sphere();
+}
 
-    std::vector<InstanceNode>().swap(instance_nodes_);
+void Scene::print_cpu_traversal_stats() const {
+    const uint64_t rays = cpu_traversal_stats_.rays;
+    const double seconds = cpu_traversal_stats_.time_ns * 1e-9;
+    std::cout << "CPU traversal: " << rays << " rays, "
+              << (seconds > 0 ? rays / seconds * 1e-6 : 0.0) << " Mrays/s per thread" << std::endl;
 }
 
 void Scene::compute_bounding_sphere() {
@@ -1,6 +1,9 @@
 #ifndef IMBA_SCENE_H
 #define IMBA_SCENE_H
 
+#include <atomic>
+#include <chrono>
+
 #include "imbatracer/render/materials/materials.h"
 #include "imbatracer/render/light.h"
 #include "imbatracer/render/scheduling/ray_queue.h"
@@ -8,6 +11,8 @@
 #include "imbatracer/core/mesh.h"
 #include "imbatracer/core/mask.h"
 
+#include "imbatracer/loaders/accel_cache.h"
+
 namespace imba {
 
 /// Mesh attributes used by the scene.
@@ -19,6 +24,20 @@ struct MeshAttributes {
     };
 };
 
+/// Node layouts of the acceleration structures for the CPU traversal.
+enum class CpuNodeLayout {
+    MBVH4,  ///< 4-wide nodes, traversed by the traversal library
+    MBVH8,  ///< 8-wide nodes, traversed by the native traversal routines
+    QMBVH4  ///< 4-wide nodes with quantized bounds, traversed by the native traversal routines
+};
+
+/// Implementations of the CPU traversal for 4-wide nodes. The other layouts are always traversed by the native routines.
+enum class CpuTraversal {
+    LIBRARY,  ///< Traversal library
+    NATIVE,   ///< Native traversal routines
+    VALIDATE  ///< Both, the results are compared and those of the library are used
+};
+
 using LightContainer = std::vector<std::unique_ptr<Light>>;
 using TextureContainer = std::vector<std::unique_ptr<TextureSampler>>;
 using MaterialContainer = std::vector<std::unique_ptr<Material>>;
@@ -31,13 +50,51 @@ public:
     Scene(bool cpu_buffers = false, bool gpu_buffers = true)
         : cpu_buffers_(cpu_buffers)
         , gpu_buffers_(gpu_buffers)
+        , fast_mesh_accels_(false)
+        , bvh_optimization_budget_(0.0f)
+        , cpu_layout_(CpuNodeLayout::MBVH4)
     {
+        set_cpu_traversal(CpuTraversal::LIBRARY);
         if (!cpu_buffers && !gpu_buffers) {
             std::cout << "Neither CPU nor GPU traversal was enabled!" << std::endl;
             exit(0);
         }
     }
 
+    /// Selects the fast binned BVH builder for the meshes, instead of the SBVH builder.
+    /// Acceleration structures built that way are not stored in the cache files.
+    void set_fast_mesh_accels(bool fast) { fast_mesh_accels_ = fast; }
+
+    /// Spends up to the given time (in milliseconds) reducing the cost of every acceleration structure after it is built.
+    /// Optimized mesh acceleration structures are stored in the cache separately from the others.
+    void set_bvh_optimization_budget(float ms) { bvh_optimization_budget_ = ms; }
+
+    /// Selects the node layout used for the CPU traversal. Must be called before the acceleration structures are built.
+    void set_cpu_node_layout(CpuNodeLayout layout) { cpu_layout_ = layout; }
+    CpuNodeLayout cpu_node_layout() const { return cpu_layout_; }
+
+    /// Selects the implementation of the CPU traversal, for the 4-wide nodes.
+    void set_cpu_traversal(CpuTraversal traversal) {
+        switch (traversal) {
+            case CpuTraversal::LIBRARY:
+                intersect_cpu_ = traversal_cpu::intersect_cpu_masked_instanced;
+                occluded_cpu_  = traversal_cpu::occluded_cpu_masked_instanced;
+                break;
+            case CpuTraversal::NATIVE:
+                intersect_cpu_ = traversal_native::intersect_cpu_masked_instanced;
+                occluded_cpu_  = traversal_native::occluded_cpu_masked_instanced;
+                break;
+            case CpuTraversal::VALIDATE:
+                intersect_cpu_ = traversal_native::validate_intersect_cpu_masked_instanced;
+                occluded_cpu_  = traversal_native::validate_occluded_cpu_masked_instanced;
+                break;
+        }
+    }
+
+    /// Enables an automatic cache for the mesh acceleration structures, in the given directory.
+    /// It is used for all the meshes that have no explicit acceleration structure file.
+    void set_accel_cache(const std::string& dir, uint64_t max_size) { accel_cache_.reset(new AccelCache(dir, max_size)); }
+
     /// Builds an acceleration structure for every mesh in the scene.
     void build_mesh_accels(const std::vector<std::string>& accel_filenames);
     /// Builds a top-level acceleration structure.
@@ -52,6 +109,14 @@ public:
     /// The top-level acceleration structure must have been built before this call.
     void upload_top_level_accel();
 
+    /// Changes the transformation of an instance. The change is visible to the traversal after update_top_level_accel().
+    void set_instance_transform(int i, const float4x4& mat) { instances_[i] = Mesh::Instance(instances_[i].id, mat); }
+    /// Updates the top-level acceleration structure after instances have moved, and uploads it in place.
+    /// The tree is refitted, unless its SAH cost exceeds the cost it had when it was built by more than the given factor,
+    /// in which case it is rebuilt. Both costs are relative to the area of the root, so that a scene that only grows
+    /// does not trigger a rebuild. The lights are not moved with the instances.
+    void update_top_level_accel(float rebuild_threshold = 1.5f);
+
     /// Computes the bounding sphere of the scene.
     void compute_bounding_sphere();
 
@@ -71,7 +136,30 @@ public:
 #undef CONTAINER_ACCESSORS
 
     const TraversalData<traversal_gpu::Node>& traversal_data_gpu() const { assert(gpu_buffers_); return traversal_gpu_; }
-    const TraversalData<traversal_cpu::Node>& traversal_data_cpu() const { assert(cpu_buffers_); return traversal_cpu_; }
+    const TraversalData<traversal_cpu::Node>& traversal_data_cpu() const { assert(cpu_buffers_ && cpu_layout_ == CpuNodeLayout::MBVH4); return traversal_cpu_; }
+    const TraversalData<traversal_native::Node8>& traversal_data_cpu8() const { assert(cpu_buffers_ && cpu_layout_ == CpuNodeLayout::MBVH8); return traversal_cpu8_; }
+    const TraversalData<traversal_native::QNode4>& traversal_data_cpu4q() const { assert(cpu_buffers_ && cpu_layout_ == CpuNodeLayout::QMBVH4); return traversal_cpu4q_; }
+
+    /// Traverses the rays of a queue on the CPU, with the acceleration structure of the selected node layout.
+    template <typename StateType>
+    void traverse_cpu(RayQueue<StateType>& q) const {
+        TraversalTimer timer(cpu_traversal_stats_, q.size());
+        if      (cpu_layout_ == CpuNodeLayout::MBVH8)  q.traverse_cpu(traversal_cpu8_,  traversal_native::intersect_cpu8_masked_instanced);
+        else if (cpu_layout_ == CpuNodeLayout::QMBVH4) q.traverse_cpu(traversal_cpu4q_, traversal_native::intersect_cpu4q_masked_instanced);
+        else                                           q.traverse_cpu(traversal_cpu_,   intersect_cpu_);
+    }
+
+    /// Traverses the shadow rays of a queue on the CPU, with the acceleration structure of the selected node layout.
+    template <typename StateType>
+    void traverse_occluded_cpu(RayQueue<StateType>& q) const {
+        TraversalTimer timer(cpu_traversal_stats_, q.size());
+        if      (cpu_layout_ == CpuNodeLayout::MBVH8)  q.traverse_occluded_cpu(traversal_cpu8_,  traversal_native::occluded_cpu8_masked_instanced);
+        else if (cpu_layout_ == CpuNodeLayout::QMBVH4) q.traverse_occluded_cpu(traversal_cpu4q_, traversal_native::occluded_cpu4q_masked_instanced);
+        else                                           q.traverse_occluded_cpu(traversal_cpu_,   occluded_cpu_);
+    }
+
+    /// Prints the number of rays traversed on the CPU, and the number of rays traversed per second by each thread.
+    void print_cpu_traversal_stats() const;
 
     bool has_gpu_buffers() const { return gpu_buffers_; }
     bool has_cpu_buffers() const { return cpu_buffers_; }
@@ -91,30 +179,62 @@ public:
     }
 
 private:
+    struct TraversalStats {
+        std::atomic<uint64_t> rays;
+        std::atomic<uint64_t> time_ns;
+        TraversalStats() : rays(0), time_ns(0) {}
+    };
+
+    /// Measures the time spent in a call to the CPU traversal.
+    struct TraversalTimer {
+        TraversalStats& stats;
+        std::chrono::high_resolution_clock::time_point start;
+
+        TraversalTimer(TraversalStats& stats, int ray_count)
+            : stats(stats), start(std::chrono::high_resolution_clock::now())
+        {
+            stats.rays += ray_count;
+        }
+        ~TraversalTimer() {
+            stats.time_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+        }
+    };
+
     template <typename Node>
     struct BuildAccelData {
         std::vector<Node> top_nodes;
         std::vector<Node> nodes;
         std::vector<Vec4> tris;
         std::vector<int>  layout;
+        std::vector<InstanceNode> instance_nodes;
         int node_count;
+        float top_level_cost; ///< SAH cost of the top-level acceleration structure when it was built, relative to the area of its root
     };
 
     bool cpu_buffers_;
     bool gpu_buffers_;
+    bool fast_mesh_accels_;
+    float bvh_optimization_budget_;
+    CpuNodeLayout cpu_layout_;
+    CpuTraversalFn<traversal_cpu::Node> intersect_cpu_;
+    CpuTraversalFn<traversal_cpu::Node> occluded_cpu_;
+    std::unique_ptr<AccelCache> accel_cache_;
+    mutable TraversalStats cpu_traversal_stats_;
 
     template <typename Node>
     void setup_traversal_buffers(BuildAccelData<Node>&, TraversalData<Node>&, anydsl::Platform);
     template <typename Node, typename NewAdapterFn>
     void build_top_level_accel(BuildAccelData<Node>&, NewAdapterFn);
-    template <typename Node, typename NewAdapterFn, typename LoadAccelFn, typename StoreAccelFn>
-    void build_mesh_accels(BuildAccelData<Node>&, const std::vector<std::string>&, NewAdapterFn, LoadAccelFn, StoreAccelFn);
+    template <typename Node, typename NewAdapterFn, typename LoadAccelFn, typename StoreAccelFn, typename RelocateAccelFn>
+    void build_mesh_accels(BuildAccelData<Node>&, const std::vector<std::string>&, const std::string&, NewAdapterFn, LoadAccelFn, StoreAccelFn, RelocateAccelFn);
     template <typename Node>
     void upload_mask_buffer(TraversalData<Node>&, anydsl::Platform, const MaskBuffer&);
     template <typename Node>
     void upload_mesh_accels(BuildAccelData<Node>&, TraversalData<Node>&);
     template <typename Node>
     void upload_top_level_accel(BuildAccelData<Node>&, TraversalData<Node>&);
+    template <typename Node, typename NewAdapterFn>
+    void update_top_level_accel(BuildAccelData<Node>&, TraversalData<Node>&, NewAdapterFn, float);
 
     void setup_traversal_buffers();
 
@@ -126,14 +246,17 @@ private:
 
     TraversalData<traversal_gpu::Node> traversal_gpu_;
     TraversalData<traversal_cpu::Node> traversal_cpu_;
+    TraversalData<traversal_native::Node8> traversal_cpu8_;
+    TraversalData<traversal_native::QNode4> traversal_cpu4q_;
 
     BuildAccelData<traversal_gpu::Node> build_gpu_;
     BuildAccelData<traversal_cpu::Node> build_cpu_;
+    BuildAccelData<traversal_native::Node8> build_cpu8_;
+    BuildAccelData<traversal_native::QNode4> build_cpu4q_;
 
     std::vector<Vec2> texcoord_buf_;
     std::vector<int>  index_buf_;
     std::vector<int>  tri_layout_;
-    std::vector<InstanceNode> instance_nodes_;
 
     BSphere sphere_;
 
@@ -7,8 +7,9 @@
 #include <tbb/tbb.h>
 #include <tbb/task_group.h>
 
-#include <condition_variable>
-#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 namespace imba {
 
@@ -126,6 +127,12 @@ public:
         queue_flags_[ref.index()] = new_tag;
     }
 
+    /// Enables sorting the rays into a coherent order before traversal, for queues with at least min_size rays.
+    void set_reordering(int min_size) {
+        for (auto q : queues_)
+            q->set_reordering(min_size);
+    }
+
     /// Checks if there are still any non-empty queues left.
     bool has_nonempty() const { return nonempty_count_ > 0; }
 
@@ -141,8 +148,8 @@ private:
 };
 
 /// Uses a fixed number of queues, and multiple shading threads.
-/// Traversal runs in the main thread and some other optimizations have been made for the GPU traversal.
-/// Thus, the QueueScheduler should never be used with the CPU traversal.
+/// With the GPU traversal, traversal runs in the main thread. With the CPU traversal,
+/// all queues that are ready for traversal are traversed concurrently by worker tasks.
 template <typename StateType, typename ShadowStateType>
 class QueueScheduler : public RayScheduler<StateType, ShadowStateType> {
     using BaseType = RayScheduler<StateType, ShadowStateType>;
@@ -152,6 +159,7 @@ class QueueScheduler : public RayScheduler<StateType, ShadowStateType> {
 
     static constexpr int DEFAULT_QUEUE_SIZE = 1 << 16;
     static constexpr int DEFAULT_QUEUE_COUNT = 12;
+    static constexpr int SHADOW_QUEUE_COUNT = 4;
 
 protected:
     using BaseType::scene_;
@@ -160,7 +168,6 @@ protected:
 public:
     QueueScheduler(RayGen<StateType>& ray_gen,
                    Scene& scene,
-                   int max_shadow_rays_per_hit,
                    bool gpu_traversal = true,
                    float regen_threshold = 0.75f,
                    int queue_size = DEFAULT_QUEUE_SIZE,
@@ -168,79 +175,66 @@ public:
         : BaseType(scene, gpu_traversal)
         , ray_gen_(ray_gen)
         , primary_queue_pool_(queue_size, queue_count, gpu_traversal)
-        , shadow_queue_pool_(queue_size * max_shadow_rays_per_hit, 2 * queue_count / 3 + 1, gpu_traversal)
+        , shadow_stream_(queue_size, SHADOW_QUEUE_COUNT, gpu_traversal)
         , regen_threshold_(regen_threshold)
     {}
 
     ~QueueScheduler() noexcept(true) {}
 
-    void run_iteration(AtomicImage& out,
+    /// Enables sorting the primary rays into a coherent order before traversal, for queues with at least min_size rays.
+    void set_reordering(int min_size) { primary_queue_pool_.set_reordering(min_size); }
+
+    void run_iteration(ThreadLocalImage& out,
                        ProcessShadowFn process_shadow_rays, ProcessPrimaryFn process_primary_rays,
                        SamplePixelFn sample_fn) override final {
         ray_gen_.start_frame();
 
+        // Shadow rays are traversed and processed by the shading thread that fills up a shadow queue.
+        shadow_stream_.set_process_fn([this, &out, process_shadow_rays] (RayQueue<ShadowStateType>& q_shadow) {
+            if (gpu_traversal)
+                q_shadow.traverse_occluded_gpu(scene_.traversal_data_gpu());
+            else
+                scene_.traverse_occluded_cpu(q_shadow);
+
+            process_shadow_rays(q_shadow, out);
+        });
+
         done_processing_ = 0;
         while (!ray_gen_.is_empty() ||
-               primary_queue_pool_.nonempty_count() ||
-               shadow_queue_pool_.nonempty_count()) {
+               primary_queue_pool_.nonempty_count()) {
             bool idle = true;
 
-            // Traverse a shadow queue and process it in parallel
-            auto q_shadow = shadow_queue_pool_.claim_queue_with_tag(QUEUE_READY_FOR_TRAVERSAL);
-            if (q_shadow) {
+            // Traverse a primary ray queue
+            auto q_primary = primary_queue_pool_.claim_queue_with_tag(QUEUE_READY_FOR_TRAVERSAL);
+            if (q_primary && gpu_traversal) {
                 idle = false;
-
-                if (gpu_traversal)
-                    q_shadow->traverse_occluded_gpu(scene_.traversal_data_gpu());
-                else
-                    q_shadow->traverse_occluded_cpu(scene_.traversal_data_cpu());
-
-                shading_tasks_.run([this, process_shadow_rays, q_shadow, &out] {
-                    process_shadow_rays(*q_shadow, out);
-                    shadow_queue_pool_.return_queue(q_shadow, QUEUE_EMPTY);
-
-                    // Notify the scheduler that one shadow queue has been processed
-                    {
-                        std::lock_guard<std::mutex> lock(mutex_);
+                q_primary->traverse_gpu(scene_.traversal_data_gpu());
+            } else if (q_primary) {
+                // Traverse all queues that are ready in parallel, they are returned for shading once done.
+                idle = false;
+                do {
+                    tasks_.run([this, q_primary] () {
+                        scene_.traverse_cpu(*q_primary);
+                        primary_queue_pool_.return_queue(q_primary, QUEUE_READY_FOR_SHADING);
                         done_processing_++;
-                    }
-                    cv_.notify_all();
-                });
+                    });
+                } while ((q_primary = primary_queue_pool_.claim_queue_with_tag(QUEUE_READY_FOR_TRAVERSAL)));
             }
 
-            // Traverse a primary ray queue
-            auto q_primary = primary_queue_pool_.claim_queue_with_tag(QUEUE_READY_FOR_TRAVERSAL);
-            if (q_primary) {
-                idle = false;
-                if (gpu_traversal)
-                    q_primary->traverse_gpu(scene_.traversal_data_gpu());
-                else
-                    q_primary->traverse_cpu(scene_.traversal_data_cpu());
-            } else {
+            if (!q_primary)
                 q_primary = primary_queue_pool_.claim_queue_with_tag(QUEUE_READY_FOR_SHADING);
-            }
 
-            // Try to shade a queue of rays
-            auto q_shadow_out = shadow_queue_pool_.claim_queue_with_tag(QUEUE_EMPTY);
-            if (q_primary && q_shadow_out) {
+            // Shade a queue of rays
+            if (q_primary) {
                 idle = false;
-                shading_tasks_.run([this, process_primary_rays, &out, q_primary, q_shadow_out] () {
-                    process_primary_rays(*q_primary, *q_shadow_out, out);
+                tasks_.run([this, process_primary_rays, &out, q_primary] () {
+                    process_primary_rays(*q_primary, shadow_stream_, out);
 
                     primary_queue_pool_.return_queue(q_primary, QUEUE_READY_FOR_TRAVERSAL);
-                    shadow_queue_pool_.return_queue(q_shadow_out, QUEUE_READY_FOR_TRAVERSAL);
 
                     // Notify the scheduler that one primary queue has been processed
-                    {
-                        std::lock_guard<std::mutex> lock(mutex_);
-                        done_processing_++;
-                    }
-                    cv_.notify_all();
+                    done_processing_++;
                 });
-            } else {
-                // We cannot shade the rays in the queue, so we postpone them for the next iteration
-                if (q_primary)    primary_queue_pool_.return_queue(q_primary, QUEUE_READY_FOR_SHADING);
-                if (q_shadow_out) shadow_queue_pool_.return_queue(q_shadow_out, QUEUE_EMPTY);
             }
 
             // Try to generate rays in empty queues
@@ -263,27 +257,43 @@ public:
                 primary_queue_pool_.return_queue(q_regen, QUEUE_READY_FOR_TRAVERSAL);
             }
 
-            // If nothing happened this iteration, wait for the next shading task
-            if (idle) {
-                std::unique_lock<std::mutex> lock(mutex_);
-                while (done_processing_ <= 0) cv_.wait(lock);
-                done_processing_--;
-            }
+            // If nothing happened this iteration, wait for the next traversal or shading task
+            if (idle)
+                wait_done();
         }
 
-        shading_tasks_.wait();
+        tasks_.wait();
+
+        // Process the shadow rays that did not fill up a queue.
+        shadow_stream_.flush();
     }
 
 private:
     RayGen<StateType>& ray_gen_;
 
     RayQueuePool<StateType> primary_queue_pool_;
-    RayQueuePool<ShadowStateType> shadow_queue_pool_;
-    tbb::task_group shading_tasks_;
-
-    std::condition_variable cv_;
-    std::mutex mutex_;
-    int done_processing_;
+    RayStream<ShadowStateType> shadow_stream_;
+    tbb::task_group tasks_;
+
+    // Number of traversal and shading tasks that finished since the scheduler last checked.
+    std::atomic<int> done_processing_;
+
+    /// Waits until a traversal or shading task has finished. The thread yields first, then sleeps
+    /// for short periods, so that it does not keep a core busy while the tasks are running.
+    void wait_done() {
+        int spins = 0;
+        int done = done_processing_;
+        while (done <= 0 || !done_processing_.compare_exchange_weak(done, done - 1)) {
+            if (done > 0) continue;
+            if (spins < 64) {
+                std::this_thread::yield();
+                spins++;
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+            done = done_processing_;
+        }
+    }
 
     float regen_threshold_;
 };
@@ -8,15 +8,24 @@
 #include <atomic>
 #include <mutex>
 #include <memory>
+#include <numeric>
 
 #include <tbb/parallel_sort.h>
+#include <tbb/parallel_for.h>
 #include <anydsl_runtime.hpp>
 
 #include "imbatracer/core/traversal_interface.h"
+#include "imbatracer/core/traversal_native.h"
+#include "imbatracer/core/counting_sort.h"
+#include "imbatracer/core/bbox.h"
 #include "imbatracer/render/random.h"
 
 namespace imba {
 
+/// Signature of the CPU traversal routines, for a given node layout.
+template <typename Node>
+using CpuTraversalFn = void (*)(int, Node*, InstanceNode*, Vec4*, Ray*, Hit*, int*, Vec2*, TransparencyMask*, char*, int);
+
 /// State associated with a ray.
 struct RayState {
     union {
@@ -70,6 +79,7 @@ public:
         , sorted_indices_ (align(capacity))
         , last_(-1)
         , gpu_buffers_(gpu_buffers)
+        , reorder_min_size_(0)
     {
         memset(ray_buffer_.data(), 0, sizeof(Ray) * align(capacity));
 
@@ -89,6 +99,10 @@ public:
         , state_buffer_(std::move(rhs.state_buffer_))
         , sorted_indices_(std::move(rhs.sorted_indices_))
         , last_(rhs.last_.load())
+        , tmp_ray_buffer_(std::move(rhs.tmp_ray_buffer_))
+        , tmp_hit_buffer_(std::move(rhs.tmp_hit_buffer_))
+        , tmp_state_buffer_(std::move(rhs.tmp_state_buffer_))
+        , reorder_min_size_(rhs.reorder_min_size_)
     {}
 
     RayQueue& operator= (RayQueue<StateType>&& rhs) {
@@ -97,6 +111,10 @@ public:
         state_buffer_ = std::move(rhs.state_buffer_);
         sorted_indices_ = std::move(rhs.sorted_indices_);
         last_ = rhs.last_.load();
+        tmp_ray_buffer_ = std::move(rhs.tmp_ray_buffer_);
+        tmp_hit_buffer_ = std::move(rhs.tmp_hit_buffer_);
+        tmp_state_buffer_ = std::move(rhs.tmp_state_buffer_);
+        reorder_min_size_ = rhs.reorder_min_size_;
 
         return *this;
     }
@@ -144,6 +162,27 @@ public:
         std::copy(states_begin, states_end, state_buffer_.begin() + start_idx);
     }
 
+    /// Adds as many of the given rays as fit into the queue. Thread-safe
+    ///
+    /// \param filled Set to true if this call filled the queue up. Only one call sets it until the queue is cleared.
+    /// \returns The number of rays that were added.
+    template<typename RayIter, typename StateIter>
+    int push_some(RayIter rays_begin, RayIter rays_end, StateIter states_begin, bool& filled) {
+        const int count = rays_end - rays_begin;
+        const int end_idx = last_ += count; // atomic add to last_
+        const int start_idx = end_idx - (count - 1);
+
+        const int cap = capacity();
+        filled = start_idx < cap && end_idx >= cap - 1;
+
+        const int added = std::max(0, std::min(count, cap - start_idx));
+        if (added > 0) {
+            std::copy(rays_begin, rays_begin + added, ray_buffer_.begin() + start_idx);
+            std::copy(states_begin, states_begin + added, state_buffer_.begin() + start_idx);
+        }
+        return added;
+    }
+
     // Appends the rays and state data from another queue to this queue. Hits are not copied.
     void append(const RayQueue<StateType>& other) {
         int count = other.size();
@@ -158,111 +197,124 @@ public:
     }
 
     /// Compact the queue by moving all rays that hit something (and their associated states and hits) to the front.
+    /// The relative order of the rays that hit something, and of those that did not, is preserved.
+    /// Resets the sorted indices. Invalidates all pointers obtained from rays(), hits(), and states().
     inline int compact_hits() {
-        auto hits   = this->hits();
-        auto states = this->states();
-        auto rays   = this->rays();
-
-        int last_empty = -1;
-        for (int i = 0; i < size(); ++i) {
-            if (hits[i].tri_id < 0 && last_empty == -1) {
-                last_empty = i;
-            } else if (hits[i].tri_id >= 0 && last_empty != -1) {
-                std::swap(hits[last_empty],   hits[i]);
-                std::swap(states[last_empty], states[i]);
-                std::swap(rays[last_empty],   rays[i]);
-                last_empty++;
+        const int count = size();
+        alloc_scratch_buffers();
+
+        const int hit_count = count_blocks(count, [this] (int i) { return hit_buffer_[i].tri_id >= 0; });
+
+        // Scatter the hits to the front and the misses behind them, and reset the sorted indices in the same pass.
+        tbb::parallel_for(tbb::blocked_range<int>(0, block_offsets_.size() - 1),
+            [&] (const tbb::blocked_range<int>& range)
+        {
+            for (auto b = range.begin(); b != range.end(); ++b) {
+                const int begin = b * BLOCK_SIZE;
+                const int end   = std::min(count, begin + BLOCK_SIZE);
+                int hit_pos  = block_offsets_[b];
+                int miss_pos = hit_count + begin - block_offsets_[b];
+                for (int i = begin; i < end; ++i) {
+                    const int dst = hit_buffer_[i].tri_id >= 0 ? hit_pos++ : miss_pos++;
+                    tmp_ray_buffer_[dst]   = ray_buffer_[i];
+                    tmp_hit_buffer_[dst]   = hit_buffer_[i];
+                    tmp_state_buffer_[dst] = state_buffer_[i];
+                    sorted_indices_[i] = i;
+                }
             }
-        }
+        });
 
-        for (int i = 0; i <= last_; ++i)
-            sorted_indices_[i] = i;
+        std::swap(ray_buffer_, tmp_ray_buffer_);
+        std::swap(hit_buffer_, tmp_hit_buffer_);
+        std::swap(state_buffer_, tmp_state_buffer_);
 
-        if (last_empty != -1)
-            return last_empty;
-        else
-            return size();
+        return hit_count;
     }
 
-    /// Compacts the queue by moving all continued rays to the front. Does not move the hits.
+    /// Compacts the queue by moving all continued rays to the front, preserving their relative order. Does not move the hits.
+    /// Invalidates all pointers obtained from rays() and states().
     inline void compact_rays() {
-        auto states = this->states();
-        auto rays   = this->rays();
-
-        int last_empty = -1;
-        for (int i = 0; i < size(); ++i) {
-            if (states[i].pixel_id < 0 && last_empty == -1) {
-                last_empty = i;
-            } else if (states[i].pixel_id >= 0 && last_empty != -1) {
-                states[last_empty] = states[i];
-                rays[last_empty]   = rays[i];
-                last_empty++;
+        const int count = size();
+        alloc_scratch_buffers();
+
+        const int ray_count = count_blocks(count, [this] (int i) { return state_buffer_[i].pixel_id >= 0; });
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, block_offsets_.size() - 1),
+            [&] (const tbb::blocked_range<int>& range)
+        {
+            for (auto b = range.begin(); b != range.end(); ++b) {
+                const int begin = b * BLOCK_SIZE;
+                const int end   = std::min(count, begin + BLOCK_SIZE);
+                int pos = block_offsets_[b];
+                for (int i = begin; i < end; ++i) {
+                    if (state_buffer_[i].pixel_id < 0) continue;
+                    tmp_ray_buffer_[pos]   = ray_buffer_[i];
+                    tmp_state_buffer_[pos] = state_buffer_[i];
+                    pos++;
+                }
             }
-        }
+        });
+
+        std::swap(ray_buffer_, tmp_ray_buffer_);
+        std::swap(state_buffer_, tmp_state_buffer_);
 
-        // If at least one empty ray was replaced, shrink the queue.
-        // last_empty corresponds to the new queue size.
-        if (last_empty != -1)
-            shrink(last_empty);
+        shrink(ray_count);
     }
 
+    /// Enables sorting the rays by direction octant and origin before they are traversed on the CPU.
+    /// Only queues that contain at least min_size rays are sorted. A size of zero disables the sorting.
+    void set_reordering(int min_size) { reorder_min_size_ = min_size; }
+
     typedef std::function<int (const Hit&)> GetMatIDFn;
+    typedef std::function<int (const Hit&)> GetSortKeyFn;
 
-    inline void sort_by_material(GetMatIDFn get_mat_id, int num_mats, int count) {
-        if (matcount_.size() < num_mats)
-            matcount_ = std::vector<std::atomic<int> >(num_mats);
-        std::fill(matcount_.begin(), matcount_.end(), 0);
+    /// Sorts the first count hits by their material, such that ray(i), hit(i), and state(i) access them in sorted order.
+    /// Hits with the same material keep their relative order, unless a secondary key is given (for example a
+    /// texture or triangle id), in which case they are additionally sorted by that key within every material.
+    inline void sort_by_material(GetMatIDFn get_mat_id, int num_mats, int count, GetSortKeyFn get_sort_key = nullptr) {
+        mat_sort_.sort(count, num_mats, [&] (int i) { return get_mat_id(hit_buffer_[i]); }, sorted_indices_.data());
+
+        if (!get_sort_key)
+            return;
+
+        if (sort_keys_.size() < size_t(count))
+            sort_keys_.resize(count);
 
-        // Count the number of hit points per material.
         tbb::parallel_for(tbb::blocked_range<int>(0, count),
             [&] (const tbb::blocked_range<int>& range)
         {
-            for (auto i = range.begin(); i != range.end(); ++i) {
-                const int mat_id = get_mat_id(hit_buffer_[i]);
-                ray_buffer_[i].dir.w = int_as_float(mat_id);
-                matcount_[mat_id]++;
-            }
+            for (auto i = range.begin(); i != range.end(); ++i)
+                sort_keys_[i] = get_sort_key(hit_buffer_[i]);
         });
 
-        // Compute the starting index of every bin.
-        int accum = 0;
-        for (int i = 0; i < num_mats; ++i) {
-            const int tmp = matcount_[i];
-            matcount_[i] = accum;
-            accum += tmp;
-        }
+        // Sort the bins independently. Ties are broken by the index, to keep the result deterministic.
+        auto less = [this] (int a, int b) {
+            return sort_keys_[a] < sort_keys_[b] || (sort_keys_[a] == sort_keys_[b] && a < b);
+        };
 
-        // Distribute the indices according to their material ids.
-        tbb::parallel_for(tbb::blocked_range<int>(0, count),
+        tbb::parallel_for(tbb::blocked_range<int>(0, num_mats),
             [&] (const tbb::blocked_range<int>& range)
         {
-            for (auto i = range.begin(); i != range.end(); ++i) {
-                const int mat = float_as_int(ray_buffer_[i].dir.w);
-                sorted_indices_[matcount_[mat]++] = i;
+            for (auto m = range.begin(); m != range.end(); ++m) {
+                auto begin = sorted_indices_.begin() + mat_sort_.bin_begin(m);
+                auto end   = sorted_indices_.begin() + mat_sort_.bin_begin(m + 1);
+                if (end - begin > PARALLEL_SORT_THRESHOLD)
+                    tbb::parallel_sort(begin, end, less);
+                else
+                    std::sort(begin, end, less);
             }
         });
     }
 
-    /// Traverses all rays currently in the queue on the CPU.
-    void traverse_cpu(const TraversalData<traversal_cpu::Node>& c_data) {
+    /// Traverses all rays currently in the queue on the CPU, with the given traversal routine.
+    template <typename Node>
+    void traverse_cpu(const TraversalData<Node>& c_data, CpuTraversalFn<Node> intersect) {
         assert(size() != 0);
 
-        int count = align_cpu(size());
-        auto& data = const_cast<TraversalData<traversal_cpu::Node>&>(c_data);
-        auto nodes = reinterpret_cast<traversal_cpu::Node*>(data.nodes.data());
-
-        traversal_cpu::intersect_cpu_masked_instanced(
-            data.root,
-            nodes,
-            data.instances.data(),
-            data.tris.data(),
-            ray_buffer_.data(),
-            hit_buffer_.data(),
-            data.indices.data(),
-            data.texcoords.data(),
-            data.masks.data(),
-            data.mask_buffer.data(),
-            count);
+        auto& data = const_cast<TraversalData<Node>&>(c_data);
+        traverse_cpu_coherent([&] (Ray* rays, Hit* hits, int count) {
+            call_cpu(intersect, data, rays, hits, count);
+        });
     }
 
     // Traverses all rays currently in the queue on the GPU.
@@ -292,27 +344,15 @@ public:
         anydsl::copy(dev_hit_buffer_, hit_buffer_, size());
     }
 
-    /// Traverses all rays currently in the queue on the CPU. For shadow rays.
-    void traverse_occluded_cpu(const TraversalData<traversal_cpu::Node>& c_data) {
+    /// Traverses all rays currently in the queue on the CPU, with the given traversal routine. For shadow rays.
+    template <typename Node>
+    void traverse_occluded_cpu(const TraversalData<Node>& c_data, CpuTraversalFn<Node> occluded) {
         assert(size() != 0);
 
-        int count = align_cpu(size());
-        auto& data = const_cast<TraversalData<traversal_cpu::Node>&>(c_data);
-
-        auto nodes = reinterpret_cast<traversal_cpu::Node*>(data.nodes.data());
-
-        traversal_cpu::occluded_cpu_masked_instanced(
-            data.root,
-            nodes,
-            data.instances.data(),
-            data.tris.data(),
-            ray_buffer_.data(),
-            hit_buffer_.data(),
-            data.indices.data(),
-            data.texcoords.data(),
-            data.masks.data(),
-            data.mask_buffer.data(),
-            count);
+        auto& data = const_cast<TraversalData<Node>&>(c_data);
+        traverse_cpu_coherent([&] (Ray* rays, Hit* hits, int count) {
+            call_cpu(occluded, data, rays, hits, count);
+        });
     }
 
     // Traverses all rays currently in the queue on the GPU. For shadow rays.
@@ -343,6 +383,142 @@ public:
     }
 
 private:
+    template <typename Node>
+    static void call_cpu(CpuTraversalFn<Node> traverse, TraversalData<Node>& data, Ray* rays, Hit* hits, int count) {
+        traverse(
+            data.root,
+            data.nodes.data(),
+            data.instances.data(),
+            data.tris.data(),
+            rays,
+            hits,
+            data.indices.data(),
+            data.texcoords.data(),
+            data.masks.data(),
+            data.mask_buffer.data(),
+            count);
+    }
+
+    void alloc_scratch_buffers() {
+        if (tmp_state_buffer_.size() == state_buffer_.size())
+            return;
+
+        tmp_ray_buffer_   = anydsl::Array<Ray>(ray_buffer_.size());
+        tmp_hit_buffer_   = anydsl::Array<Hit>(hit_buffer_.size());
+        tmp_state_buffer_ = std::vector<StateType>(state_buffer_.size());
+
+        // The scratch buffers are swapped with the queue, so the padding rays after the last one must be valid too.
+        memset(tmp_ray_buffer_.data(), 0, sizeof(Ray) * tmp_ray_buffer_.size());
+        memset(tmp_hit_buffer_.data(), 0, sizeof(Hit) * tmp_hit_buffer_.size());
+    }
+
+    /// Splits the first count rays into blocks and computes, for every block, the number of
+    /// rays before it for which the predicate is true. Returns the total number of such rays.
+    template <typename PredFn>
+    int count_blocks(int count, PredFn pred) {
+        const int block_count = (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        block_offsets_.resize(block_count + 1);
+        block_offsets_[0] = 0;
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, block_count),
+            [&] (const tbb::blocked_range<int>& range)
+        {
+            for (auto b = range.begin(); b != range.end(); ++b) {
+                const int end = std::min(count, (b + 1) * BLOCK_SIZE);
+                int selected = 0;
+                for (int i = b * BLOCK_SIZE; i < end; ++i)
+                    selected += pred(i) ? 1 : 0;
+                block_offsets_[b + 1] = selected;
+            }
+        });
+
+        std::partial_sum(block_offsets_.begin(), block_offsets_.end(), block_offsets_.begin());
+        return block_offsets_.back();
+    }
+
+    /// Calls the given traversal function on the rays of the queue. If reordering is enabled and the queue is large
+    /// enough, the rays are first sorted into a coherent order (direction octant, then Morton code of the origin),
+    /// traversed in that order from the scratch buffers, and the hits are scattered back to the original positions.
+    template <typename TraverseFn>
+    void traverse_cpu_coherent(TraverseFn traverse) {
+        const int count = size();
+        if (reorder_min_size_ <= 0 || count < reorder_min_size_) {
+            traverse(ray_buffer_.data(), hit_buffer_.data(), align_cpu(count));
+            return;
+        }
+
+        alloc_scratch_buffers();
+        if (reorder_keys_.size() < size_t(count))
+            reorder_keys_.resize(count);
+
+        // Compute the bounds of the ray origins, used to quantize them.
+        BBox bounds = tbb::parallel_reduce(tbb::blocked_range<int>(0, count), BBox::empty(),
+            [this] (const tbb::blocked_range<int>& range, BBox bb) {
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    const Vec4& org = ray_buffer_[i].org;
+                    bb.extend(float3(org.x, org.y, org.z));
+                }
+                return bb;
+            },
+            [] (BBox a, const BBox& b) { return a.extend(b); });
+
+        const float3 extents = bounds.max - bounds.min;
+        const float3 scale(extents.x > 0.0f ? MORTON_GRID / extents.x : 0.0f,
+                           extents.y > 0.0f ? MORTON_GRID / extents.y : 0.0f,
+                           extents.z > 0.0f ? MORTON_GRID / extents.z : 0.0f);
+
+        // Build the sort keys: the upper bits hold the key (octant, then Morton code), the lower bits the index.
+        tbb::parallel_for(tbb::blocked_range<int>(0, count),
+            [&] (const tbb::blocked_range<int>& range)
+        {
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                const Ray& r = ray_buffer_[i];
+                const uint32_t octant = (r.dir.x < 0.0f ? 1 : 0) | (r.dir.y < 0.0f ? 2 : 0) | (r.dir.z < 0.0f ? 4 : 0);
+                const uint32_t x = quantize((r.org.x - bounds.min.x) * scale.x);
+                const uint32_t y = quantize((r.org.y - bounds.min.y) * scale.y);
+                const uint32_t z = quantize((r.org.z - bounds.min.z) * scale.z);
+                const uint64_t key = (octant << (3 * MORTON_BITS)) | morton_code(x, y, z);
+                reorder_keys_[i] = (key << 32) | uint64_t(i);
+            }
+        });
+
+        tbb::parallel_sort(reorder_keys_.begin(), reorder_keys_.begin() + count);
+
+        // Gather the rays in sorted order. The rays behind the end of the queue are traversed as well, copy them too.
+        const int aligned_count = align_cpu(count);
+        tbb::parallel_for(tbb::blocked_range<int>(0, aligned_count),
+            [&] (const tbb::blocked_range<int>& range)
+        {
+            for (auto i = range.begin(); i != range.end(); ++i)
+                tmp_ray_buffer_[i] = i < count ? ray_buffer_[reorder_keys_[i] & 0xFFFFFFFF] : ray_buffer_[i];
+        });
+
+        traverse(tmp_ray_buffer_.data(), tmp_hit_buffer_.data(), aligned_count);
+
+        // Map the hits back to the original order of the rays.
+        tbb::parallel_for(tbb::blocked_range<int>(0, count),
+            [&] (const tbb::blocked_range<int>& range)
+        {
+            for (auto i = range.begin(); i != range.end(); ++i)
+                hit_buffer_[reorder_keys_[i] & 0xFFFFFFFF] = tmp_hit_buffer_[i];
+        });
+    }
+
+    static uint32_t quantize(float f) {
+        return static_cast<uint32_t>(std::min(std::max(f, 0.0f), float(MORTON_GRID - 1)));
+    }
+
+    /// Interleaves the lower MORTON_BITS bits of the three coordinates.
+    static uint32_t morton_code(uint32_t x, uint32_t y, uint32_t z) {
+        uint32_t code = 0;
+        for (int i = 0; i < MORTON_BITS; ++i) {
+            code |= ((x >> i) & 1) << (3 * i + 2) |
+                    ((y >> i) & 1) << (3 * i + 1) |
+                    ((z >> i) & 1) << (3 * i);
+        }
+        return code;
+    }
+
     anydsl::Array<Ray> ray_buffer_;
     anydsl::Array<Hit> hit_buffer_;
 
@@ -354,9 +530,32 @@ private:
     std::vector<StateType> state_buffer_;
     std::atomic<int> last_;
 
+    // Number of rays per block in the parallel compaction passes.
+    static constexpr int BLOCK_SIZE = 4096;
+
+    // Scratch buffers for the compaction passes, allocated on first use.
+    anydsl::Array<Ray> tmp_ray_buffer_;
+    anydsl::Array<Hit> tmp_hit_buffer_;
+    std::vector<StateType> tmp_state_buffer_;
+
+    // Offset of the first selected ray of every block, used by the compaction passes.
+    std::vector<int> block_offsets_;
+
     // Used for sorting the hit points with counting sort
     std::vector<int> sorted_indices_;
-    std::vector<std::atomic<int> > matcount_;
+    CountingSort mat_sort_;
+
+    // Bins larger than this are sorted by the secondary key in parallel.
+    static constexpr int PARALLEL_SORT_THRESHOLD = 8192;
+    std::vector<int> sort_keys_;
+
+    // Number of bits per axis for the Morton code of the ray origins.
+    static constexpr int MORTON_BITS = 9;
+    static constexpr int MORTON_GRID = 1 << MORTON_BITS;
+
+    // Rays are only reordered in queues that contain at least that many rays (zero disables reordering).
+    int reorder_min_size_;
+    std::vector<uint64_t> reorder_keys_;
 };
 
 } // namespace imba
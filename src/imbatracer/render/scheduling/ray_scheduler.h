@@ -2,6 +2,7 @@
 #define IMBA_RAY_SCHEDULER_H
 
 #include "imbatracer/render/ray_gen/ray_gen.h"
+#include "imbatracer/render/scheduling/ray_stream.h"
 
 #include <array>
 #include <atomic>
@@ -15,8 +16,8 @@ template <typename StateType, typename ShadowStateType>
 class RayScheduler {
 protected:
     using SamplePixelFn = typename RayGen<StateType>::SamplePixelFn;
-    typedef std::function<void (RayQueue<StateType>&, RayQueue<ShadowStateType>&, AtomicImage&)> ProcessPrimaryFn;
-    typedef std::function<void (RayQueue<ShadowStateType>&, AtomicImage&)> ProcessShadowFn;
+    typedef std::function<void (RayQueue<StateType>&, RayStream<ShadowStateType>&, ThreadLocalImage&)> ProcessPrimaryFn;
+    typedef std::function<void (RayQueue<ShadowStateType>&, ThreadLocalImage&)> ProcessShadowFn;
 
 public:
     RayScheduler(Scene& scene, bool gpu_traversal)
@@ -26,7 +27,7 @@ public:
 
     virtual ~RayScheduler() {}
 
-    virtual void run_iteration(AtomicImage& out,
+    virtual void run_iteration(ThreadLocalImage& out,
                                ProcessShadowFn process_shadow_rays,
                                ProcessPrimaryFn process_primary_rays,
                                SamplePixelFn sample_fn) = 0;
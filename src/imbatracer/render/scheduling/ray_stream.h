@@ -0,0 +1,176 @@
+#ifndef IMBA_RAY_STREAM_H
+#define IMBA_RAY_STREAM_H
+
+#include "imbatracer/render/scheduling/ray_queue.h"
+
+#define NOMINMAX
+#include <tbb/tbb.h>
+
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace imba {
+
+/// A small set of fixed-size ray queues that are filled concurrently, and processed as soon as one of them is full.
+/// While the thread that filled a queue processes it, the other threads keep adding rays to the next queue.
+/// Thus, the memory required does not depend on the number of rays that are generated per hit.
+template <typename StateType>
+class RayStream {
+public:
+    /// Function that traverses and processes the rays of a full queue. The queue is cleared afterwards.
+    typedef std::function<void (RayQueue<StateType>&)> ProcessFn;
+
+    RayStream(int queue_size, int queue_count, bool gpu_buffers)
+        : queues_(queue_count)
+        , writers_(queue_count)
+        , free_(queue_count)
+    {
+        assert(queue_count >= 2);
+
+        for (int i = 0; i < queue_count; ++i) {
+            queues_[i] = new RayQueue<StateType>(queue_size, gpu_buffers);
+            writers_[i] = 0;
+            free_[i] = i != 0;
+        }
+        current_ = 0;
+    }
+
+    ~RayStream() {
+        for (auto q : queues_) delete q;
+    }
+
+    RayStream(const RayStream&) = delete;
+    RayStream& operator= (const RayStream&) = delete;
+
+    /// Sets the function that is called for every full queue, and for the remaining rays in flush().
+    void set_process_fn(ProcessFn fn) { process_fn_ = fn; }
+
+    /// Adds a single ray to the stream. Thread-safe
+    void push(const Ray& ray, const StateType& state) {
+        push(&ray, &ray + 1, &state, &state + 1);
+    }
+
+    /// Adds a set of rays to the stream. Thread-safe
+    /// If a queue becomes full, the calling thread processes it before returning.
+    template<typename RayIter, typename StateIter>
+    void push(RayIter rays_begin, RayIter rays_end, StateIter states_begin, StateIter states_end) {
+        while (rays_begin != rays_end) {
+            // Announce the write before checking that the queue is still current, so that
+            // the thread processing it can wait until all pending writes are done.
+            const int cur = current_;
+            writers_[cur]++;
+            if (current_ != cur) {
+                writers_[cur]--;
+                continue;
+            }
+
+            bool filled;
+            const int added = queues_[cur]->push_some(rays_begin, rays_end, states_begin, filled);
+            writers_[cur]--;
+
+            rays_begin   += added;
+            states_begin += added;
+
+            if (filled)
+                process_full(cur);
+            else if (added == 0)
+                std::this_thread::yield(); // Another thread filled the queue and is about to replace it.
+        }
+    }
+
+    /// Processes the rays that are left in the current queue. Must not be called concurrently with push().
+    void flush() {
+        auto& q = *queues_[current_];
+        q.shrink(std::min(q.size(), q.capacity()));
+        if (q.size() > 0)
+            process(q);
+        q.clear();
+    }
+
+private:
+    void process_full(int full) {
+        // Replace the full queue with an empty one.
+        int next;
+        while ((next = acquire_free()) < 0)
+            std::this_thread::yield();
+        current_ = next;
+
+        // Wait for the threads that might still be copying their rays into the full queue.
+        while (writers_[full] > 0)
+            std::this_thread::yield();
+
+        auto& q = *queues_[full];
+        q.shrink(q.capacity());
+        process(q);
+        q.clear();
+
+        free_[full] = true;
+    }
+
+    void process(RayQueue<StateType>& q) {
+        // Isolation prevents this thread from taking up shading work (that could push to this stream) while it waits.
+        tbb::this_task_arena::isolate([&] { process_fn_(q); });
+    }
+
+    int acquire_free() {
+        for (size_t i = 0; i < free_.size(); ++i) {
+            bool expected = true;
+            if (free_[i].compare_exchange_strong(expected, false))
+                return int(i);
+        }
+        return -1;
+    }
+
+    std::vector<RayQueue<StateType>*> queues_;
+    std::vector<std::atomic<int> > writers_;
+    std::vector<std::atomic<bool> > free_;
+    std::atomic<int> current_;
+
+    ProcessFn process_fn_;
+};
+
+/// Collects rays in a small local buffer and adds them to a shared stream in blocks, so that only
+/// one atomic operation is needed per block instead of one per ray. The slots of a block are reserved
+/// only when the block is flushed, with its exact size, so that no holes are left in the queues.
+/// Not thread-safe: every thread uses its own batch. The remaining rays are flushed on destruction.
+template <typename StateType, int N = 64>
+class RayBatch {
+public:
+    RayBatch(RayStream<StateType>& stream)
+        : stream_(stream), count_(0)
+    {}
+
+    RayBatch(const RayBatch&) = delete;
+    RayBatch& operator= (const RayBatch&) = delete;
+
+    ~RayBatch() { flush(); }
+
+    void push(const Ray& ray, const StateType& state) {
+        rays_[count_] = ray;
+        states_[count_] = state;
+        if (++count_ == N)
+            flush();
+    }
+
+    /// Adds all rays in the buffer to the stream.
+    void flush() {
+        if (count_ == 0)
+            return;
+
+        stream_.push(rays_, rays_ + count_, states_, states_ + count_);
+        count_ = 0;
+    }
+
+private:
+    RayStream<StateType>& stream_;
+
+    int count_;
+    Ray rays_[N];
+    StateType states_[N];
+};
+
+} // namespace imba
+
+#endif // IMBA_RAY_STREAM_H
@@ -2,15 +2,17 @@
 #define IMBA_TILE_SCHEDULER_H
 
 #include "imbatracer/render/scheduling/ray_scheduler.h"
+#include "imbatracer/render/scheduling/worker_pool.h"
 #include "imbatracer/render/ray_gen/tile_gen.h"
 
-#include <thread>
 #include <atomic>
 
 namespace imba {
 
-/// Launches multiple threads, each running an entire traversal-shading pipeline.
+/// Runs multiple workers on a persistent thread pool, each running an entire traversal-shading pipeline.
 /// Thus, there can be multiple calls to traversal at the same time.
+/// The shading loops of the integrators run on the same pool as the workers.
+/// In pipelined mode, every worker traverses one of its two primary queues while shading the other.
 template <typename StateType, typename ShadowStateType, bool enable_stats = true>
 class TileScheduler : public RayScheduler<StateType, ShadowStateType> {
     using BaseType = RayScheduler<StateType, ShadowStateType>;
@@ -20,6 +22,9 @@ class TileScheduler : public RayScheduler<StateType, ShadowStateType> {
 
     static constexpr int MIN_QUEUE_SIZE = 0;
 
+    // Every thread streams its shadow rays through this many queues, with a quarter of the size of a primary queue each.
+    static constexpr int SHADOW_QUEUE_COUNT = 4;
+
 protected:
     using BaseType::scene_;
     using BaseType::gpu_traversal;
@@ -27,32 +32,37 @@ protected:
 public:
     TileScheduler(TileGen<StateType>& tile_gen,
                   Scene& scene,
-                  int max_shadow_rays_per_hit,
                   int num_threads, int q_size,
-                  bool gpu_traversal)
+                  bool gpu_traversal,
+                  int worker_count = 0,
+                  bool pin_threads = false)
         : BaseType(scene, gpu_traversal)
         , tile_gen_(tile_gen)
+        , pool_(worker_count, pin_threads)
         , num_threads_(num_threads), q_size_(q_size)
-        , thread_local_prim_queues_(num_threads)
-        , thread_local_shadow_queues_(num_threads)
+        , thread_local_prim_queues_(num_threads * 2, nullptr)
+        , thread_local_shadow_streams_(num_threads)
         , thread_local_ray_gen_(num_threads)
     {
-        for (auto& q : thread_local_prim_queues_)
-            q = new RayQueue<StateType>(q_size, gpu_traversal);
+        // The second queue of every thread is only allocated when pipelining is enabled.
+        for (int i = 0; i < num_threads; ++i)
+            thread_local_prim_queues_[i * 2] = new RayQueue<StateType>(q_size, gpu_traversal);
 
-        for (auto& q : thread_local_shadow_queues_)
-            q = new RayQueue<ShadowStateType>(q_size * max_shadow_rays_per_hit, gpu_traversal);
+        for (auto& s : thread_local_shadow_streams_)
+            s = new RayStream<ShadowStateType>(std::max(1, q_size / SHADOW_QUEUE_COUNT), SHADOW_QUEUE_COUNT, gpu_traversal);
 
         for (auto& ptr : thread_local_ray_gen_)
             ptr = new uint8_t[tile_gen_.sizeof_ray_gen()];
 
         total_prim_rays_   = 0;
         total_shadow_rays_ = 0;
+        reorder_min_size_  = 0;
+        pipelined_         = false;
     }
 
     ~TileScheduler() {
         for (auto q : thread_local_prim_queues_) delete q;
-        for (auto q : thread_local_shadow_queues_) delete q;
+        for (auto s : thread_local_shadow_streams_) delete s;
 
         for (auto ptr : thread_local_ray_gen_) delete [] ptr;
 
@@ -60,22 +70,56 @@ public:
             std::cout << total_prim_rays_ << " primary ray(s), " << total_shadow_rays_ << " shadow ray(s)" << std::endl;
     }
 
-    void run_iteration(AtomicImage& image,
+    /// Enables sorting the primary rays into a coherent order before traversal, for queues with at least min_size rays.
+    void set_reordering(int min_size) {
+        reorder_min_size_ = min_size;
+        for (auto q : thread_local_prim_queues_)
+            if (q) q->set_reordering(min_size);
+    }
+
+    /// Enables overlapping the traversal of one primary queue with the shading of another one, within every worker.
+    void set_pipelining(bool enable) {
+        pipelined_ = enable;
+        if (!enable)
+            return;
+
+        for (int i = 0; i < num_threads_; ++i) {
+            auto& q = thread_local_prim_queues_[i * 2 + 1];
+            if (q) continue;
+            q = new RayQueue<StateType>(q_size_, gpu_traversal);
+            q->set_reordering(reorder_min_size_);
+        }
+    }
+
+    void run_iteration(ThreadLocalImage& image,
                        ProcessShadowFn process_shadow_rays,
                        ProcessPrimaryFn process_primary_rays,
                        SamplePixelFn sample_fn) override final {
         tile_gen_.start_frame();
 
-        std::vector<std::thread> threads;
-        for (int i = 0; i < num_threads_; ++i) {
-            threads.emplace_back([this, i, &image, process_shadow_rays, process_primary_rays, sample_fn]()
-                {
-                    render_thread(i, image, process_shadow_rays, process_primary_rays, sample_fn);
-                });
+        for (auto s : thread_local_shadow_streams_) {
+            s->set_process_fn([this, &image, process_shadow_rays] (RayQueue<ShadowStateType>& shadow_q) {
+                if (enable_stats)
+                    total_shadow_rays_ += shadow_q.size();
+
+                if (gpu_traversal)
+                    shadow_q.traverse_occluded_gpu(scene_.traversal_data_gpu());
+                else
+                    scene_.traverse_occluded_cpu(shadow_q);
+                process_shadow_rays(shadow_q, image);
+            });
         }
 
-        for (auto& t : threads)
-            t.join();
+        // Every pipeline uses the queues with its own index, independently of the thread it runs on.
+        pool_.execute([&] {
+            tbb::parallel_for(tbb::blocked_range<int>(0, num_threads_, 1),
+                [&] (const tbb::blocked_range<int>& range) {
+                    for (auto i = range.begin(); i != range.end(); ++i) {
+                        if (pipelined_) render_thread_pipelined(i, image, process_primary_rays, sample_fn);
+                        else            render_thread(i, image, process_primary_rays, sample_fn);
+                    }
+                });
+        });
     }
 
 private:
@@ -84,11 +128,13 @@ private:
 
     TileGen<StateType>& tile_gen_;
 
+    WorkerPool pool_;
+
     // Every thread has two primary queues. Thread i owns queue[i * 2] and queue[i * 2 + 1].
     std::vector<RayQueue<StateType>*> thread_local_prim_queues_;
 
-    // Every thread has one shadow queue.
-    std::vector<RayQueue<ShadowStateType>*> thread_local_shadow_queues_;
+    // Every thread has one shadow ray stream, that is traversed and processed whenever one of its queues is full.
+    std::vector<RayStream<ShadowStateType>*> thread_local_shadow_streams_;
 
     // Every thread has a ray generator.
     // To prevent reallocation every time a new tile is needed, we use a memory pool.
@@ -97,15 +143,25 @@ private:
     std::atomic<uint64_t> total_prim_rays_;
     std::atomic<uint64_t> total_shadow_rays_;
 
-    void render_thread(int thread_idx, AtomicImage& image,
-                       ProcessShadowFn process_shadow_rays,
+    int reorder_min_size_;
+    bool pipelined_;
+
+    void traverse(RayQueue<StateType>& q) {
+        if (enable_stats)
+            total_prim_rays_ += q.size();
+
+        if (gpu_traversal) q.traverse_gpu(scene_.traversal_data_gpu());
+        else               scene_.traverse_cpu(q);
+    }
+
+    void render_thread(int thread_idx, ThreadLocalImage& image,
                        ProcessPrimaryFn process_primary_rays,
                        SamplePixelFn sample_fn) {
         auto cur_tile = tile_gen_.next_tile(thread_local_ray_gen_[thread_idx]);
         while (cur_tile != nullptr) {
             // Get the ray queues for this thread.
-            auto prim_q   = thread_local_prim_queues_  [thread_idx];
-            auto shadow_q = thread_local_shadow_queues_[thread_idx];
+            auto prim_q        = thread_local_prim_queues_  [thread_idx * 2];
+            auto shadow_stream = thread_local_shadow_streams_[thread_idx];
 
             // Traverse and shade until there are no more rays left.
             cur_tile->start_frame();
@@ -114,30 +170,59 @@ private:
 
                 // TODO Add regeneration again (minor performance increase)
 
-                if (enable_stats)
-                    total_prim_rays_ += prim_q->size();
+                traverse(*prim_q);
 
-                if (gpu_traversal) prim_q->traverse_gpu(scene_.traversal_data_gpu());
-                else               prim_q->traverse_cpu(scene_.traversal_data_cpu());
+                // Isolation prevents this thread from picking up another tile while it waits for the shading loop.
+                tbb::this_task_arena::isolate([&] { process_primary_rays(*prim_q, *shadow_stream, image); });
+            }
 
-                process_primary_rays(*prim_q, *shadow_q, image);
+            // Process the shadow rays that did not fill up a queue.
+            shadow_stream->flush();
 
-                if (shadow_q->size() > MIN_QUEUE_SIZE) {
-                    if (enable_stats)
-                        total_shadow_rays_ += shadow_q->size();
+            // We are using the same memory for the new ray generation, so we
+            // have to delete the old one first!
+            cur_tile.reset(nullptr);
+            cur_tile = tile_gen_.next_tile(thread_local_ray_gen_[thread_idx]);
+        }
+    }
 
-                    if (gpu_traversal)
-                        shadow_q->traverse_occluded_gpu(scene_.traversal_data_gpu());
-                    else
-                        shadow_q->traverse_occluded_cpu(scene_.traversal_data_cpu());
-                    process_shadow_rays(*shadow_q, image);
-                }
+    void render_thread_pipelined(int thread_idx, ThreadLocalImage& image,
+                                 ProcessPrimaryFn process_primary_rays,
+                                 SamplePixelFn sample_fn) {
+        auto cur_tile = tile_gen_.next_tile(thread_local_ray_gen_[thread_idx]);
+        while (cur_tile != nullptr) {
+            // Queue a is shaded while queue b is filled and traversed, then they switch roles.
+            auto q_a           = thread_local_prim_queues_  [thread_idx * 2];
+            auto q_b           = thread_local_prim_queues_  [thread_idx * 2 + 1];
+            auto shadow_stream = thread_local_shadow_streams_[thread_idx];
+
+            cur_tile->start_frame();
+            cur_tile->fill_queue(*q_a, sample_fn);
+            traverse(*q_a);
+
+            while (!cur_tile->is_empty() || q_a->size() > MIN_QUEUE_SIZE || q_b->size() > MIN_QUEUE_SIZE) {
+                // Only this task accesses the tile, shading writes the continuation rays back to queue a.
+                // The whole step is isolated, so that waiting for the traversal cannot pick up another tile.
+                tbb::this_task_arena::isolate([&] {
+                    tbb::task_group traversal;
+                    traversal.run([&] {
+                        cur_tile->fill_queue(*q_b, sample_fn);
+                        if (q_b->size() > 0)
+                            traverse(*q_b);
+                    });
+
+                    if (q_a->size() > 0)
+                        process_primary_rays(*q_a, *shadow_stream, image);
+
+                    traversal.wait();
+                });
 
-                shadow_q->clear();
+                // The continuation rays in queue a are traversed during the next step.
+                std::swap(q_a, q_b);
             }
 
-            // We are using the same memory for the new ray generation, so we
-            // have to delete the old one first!
+            shadow_stream->flush();
+
             cur_tile.reset(nullptr);
             cur_tile = tile_gen_.next_tile(thread_local_ray_gen_[thread_idx]);
         }
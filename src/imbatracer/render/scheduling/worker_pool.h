@@ -0,0 +1,108 @@
+#ifndef IMBA_WORKER_POOL_H
+#define IMBA_WORKER_POOL_H
+
+#define NOMINMAX
+#include <tbb/tbb.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+
+namespace imba {
+
+/// Persistent set of worker threads, backed by a TBB task arena.
+/// All parallel loops that are started from within execute() run on the threads of this pool,
+/// so nested loops do not oversubscribe the machine and no threads are created per frame.
+class WorkerPool {
+public:
+    /// Creates a pool with the given number of threads (zero or less selects the number of hardware threads).
+    /// If requested, every thread that joins the pool is pinned to a fixed core.
+    WorkerPool(int concurrency = 0, bool pin_threads = false)
+        : arena_(concurrency > 0 ? concurrency : tbb::task_arena::automatic)
+    {
+        arena_.initialize();
+        if (pin_threads)
+            pinning_.reset(new PinningObserver(arena_));
+    }
+
+    ~WorkerPool() {
+        // The observer has to be disabled before the arena is destroyed.
+        pinning_.reset(nullptr);
+    }
+
+    /// Runs the given function on the threads of this pool and waits for it to finish.
+    template <typename F>
+    void execute(const F& f) { arena_.execute(f); }
+
+    /// Returns the maximum number of threads that work in this pool at the same time.
+    int concurrency() { return arena_.max_concurrency(); }
+
+private:
+    /// Pins every thread entering the arena to the core corresponding to its slot in the arena.
+    /// The previous affinity of the thread is restored when it leaves the arena, which matters for the thread calling execute().
+    class PinningObserver : public tbb::task_scheduler_observer {
+    public:
+        PinningObserver(tbb::task_arena& arena)
+            : tbb::task_scheduler_observer(arena)
+            , core_count_(std::max(1u, std::thread::hardware_concurrency()))
+        {
+            observe(true);
+        }
+
+        ~PinningObserver() {
+            observe(false);
+        }
+
+        void on_scheduler_entry(bool) override {
+#ifdef __linux__
+            const int slot = tbb::this_task_arena::current_thread_index();
+            if (slot < 0)
+                return;
+
+            auto& saved = saved_affinity();
+            saved.valid = pthread_getaffinity_np(pthread_self(), sizeof(saved.cpu_set), &saved.cpu_set) == 0;
+
+            cpu_set_t cpu_set;
+            CPU_ZERO(&cpu_set);
+            CPU_SET(slot % core_count_, &cpu_set);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+#endif
+        }
+
+        void on_scheduler_exit(bool) override {
+#ifdef __linux__
+            auto& saved = saved_affinity();
+            if (saved.valid)
+                pthread_setaffinity_np(pthread_self(), sizeof(saved.cpu_set), &saved.cpu_set);
+            saved.valid = false;
+#endif
+        }
+
+    private:
+#ifdef __linux__
+        struct SavedAffinity {
+            bool valid;
+            cpu_set_t cpu_set;
+        };
+
+        static SavedAffinity& saved_affinity() {
+            static thread_local SavedAffinity saved = { false, cpu_set_t() };
+            return saved;
+        }
+#endif
+
+        const int core_count_;
+    };
+
+    tbb::task_arena arena_;
+    std::unique_ptr<PinningObserver> pinning_;
+};
+
+} // namespace imba
+
+#endif // IMBA_WORKER_POOL_H